@@ -1,43 +1,49 @@
 #include "stdafx.h"
 #include "AntiConvolutionalLayer.h"
+#include "ConvAutotuner.h"
+#include "InferenceContext.h"
 
 AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTX, size_t _NOUTY, size_t _NINX, size_t _NINY, size_t _kernelX, size_t _kernelY, uint32_t _strideY, uint32_t _strideX,
-	 uint32_t _outChannels, uint32_t _inChannels, actfunc_t type)
-	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX), features(_outChannels*_inChannels), inChannels(_inChannels),
-	outChannels(_outChannels), PhysicalLayer(_outChannels*_NOUTX*_NOUTY, _inChannels*_NINX*_NINY, type, MATIND{ _kernelY, _outChannels*_inChannels*_kernelX }, MATIND{ _kernelY, _outChannels*_inChannels*_kernelX },
-		MATIND{ 1,_outChannels*_inChannels }, MATIND{_kernelY, _outChannels*_inChannels*_kernelX}) {
+	 uint32_t _outChannels, uint32_t _inChannels, actfunc_t type, uint32_t _dilationY, uint32_t _dilationX, uint32_t _groups)
+	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX),
+	dilationY(_dilationY), dilationX(_dilationX), groups(_groups), features(_outChannels*_inChannels/_groups), inChannels(_inChannels),
+	outChannels(_outChannels), PhysicalLayer(_outChannels*_NOUTX*_NOUTY, _inChannels*_NINX*_NINY, type, MATIND{ _kernelY, _outChannels*_inChannels/_groups*_kernelX }, MATIND{ _kernelY, _outChannels*_inChannels/_groups*_kernelX },
+		MATIND{ 1,_outChannels*_inChannels/_groups }, MATIND{_kernelY, _outChannels*_inChannels/_groups*_kernelX}) {
 
 	init();
 }
 
 AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTX, size_t _NOUTY, size_t _NINX, size_t _NINY, size_t _kernelX, size_t _kernelY, uint32_t _strideY, uint32_t _strideX,
-	 uint32_t _outChannels, uint32_t _inChannels, actfunc_t type, CNetLayer& lower)
-	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX), features(_outChannels*_inChannels), inChannels(_inChannels),
-	outChannels(_outChannels), PhysicalLayer(_outChannels*_NOUTX*_NOUTY, type, MATIND{ _kernelY, _outChannels*_inChannels*_kernelX }, MATIND{ _kernelY, _outChannels*_inChannels*_kernelX },
-		MATIND{ 1, _outChannels*_inChannels }, MATIND{_kernelY, _outChannels*_inChannels*_kernelX }, lower) {
+	 uint32_t _outChannels, uint32_t _inChannels, actfunc_t type, CNetLayer& lower, uint32_t _dilationY, uint32_t _dilationX, uint32_t _groups)
+	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX),
+	dilationY(_dilationY), dilationX(_dilationX), groups(_groups), features(_outChannels*_inChannels/_groups), inChannels(_inChannels),
+	outChannels(_outChannels), PhysicalLayer(_outChannels*_NOUTX*_NOUTY, type, MATIND{ _kernelY, _outChannels*_inChannels/_groups*_kernelX }, MATIND{ _kernelY, _outChannels*_inChannels/_groups*_kernelX },
+		MATIND{ 1, _outChannels*_inChannels/_groups }, MATIND{_kernelY, _outChannels*_inChannels/_groups*_kernelX }, lower) {
 
 	init();
 	assertGeometry();
 }
 
 // second most convenient constructor
-AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTXY, size_t _NINXY, size_t _kernelXY, uint32_t _stride,  uint32_t _outChannels, uint32_t _inChannels, actfunc_t type)
-	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), NINX(_NINXY), NINY(_NINXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride), features(_outChannels*_inChannels), 
+AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTXY, size_t _NINXY, size_t _kernelXY, uint32_t _stride,  uint32_t _outChannels, uint32_t _inChannels, actfunc_t type, uint32_t _dilation, uint32_t _groups)
+	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), NINX(_NINXY), NINY(_NINXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride),
+	dilationY(_dilation), dilationX(_dilation), groups(_groups), features(_outChannels*_inChannels/_groups), 
 	outChannels(_outChannels), inChannels(_inChannels),
-	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, _inChannels*_NINXY*_NINXY, type, MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY }, MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY },
-		MATIND{ 1, _outChannels*_inChannels }, MATIND{ _kernelXY, _outChannels*_inChannels*_kernelXY }) {
+	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, _inChannels*_NINXY*_NINXY, type, MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY }, MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY },
+		MATIND{ 1, _outChannels*_inChannels/_groups }, MATIND{ _kernelXY, _outChannels*_inChannels/_groups*_kernelXY }) {
 
 	init();
 	assertGeometry();
 }
 
 // most convenient constructor
-AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY, uint32_t _stride, uint32_t _outChannels, uint32_t _inChannels, actfunc_t type, CNetLayer& lower)
-	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), NINX(sqrt(lower.getNOUT() / (_inChannels))), NINY(sqrt(lower.getNOUT() / (_inChannels))), kernelX(_kernelXY), kernelY(_kernelXY),
-	strideY(_stride), strideX(_stride), features(_outChannels*_inChannels), outChannels(_outChannels), inChannels(_inChannels),
-	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, type, MATIND{ _kernelXY, _outChannels*_inChannels*_kernelXY }, MATIND{ _kernelXY, _outChannels*_inChannels*_kernelXY },
-		MATIND{ 1,_outChannels*_inChannels }, MATIND{_kernelXY, _outChannels*_inChannels*_kernelXY }, lower) {
+AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY, uint32_t _stride, uint32_t _outChannels, uint32_t _inChannels, actfunc_t type, CNetLayer& lower, uint32_t _dilation, uint32_t _groups)
+	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), kernelX(_kernelXY), kernelY(_kernelXY),
+	strideY(_stride), strideX(_stride), dilationY(_dilation), dilationX(_dilation), groups(_groups), features(_outChannels*_inChannels/_groups), outChannels(_outChannels), inChannels(_inChannels),
+	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, type, MATIND{ _kernelXY, _outChannels*_inChannels/_groups*_kernelXY }, MATIND{ _kernelXY, _outChannels*_inChannels/_groups*_kernelXY },
+		MATIND{ 1,_outChannels*_inChannels/_groups }, MATIND{_kernelXY, _outChannels*_inChannels/_groups*_kernelXY }, lower) {
 
+	lower.outputPlanes(inChannels, NINY, NINX); // planes of the layer below, squares if it has none
 	init();
 	assertGeometry();
 }
@@ -45,20 +51,90 @@ AntiConvolutionalLayer::AntiConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY,
 // destructor
 AntiConvolutionalLayer::~AntiConvolutionalLayer() {}
 
+bool AntiConvolutionalLayer::planeShape(size_t& planeY, size_t& planeX) const {
+	planeY = NOUTY;
+	planeX = NOUTX;
+	return true;
+}
+
 layer_t AntiConvolutionalLayer::whoAmI() const {
 	return layer_t::antiConvolutional;
 }
+CNetLayer* AntiConvolutionalLayer::replicate() const {
+	AntiConvolutionalLayer* replica = new AntiConvolutionalLayer(*this);
+	replica->setAlgorithm(algorithm, gradAlgorithm); // drops the copied FFT plans and spectra
+	return replica;
+}
 
 void AntiConvolutionalLayer::assertGeometry() {
 	assert(outChannels*NOUTX*NOUTY == getNOUT());
 	assert(inChannels*NINX*NINY == getNIN());
-	assert(antiConvoSize(NINY, kernelY, antiConvPad(NINY, strideY, kernelY, NOUTY), strideY) == NOUTY);
-	assert(antiConvoSize(NINX, kernelX, antiConvPad(NINX, strideX, kernelX, NOUTX), strideX) == NOUTX);
+	assert(dilationX > 0 && dilationY > 0);
+	assert(groups > 0 && inChannels % groups == 0 && outChannels % groups == 0);
+	// a dilated kernel pads like a dense kernel of its extent
+	assert(antiConvoSize(NINY, dilatedSize(kernelY, dilationY), antiConvPad(NINY, strideY, dilatedSize(kernelY, dilationY), NOUTY), strideY) == NOUTY);
+	assert(antiConvoSize(NINX, dilatedSize(kernelX, dilationX), antiConvPad(NINX, strideX, dilatedSize(kernelX, dilationX), NOUTX), strideX) == NOUTX);
 }
 void AntiConvolutionalLayer::init() {
 	W.unaryExpr(&abs<fREAL>); // make evrythng positive
-	padY = antiConvPad(getNINY(), strideY, kernelY, getNOUTY());
-	padX = antiConvPad(getNINX(), strideX, kernelX, getNOUTX());
+	padY = antiConvPad(getNINY(), strideY, dilatedSize(kernelY, dilationY), getNOUTY());
+	padX = antiConvPad(getNINX(), strideX, dilatedSize(kernelX, dilationX), getNOUTX());
+	selectAlgorithm();
+}
+// The direct loops run over the smaller input plane. Large dense, ungrouped stride-1 kernels use the FFT engine.
+void AntiConvolutionalLayer::selectAlgorithm() {
+	bool unitStride = strideY == 1 && strideX == 1 && dilationY == 1 && dilationX == 1 && groups == 1;
+	setAlgorithm(unitStride && fftConvCheaper(NINY, NINX, kernelY, kernelX, outChannels, inChannels, false) ? convalgo_t::fftConv : convalgo_t::directConv,
+		unitStride && fftConvCheaper(NINY, NINX, kernelY, kernelX, outChannels, inChannels, true) ? convalgo_t::fftConv : convalgo_t::directConv);
+}
+// Transposed convolutions run on the direct loops or the FFT engine - other paths fall back to the direct loops.
+bool AntiConvolutionalLayer::algorithmSupported(convalgo_t _algorithm, bool kernelGradient) const {
+	return (_algorithm == convalgo_t::directConv || _algorithm == convalgo_t::fftConv)
+		&& convAlgorithmSupported(_algorithm, kernelGradient, kernelY, kernelX, strideY, strideX, dilationY, dilationX, groups);
+}
+void AntiConvolutionalLayer::setAlgorithm(convalgo_t _algorithm, convalgo_t _gradAlgorithm) {
+	algorithm = algorithmSupported(_algorithm, false) ? _algorithm : convalgo_t::directConv;
+	gradAlgorithm = algorithmSupported(_gradAlgorithm, true) ? _gradAlgorithm : convalgo_t::directConv;
+	directKernel = selectConvKernel(kernelY, kernelX, strideY, strideX);
+	fftEngine.clearCache();
+}
+string AntiConvolutionalLayer::tuneKey() const {
+	return "antiConv|" + to_string(NOUTY) + "x" + to_string(NOUTX) + "|" + to_string(NINY) + "x" + to_string(NINX) + "|k" + to_string(kernelY) + "x" + to_string(kernelX)
+		+ "|s" + to_string(strideY) + "x" + to_string(strideX) + "|d" + to_string(dilationY) + "x" + to_string(dilationX) + "|c" + to_string(outChannels) + "x" + to_string(inChannels) + "|g" + to_string(groups);
+}
+/* Time one training step of the transposed convolutions (forward, delta unless this is the input layer, kernel gradient)
+*  on random tensors of this geometry for every supported pair of paths and keep the fastest. The bound state is not touched.
+*/
+void AntiConvolutionalLayer::tune(size_t repetitions) {
+	MAT input = MAT::Random(getNIN(), 1);
+	MAT delta = MAT::Random(getNOUT(), 1);
+	MAT preAct(getNOUT(), 1);
+	MAT out(getNOUT(), 1);
+	MAT deltaBelow(getNIN(), 1);
+	MAT grad(kernelY, kernelX*features);
+	bool withDelta = getHierachy() != hierarchy_t::input;
+	convalgo_t bestAlgorithm = algorithm;
+	convalgo_t bestGradAlgorithm = gradAlgorithm;
+	double best = -1;
+	for (int a = convalgo_t::directConv; a <= convalgo_t::fftConv; ++a) {
+		for (int g = convalgo_t::directConv; g <= convalgo_t::fftConv; ++g) {
+			if (!algorithmSupported(convalgo_t(a), false) || !algorithmSupported(convalgo_t(g), true))
+				continue;
+			setAlgorithm(convalgo_t(a), convalgo_t(g));
+			double time = bestTime([&]() {
+				forwardConv(input, 0, out.data(), ConvEpilogue(b, act, &preAct));
+				if (withDelta)
+					deltaConv(delta, 0, deltaBelow.data());
+				kernelGrad(input, delta, 0, grad, false);
+			}, repetitions);
+			if (best < 0 || time < best) {
+				best = time;
+				bestAlgorithm = convalgo_t(a);
+				bestGradAlgorithm = convalgo_t(g);
+			}
+		}
+	}
+	setAlgorithm(bestAlgorithm, bestGradAlgorithm);
 }
 
 /* Weight Normalization Functions
@@ -163,36 +239,52 @@ uint32_t AntiConvolutionalLayer::getOutChannels() const {
 
 void AntiConvolutionalLayer::forProp(MAT& inBelow, bool training, bool recursive) {
 
-	// (1) Reshape the remaining input
-	inBelow.resize(getNINY(), inChannels*getNINX());
-	inBelow = antiConv_(inBelow, W, getNOUTY(), getNOUTX(), strideY, strideX, padY, padX, features, outChannels, inChannels); // square convolution//
-	inBelow.resize(getNOUT(), 1);
-	inBelow += b; // add bias term
-
-	if (training) {
-		actSave = inBelow;
-		inBelow = move(getACT());
-		if (recursive && getHierachy() != hierarchy_t::output) {
-			above->forProp(inBelow, true, true);
-		}
-	} else {
-		inBelow = inBelow.unaryExpr(act);
+	// (1) Deconvolve a tensor view of each sample - the result is a flat (NOUT,B) tensor.
+	// Bias and activation are applied by the kernel (ConvEpilogue), which keeps the pre-activation in actSave when training.
+	size_t samples = inBelow.cols();
+	if (training)
+		actSave().resize(getNOUT(), samples);
+	MAT out = takeBuffer(getNOUT(), samples);
+	for (size_t s = 0; s < samples; ++s) {
+		forwardConv(inBelow, s, out.col(s).data(), ConvEpilogue(bias(), act, training ? &actSave() : nullptr, s));
+	}
+	passOn(inBelow, out);
 
-		if (recursive && getHierachy() != hierarchy_t::output)
-			above->forProp(inBelow, false, true);
+	if (recursive && getHierachy() != hierarchy_t::output)
+		above->forProp(inBelow, training, true);
+}
+void AntiConvolutionalLayer::infer(MAT& in, InferenceContext& context, size_t layer) const {
+	FFTConvolution& fft = context.scratch(layer).fftEngine;
+	MAT out(getNOUT(), in.cols());
+	for (size_t s = 0; s < in.cols(); ++s) {
+		forwardConv(in, s, out.col(s).data(), ConvEpilogue(bias(), act, nullptr), fft);
+	}
+	in = move(out);
+}
+// Dispatch the transposed convolution on a tensor view of one sample of the flat input.
+void AntiConvolutionalLayer::forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue) {
+	forwardConv(input, sample, result, epilogue, fftEngine);
+}
+void AntiConvolutionalLayer::forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue, FFTConvolution& fft) const {
+	if (algorithm == convalgo_t::fftConv) {
+		fft.antiConv(tensorView(input, getNINY(), getNINX(), inChannels, sample), weights(), result, getNOUTY(), getNOUTX(), padY, padX, features, outChannels, inChannels, epilogue);
+	} else {
+		antiConv_(tensorView(input, getNINY(), getNINX(), inChannels, sample), weights(), result, getNOUTY(), getNOUTX(), strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups, epilogue);
 	}
 }
 // backprop
 void AntiConvolutionalLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
 		
-	deltaAbove = deltaAbove.cwiseProduct(getDACT());
-	deltaSave = deltaAbove;
+	deltaAbove.array() *= actSave().unaryExpr(dact).array();
+	deltaSave() = deltaAbove;
 
 	if (getHierachy() != hierarchy_t::input) { // ... this is not an input layer.
 		
-		deltaAbove.resize(getNOUTY(), outChannels*getNOUTX()); // keep track of this!!!
-		deltaAbove = conv_(deltaAbove, W, getNINY(), getNINX(), strideY, strideX, padY, padX, features, inChannels, outChannels);
-		deltaAbove.resize(getNIN(), 1);
+		MAT deltaBelow = takeBuffer(getNIN(), deltaAbove.cols());
+		for (size_t s = 0; s < deltaAbove.cols(); ++s) {
+			deltaConv(deltaAbove, s, deltaBelow.col(s).data());
+		}
+		passOn(deltaAbove, deltaBelow);
 
 		if (recursive) {
 			below->backPropDelta(deltaAbove, true); // cascade...
@@ -200,41 +292,51 @@ void AntiConvolutionalLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
 	}
 }
 
+// Dispatch the delta propagation of one sample - a convolution with the layer's kernel.
+void AntiConvolutionalLayer::deltaConv(const MAT& delta, size_t sample, fREAL* result) {
+	if (algorithm == convalgo_t::fftConv) {
+		fftEngine.conv(tensorView(delta, getNOUTY(), getNOUTX(), outChannels, sample), weights(), result, getNINY(), getNINX(), padY, padX, features, inChannels, outChannels);
+	} else {
+		directKernel(tensorView(delta, getNOUTY(), getNOUTX(), outChannels, sample), weights(), result, getNINY(), getNINX(), strideY, strideX, dilationY, dilationX, padY, padX, features, inChannels, outChannels, groups, ConvEpilogue());
+	}
+}
+
 void AntiConvolutionalLayer::constrainToMax(MAT & mues, MAT & maxVec){
 	//b = -mues;
 	//W = W / maxVec.maxCoeff();
 }
 
-// grad
+// grad, summed over the samples
 MAT AntiConvolutionalLayer::w_grad(MAT& input) {
-	deltaSave.resize(NOUTY, outChannels*NOUTX);
-
-	if (getHierachy() == hierarchy_t::input) {
-	
-		input.resize(getNINY(), getNINX()*inChannels);
-		MAT convoluted = antiConvGrad_(deltaSave, input, kernelY, kernelX, strideY, strideX, padY, padX, features, outChannels, inChannels);
-
-		deltaSave.resize(getNOUT(), 1); // make sure to resize to NOUT-sideChannels
-										// Leave the dimensionality of input intact
-		input.resize(getNIN(), 1);
-
-		return convoluted;
+	MAT act;
+	if (getHierachy() != hierarchy_t::input)
+		takeBelowACT(act);
+	const MAT& fromBelow = getHierachy() == hierarchy_t::input ? input : act;
+	MAT grad = takeBuffer(kernelY, kernelX*features);
+	for (size_t s = 0; s < deltaSave().cols(); ++s) {
+		kernelGrad(fromBelow, deltaSave(), s, grad, s > 0);
+	}
+	giveBuffer(act);
+	return grad;
+}
+// Dispatch the gradient kernel on tensor views of one sample of delta and the flat input - into grad, or onto it if accumulate is set.
+void AntiConvolutionalLayer::kernelGrad(const MAT& input, const MAT& delta, size_t sample, MAT& grad, bool accumulate) {
+	if (gradAlgorithm == convalgo_t::fftConv) {
+		fftEngine.antiConvGrad(tensorView(delta, NOUTY, NOUTX, outChannels, sample), tensorView(input, getNINY(), getNINX(), inChannels, sample), grad, accumulate,
+			kernelY, kernelX, padY, padX, features, outChannels, inChannels);
 	} else {
-		MAT fromBelow = below->getACT();
-		fromBelow.resize(getNINY(), getNINX()*inChannels);
-
-		MAT convoluted = antiConvGrad_(deltaSave, fromBelow, kernelY, kernelX, strideY, strideX, padY, padX, features, outChannels, inChannels);
-
-		deltaSave.resize(getNOUT(), 1);  // make sure to resize to NOUT-sideChannels
-		return convoluted;
+		antiConvGrad_(tensorView(delta, NOUTY, NOUTX, outChannels, sample), tensorView(input, getNINY(), getNINX(), inChannels, sample), grad, accumulate,
+			kernelY, kernelX, strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups);
 	}
 }
 // b_grad
 MAT AntiConvolutionalLayer::b_grad() {
-	return deltaSave;
+	MAT grad = takeBuffer(getNOUT(), 1);
+	grad.noalias() = deltaSave().rowwise().sum();
+	return grad;
 }
 void AntiConvolutionalLayer::saveToFile(ostream& os) const {
-	os << NOUTY << " " << NOUTX << " " << NINY << " " << NINX << " " << kernelY << " " << kernelX << " " << strideY << " " << strideX << " " << outChannels << " " << inChannels << endl;
+	os << NOUTY << " " << NOUTX << " " << NINY << " " << NINX << " " << kernelY << " " << kernelX << " " << strideY << " " << strideX << " " << outChannels << " " << inChannels << " " << dilationY << " " << dilationX << " " << groups << endl;
 	os << spectralNormMode << " " << weightNormMode << endl;
 
 	MAT temp = W;
@@ -263,9 +365,11 @@ void AntiConvolutionalLayer::loadFromFile(ifstream& in) {
 	in >> strideX;
 	in >> outChannels;
 	in >> inChannels;
-	features = inChannels*outChannels;
-	padY = antiConvPad(getNINY(), strideY, kernelY, getNOUTY());
-	padX = antiConvPad(getNINX(), strideX, kernelX, getNOUTX());
+	readConvOptions(in, dilationY, dilationX, groups);
+	features = inChannels*outChannels / groups;
+	padY = antiConvPad(getNINY(), strideY, dilatedSize(kernelY, dilationY), getNOUTY());
+	padX = antiConvPad(getNINX(), strideX, dilatedSize(kernelX, dilationX), getNOUTX());
+	selectAlgorithm();
 	// Load normalization settings
 	in >> spectralNormMode;
 	in >> weightNormMode;
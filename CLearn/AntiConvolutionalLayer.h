@@ -1,6 +1,7 @@
 #pragma once
 #include "defininitions.h"
 #include "PhysicalLayer.h"
+#include "FFTConvolution.h"
 #ifndef CNET_ANTICONVOLAYER
 #define CNET_ANTICONVOLAYER
 /* Deconvolution Layer
@@ -10,16 +11,18 @@
 class AntiConvolutionalLayer : public PhysicalLayer {
 public:
 	AntiConvolutionalLayer(size_t NOUTX, size_t NOUTY, size_t NINX, size_t NINY, size_t kernelX, size_t kernelY, uint32_t strideY, uint32_t strideX, 
-		 uint32_t outChannels, uint32_t inChannels, actfunc_t type);
+		 uint32_t outChannels, uint32_t inChannels, actfunc_t type, uint32_t dilationY = 1, uint32_t dilationX = 1, uint32_t groups = 1);
 	AntiConvolutionalLayer(size_t NOUTX, size_t NOUTY, size_t NINX, size_t NINY, size_t kernelX, size_t kernelY, uint32_t strideY, uint32_t strideX, 
-		 uint32_t outChannels, uint32_t inChannels, actfunc_t type, CNetLayer& lower);
-	AntiConvolutionalLayer(size_t NOUTXY, size_t NINXY, size_t kernelXY, uint32_t stride,  uint32_t outChannels, uint32_t inChannels, actfunc_t type);
-	AntiConvolutionalLayer(size_t NOUTXY, size_t kernelXY, uint32_t stride, uint32_t outChannels, uint32_t inChannels, actfunc_t type, CNetLayer& lower);
+		 uint32_t outChannels, uint32_t inChannels, actfunc_t type, CNetLayer& lower, uint32_t dilationY = 1, uint32_t dilationX = 1, uint32_t groups = 1);
+	AntiConvolutionalLayer(size_t NOUTXY, size_t NINXY, size_t kernelXY, uint32_t stride,  uint32_t outChannels, uint32_t inChannels, actfunc_t type, uint32_t dilation = 1, uint32_t groups = 1);
+	AntiConvolutionalLayer(size_t NOUTXY, size_t kernelXY, uint32_t stride, uint32_t outChannels, uint32_t inChannels, actfunc_t type, CNetLayer& lower, uint32_t dilation = 1, uint32_t groups = 1);
 	~AntiConvolutionalLayer();
 
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
 	// forProp
 	void forProp(MAT& in, bool training, bool recursive);
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	MAT w_grad(MAT& input);
 	MAT b_grad();
 	void backPropDelta(MAT& delta, bool recursive);
@@ -34,8 +37,19 @@ public:
 	inline size_t getNINY() const { return NINY; };
 	inline size_t getKernelX() const { return kernelX; };
 	inline size_t getKernelY() const { return kernelY; };
+	inline size_t getDilationX() const { return dilationX; };
+	inline size_t getDilationY() const { return dilationY; };
+	inline size_t getGroups() const { return groups; };
+	bool planeShape(size_t& planeY, size_t& planeX) const;
 	uint32_t getOutChannels() const ;
 
+	// Execution paths - heuristic at construction, measured by tune() (see CNet::tune)
+	void setAlgorithm(convalgo_t algorithm, convalgo_t gradAlgorithm);
+	inline convalgo_t getAlgorithm() const { return algorithm; };
+	inline convalgo_t getGradAlgorithm() const { return gradAlgorithm; };
+	string tuneKey() const;
+	void tune(size_t repetitions);
+
 private:
 	/* Weight normalization functions
 	*/ 
@@ -62,6 +76,9 @@ private:
 	size_t kernelY;
 	size_t strideY;
 	size_t strideX;
+	size_t dilationY; // spacing of the kernel taps, 1 for a dense kernel
+	size_t dilationX;
+	size_t groups; // channel groups, 1 connects every in-channel to every out-channel
 	size_t padX;
 	size_t padY;
 	size_t features;
@@ -69,6 +86,19 @@ private:
 	size_t outChannels;
 	void assertGeometry();
 
+	// Execution paths of the forward/delta convolutions and of the kernel gradient
+	convalgo_t algorithm;
+	convalgo_t gradAlgorithm;
+	CONVFUNC directKernel; // conv_ or a specialized instance for delta propagation
+	FFTConvolution fftEngine; // keeps plans and kernel spectra
+	void selectAlgorithm();
+	bool algorithmSupported(convalgo_t algorithm, bool kernelGradient) const;
+	// on sample column "sample" of a minibatch, into result (a column of the output) or onto grad
+	void forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue);
+	void forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue, FFTConvolution& fft) const; // on a given FFT engine
+	void deltaConv(const MAT& delta, size_t sample, fREAL* result);
+	void kernelGrad(const MAT& input, const MAT& delta, size_t sample, MAT& grad, bool accumulate);
+
 	// File function
 	void saveToFile(ostream& os) const;
 	void loadFromFile(ifstream& in);
@@ -2,14 +2,13 @@
 #include "BatchBuffer.h"
 
 
-BatchBuffer::BatchBuffer(MATIND _WInd, size_t _NOUT, size_t _NIN) :  NIN(_NIN), NOUT(_NOUT){
+BatchBuffer::BatchBuffer(MATIND _WInd, size_t _NOUT, size_t _NIN) : gradientCount(0), sampleCount(0), NIN(_NIN), NOUT(_NOUT) {
 	mues = MAT(_NIN, 1); // each input has an independent offset...
 	sigmas= MAT(_NIN, 1);  // ... and offset.
 	// A correctly-shaped zero-gradient.
 	nullGradient = MAT(_WInd.rows, _WInd.cols);
 	nullGradient.setZero(); 
 
-	gradientBuffer = MATVEC();
 	mues.setZero();
 	sigmas.setOnes();
 
@@ -17,44 +16,43 @@ BatchBuffer::BatchBuffer(MATIND _WInd, size_t _NOUT, size_t _NIN) :  NIN(_NIN),
 //  convenience constructur
 BatchBuffer::BatchBuffer(size_t _NOUT, size_t _NIN) : BatchBuffer(MATIND{ 0,0 }, _NOUT, _NIN) {
 }
-
-void BatchBuffer::swallowGradient(const MAT& grad) {
-	if(gradientBuffer.size() < MAX_SIZE)
-		gradientBuffer.push_back(grad);
+// Accumulate in place - the first gradient of a batch overwrites the sums, which keeps their storage.
+void BatchBuffer::swallowGradient(const MAT& grad, size_t samples) {
+	if (gradientCount == 0) {
+		gradientSum = grad;
+	} else {
+		gradientSum += grad;
+	}
+	++gradientCount;
+	sampleCount += samples;
 }
 // Average over mini batch
-MAT BatchBuffer::avgGradient() {
-	size_t bufferSize = gradientBuffer.size();
-	MAT grad;
-
-	if (bufferSize > 0) {
-		grad = gradientBuffer[0];
+MAT& BatchBuffer::avgGradient() {
+	if (gradientCount == 0) {
+		gradientOut = nullGradient;
 	} else {
-		return nullGradient;
+		gradientOut = gradientSum / sampleCount;
 	}
-	for (size_t i = 1; i < bufferSize; ++i) {
-		grad += gradientBuffer[i];
-	}
-	return grad / bufferSize;
+	return gradientOut;
 }
-// RMS needed for rms prop...
-MAT BatchBuffer::rmsGradient() {
-	size_t bufferSize = gradientBuffer.size();
-	MAT grad;
 
-	if (bufferSize > 0) {
-		grad = gradientBuffer[0].unaryExpr(&norm);
-	} else {
-		return nullGradient;
+void BatchBuffer::mergeGradients(BatchBuffer& other) {
+	if (other.gradientCount == 0) {
+		return;
 	}
-	for (size_t i = 1; i < bufferSize; ++i) {
-		grad += gradientBuffer[i].unaryExpr(&norm);
+	if (gradientCount == 0) {
+		gradientSum = other.gradientSum;
+	} else {
+		gradientSum += other.gradientSum;
 	}
-	return grad / bufferSize;
+	gradientCount += other.gradientCount;
+	sampleCount += other.sampleCount;
+	other.clearGradients();
 }
 
 void BatchBuffer::clearGradients() {
-	gradientBuffer.clear();
+	gradientCount = 0;
+	sampleCount = 0;
 }
 void BatchBuffer::updateBuffer(MAT& input) {
 		this->batchBuffer.push_back(input);
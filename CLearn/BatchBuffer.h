@@ -8,10 +8,13 @@ class BatchBuffer {
 public:
 	BatchBuffer(MATIND _layerInd, size_t NOUT, size_t NIN);
 	BatchBuffer(size_t NOUT, size_t NIN);
-	// Standard gradient minibatch
-	void swallowGradient(const MAT& grad);
-	MAT avgGradient();
-	MAT rmsGradient();
+	// Standard gradient minibatch - grad may already be the sum over several samples.
+	// Gradients are kept as running sums, so the memory does not grow with the batch size.
+	void swallowGradient(const MAT& grad, size_t samples = 1);
+	// Written to a buffer that keeps its storage between batches - valid until the next call
+	MAT& avgGradient();
+	// Add the running sums of another buffer (e.g. of a replica) and clear that one
+	void mergeGradients(BatchBuffer& other);
 	
 	void clearGradients();
 	// Buffer for actual inputs - if we are interested in statistics etc
@@ -20,7 +23,7 @@ public:
 	MAT batchRMS();
 	MAT batchMax();
 	MAT batchMean();
-	inline size_t stillToCome() const { return gradientBuffer.size(); }; // can't name function as variable...
+	inline size_t stillToCome() const { return gradientCount; }; // can't name function as variable...
 	inline size_t batchSize() const { return batchBuffer.size(); };
 	void clearBuffer();
 	void normalize(MAT& input) const;
@@ -28,9 +31,11 @@ public:
 private:
 	size_t stillToGo;
 	MATVEC batchBuffer; // Store input matrices over minibatch
-	MATVEC gradientBuffer;
+	MAT gradientSum; // running sum of the swallowed gradients
+	MAT gradientOut; // avgGradient
+	size_t gradientCount; // gradients swallowed since the last clearGradients
+	size_t sampleCount; // samples behind these gradients
 	MAT nullGradient;
-	const size_t MAX_SIZE = 100;
 	fREAL eps = 1e-10;
 	MAT mues; // mean
 	MAT sigmas; // standard deviations
@@ -17,17 +17,30 @@ CNetLayer(lower.getNOUT(), actfunc_t::NONE, lower) {
 
 BatchNormLayer::~BatchNormLayer() {
 }
+// The replica reads gamma, beta and the population statistics - its batch buffer and steppers start out empty
+BatchNormLayer::BatchNormLayer(const BatchNormLayer& other) : CNetLayer(other), currMean(other.currMean), currSigma(other.currSigma),
+gamma(other.gamma), beta(other.beta), buffer(other.getNOUT(), other.getNOUT()),
+gamma_stepper(MATIND{ other.getNOUT(),1 }), beta_stepper(MATIND{ other.getNOUT(),1 }) {
+}
 
 layer_t BatchNormLayer::whoAmI() const {
 	return layer_t::batchNorm;
 }
+CNetLayer* BatchNormLayer::replicate() const { return new BatchNormLayer(*this); }
+void BatchNormLayer::pullWeights(const CNetLayer& master) {
+	const BatchNormLayer& other = dynamic_cast<const BatchNormLayer&>(master);
+	gamma = other.gamma; // same size - no reallocation
+	beta = other.beta;
+	currMean = other.currMean;
+	currSigma = other.currSigma;
+}
 
 void BatchNormLayer::forProp(MAT & in, bool training, bool recursive) {
 	if (training) {
 		buffer.updateBuffer(in); // swallow this
 
 		// store the x-hats
-		actSave = in; // x^
+		actSave() = in; // x^
 		// Now transform using the internal matrices
 		in = gamma.cwiseProduct(in);
 		in += beta;
@@ -44,8 +57,15 @@ void BatchNormLayer::forProp(MAT & in, bool training, bool recursive) {
 	}
 }
 
+// Same affine map as forProp without training, applied to every sample column
+void BatchNormLayer::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const {
+	MAT scale = gamma.cwiseQuotient(currSigma);
+	in.array().colwise() *= scale.col(0).array();
+	in.colwise() += (beta - scale.cwiseProduct(currMean)).col(0);
+}
+
 void BatchNormLayer::backPropDelta(MAT & delta, bool recursive) {
-	deltaSave = delta;
+	deltaSave() = delta;
 	delta.cwiseProduct(gamma);
 	if (recursive && getHierachy() != hierarchy_t::input)
 		below->backPropDelta(delta, true);
@@ -59,6 +79,27 @@ void BatchNormLayer::normalize(MAT & in){
 	in.cwiseQuotient(currSigma);
 }
 
+void BatchNormLayer::saveToFile(ostream& os) const {
+	os << gamma << endl;
+	os << beta << endl;
+	os << currMean << endl;
+	os << currSigma << endl;
+}
+void BatchNormLayer::loadFromFile(ifstream& in) {
+	for (size_t i = 0; i < gamma.size(); ++i) {
+		in >> gamma(i, 0);
+	}
+	for (size_t i = 0; i < beta.size(); ++i) {
+		in >> beta(i, 0);
+	}
+	for (size_t i = 0; i < currMean.size(); ++i) {
+		in >> currMean(i, 0);
+	}
+	for (size_t i = 0; i < currSigma.size(); ++i) {
+		in >> currSigma(i, 0);
+	}
+}
+
 void BatchNormLayer::init(){
 	gamma.setOnes();
 	beta.setZero();
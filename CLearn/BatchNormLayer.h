@@ -21,14 +21,23 @@ public:
 
 	// type
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
+	void pullWeights(const CNetLayer& master);
 	// forProp
 	void forProp(MAT& in, bool training, bool recursive); // recursive
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	// backprop
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 	void applyUpdate(const learnPars& pars, MAT& input, bool recursive); // recursive
 
+protected:
+	// For replicate() only - see pullWeights
+	BatchNormLayer(const BatchNormLayer& other);
+
 private:
 	void normalize(MAT& in);
+	void saveToFile(ostream& os) const;
+	void loadFromFile(ifstream& in);
 
 	void init();
 	MAT currMean; // mu_B
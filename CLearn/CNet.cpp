@@ -3,18 +3,49 @@
 #include "FullyConnectedLayer.h"
 #include "ConvolutionalLayer.h"
 #include "AntiConvolutionalLayer.h"
+#include "SeparableConvolutionalLayer.h"
 #include "MaxPoolLayer.h"
 #include "PassOnLayer.h"
 #include "DropoutLayer.h"
 #include "Reshape.h"
 #include "SideChannel.h"
 #include "GaussianReparametrizationLayer.h"
+#include "ConvAutotuner.h"
+#include <chrono>
+#include <algorithm>
 
-CNet::CNet(size_t NIN) :  NIN(NIN) {
+CNet::CNet(size_t NIN) :  NIN(NIN), inputY(0), inputX(0), linked(false), linkedLayers(0), generation(0), workers(1), asynchronous(false), replicaGeneration(0), boundWorkspace(nullptr), activeArena(&arena) {
 	layers = vector<CNetLayer*>(); // to be filled with layers
 	srand(42); // constant seed
 }
 
+CNet::CNet(size_t NINY, size_t NINX, size_t channels) : NIN(NINY*NINX*channels), inputY(NINY), inputX(NINX), linked(false), linkedLayers(0), generation(0), workers(1), asynchronous(false), replicaGeneration(0), boundWorkspace(nullptr), activeArena(&arena) {
+	layers = vector<CNetLayer*>(); // to be filled with layers
+	srand(42); // constant seed
+}
+// Replicas copy every layer (but don't reseed) and are linked right away.
+CNet::CNet(const CNet& master) : NIN(master.NIN), inputY(master.inputY), inputX(master.inputX), linked(false), linkedLayers(0), generation(0), workers(1), asynchronous(false), replicaGeneration(0), boundWorkspace(nullptr), activeArena(&arena) {
+	for (CNetLayer* layer : master.layers) {
+		layers.push_back(layer->replicate());
+	}
+	linkChain();
+}
+
+/* The last layer's plane shape if it has one, the input geometry if the sizes match (layers that keep the input size), squares otherwise.
+*/
+void CNet::planesBelow(size_t channels, size_t& NINY, size_t& NINX) const {
+	size_t size = getLayerNumber() > 0 ? getLast()->getNOUT() : NIN;
+	if (getLayerNumber() > 0 && getLast()->planeShape(NINY, NINX) && NINY*NINX*channels == size)
+		return;
+	if (inputY*inputX*channels == size) {
+		NINY = inputY;
+		NINX = inputX;
+	} else {
+		NINY = sqrt(size / channels);
+		NINX = NINY;
+	}
+}
+
 void CNet::debugMsg(fREAL* msg) {
 	msg[0] = layers[0]->getNOUT();
 	msg[1] = layers[0]->getNIN();
@@ -34,29 +65,63 @@ void CNet::addFullyConnectedLayer(size_t NOUT, actfunc_t type) {
 	}
 }
 
-void CNet::addConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride,  size_t outChannels, size_t inChannels, actfunc_t type) {
-	// At the moment, I only allow for square-shaped input.
-	// this may need to change in the future.
+void CNet::addConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride,  size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation, size_t groups) {
+	addConvolutionalLayer(NOUTXY, NOUTXY, kernelXY, kernelXY, stride, stride, outChannels, inChannels, type, dilation, groups);
+}
+
+void CNet::addConvolutionalLayer(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
+	size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation, size_t groups) {
+	size_t NINY, NINX;
+	planesBelow(inChannels, NINY, NINX);
 	if (getLayerNumber() > 0) {
-		ConvolutionalLayer* cl = new ConvolutionalLayer(NOUTXY, kernelXY, stride,  outChannels, inChannels, type, *(getLast()));
+		ConvolutionalLayer* cl = new ConvolutionalLayer(NOUTX, NOUTY, NINX, NINY, kernelX, kernelY, strideY, strideX, outChannels, inChannels, type, *(getLast()), 
+			dilation, dilation, groups);
 		layers.push_back(cl);
 	} else {
 		// then it's the input layer
-		ConvolutionalLayer* cl = new ConvolutionalLayer(NOUTXY, sqrt(NIN/inChannels), kernelXY, stride,  outChannels, inChannels, type);
+		ConvolutionalLayer* cl = new ConvolutionalLayer(NOUTX, NOUTY, NINX, NINY, kernelX, kernelY, strideY, strideX, outChannels, inChannels, type, 
+			dilation, dilation, groups);
 		layers.push_back(cl);
 	}
 }
 
-void CNet::addAntiConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride,  size_t outChannels, size_t inChannels, actfunc_t type) {
+void CNet::addAntiConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride,  size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation, size_t groups) {
+	addAntiConvolutionalLayer(NOUTXY, NOUTXY, kernelXY, kernelXY, stride, stride, outChannels, inChannels, type, dilation, groups);
+}
+
+void CNet::addAntiConvolutionalLayer(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
+	size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation, size_t groups) {
+	size_t NINY, NINX;
+	planesBelow(inChannels, NINY, NINX);
 	if (getLayerNumber() > 0) {
-		AntiConvolutionalLayer* acl = new AntiConvolutionalLayer(NOUTXY, kernelXY, stride,  outChannels , inChannels, type, *(getLast()));
+		AntiConvolutionalLayer* acl = new AntiConvolutionalLayer(NOUTX, NOUTY, NINX, NINY, kernelX, kernelY, strideY, strideX, outChannels, inChannels, type, *(getLast()),
+			dilation, dilation, groups);
 		layers.push_back(acl);
 	} else {
-		AntiConvolutionalLayer* acl = new AntiConvolutionalLayer(NOUTXY, sqrt(NIN / inChannels), kernelXY, stride,  outChannels, inChannels, type);
+		AntiConvolutionalLayer* acl = new AntiConvolutionalLayer(NOUTX, NOUTY, NINX, NINY, kernelX, kernelY, strideY, strideX, outChannels, inChannels, type,
+			dilation, dilation, groups);
 		layers.push_back(acl);
 	}
 }
 
+void CNet::addSeparableConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type) {
+	addSeparableConvolutionalLayer(NOUTXY, NOUTXY, kernelXY, kernelXY, stride, stride, outChannels, inChannels, type);
+}
+
+void CNet::addSeparableConvolutionalLayer(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
+	size_t outChannels, size_t inChannels, actfunc_t type) {
+	size_t NINY, NINX;
+	planesBelow(inChannels, NINY, NINX);
+	if (getLayerNumber() > 0) {
+		SeparableConvolutionalLayer* scl = new SeparableConvolutionalLayer(NOUTX, NOUTY, NINX, NINY, kernelX, kernelY, strideY, strideX, outChannels, inChannels, type, *(getLast()));
+		layers.push_back(scl);
+	} else {
+		// then it's the input layer
+		SeparableConvolutionalLayer* scl = new SeparableConvolutionalLayer(NOUTX, NOUTY, NINX, NINY, kernelX, kernelY, strideY, strideX, outChannels, inChannels, type);
+		layers.push_back(scl);
+	}
+}
+
 void CNet::addPassOnLayer( actfunc_t type) {
 	if (getLayerNumber() > 0) {
 		PassOnLayer* pol = new PassOnLayer(type, *(getLast()));
@@ -112,13 +177,19 @@ void CNet::addDropoutLayer(fREAL ratio) {
 }
 
 void CNet::addPoolingLayer(size_t maxOverXY, size_t channels, pooling_t type) {
+	addPoolingLayer(maxOverXY, maxOverXY, channels, type);
+}
+
+void CNet::addPoolingLayer(size_t maxOverY, size_t maxOverX, size_t channels, pooling_t type) {
+	size_t NINY, NINX;
+	planesBelow(channels, NINY, NINX);
 	switch (type) {
 		case pooling_t::max:
 			if (getLayerNumber() > 0) {
-				MaxPoolLayer* mpl = new MaxPoolLayer(maxOverXY, channels, *(getLast()));
+				MaxPoolLayer* mpl = new MaxPoolLayer(NINY, NINX, maxOverY, maxOverX, channels, *(getLast()));
 				layers.push_back(mpl);
 			} else {
-				MaxPoolLayer* mpl = new MaxPoolLayer(sqrt(NIN), maxOverXY,  channels);
+				MaxPoolLayer* mpl = new MaxPoolLayer(NINY, NINX, maxOverY, maxOverX, channels);
 				layers.push_back(mpl);
 			}
 			break;
@@ -143,13 +214,58 @@ void CNet::shareLayers(CNet* const otherNet, uint32_t firstLayer, uint32_t lastL
 	for (uint32_t i = firstLayer; i <= lastLayer; ++i) {
 		if (i < otherNet->getLayerNumber()) {
 			layers.push_back(otherNet->layers[i]);
+			borrowed.push_back(otherNet->layers[i]); // otherNet deletes it
 		}
 	}
 }
+bool CNet::lendsTo(const CNet& otherNet) const {
+	for (CNetLayer* layer : otherNet.borrowed) {
+		if (std::find(layers.begin(), layers.end(), layer) != layers.end()
+			&& std::find(borrowed.begin(), borrowed.end(), layer) == borrowed.end())
+			return true;
+	}
+	return false;
+}
+void CNet::bindWorkspace(ExecutionWorkspace& workspace) {
+	boundWorkspace = &workspace;
+	activeArena = &workspace.stepArena();
+	bindLayers();
+}
+void CNet::unbindWorkspace() {
+	boundWorkspace = nullptr;
+	activeArena = &arena;
+	bindLayers();
+}
+// State and arena go together - layers shared with another net may still point at the binding of that one
+void CNet::bindLayers() {
+	if (boundWorkspace)
+		boundWorkspace->reserve(getLayerNumber());
+	for (size_t l = 0; l < getLayerNumber(); ++l) {
+		layers[l]->bindState(boundWorkspace ? &boundWorkspace->state(l) : nullptr);
+		layers[l]->bindArena(activeArena);
+	}
+}
+/* Binds a workspace for one pass and restores the binding the net had before - also if the pass throws.
+*/
+class WorkspaceScope {
+public:
+	WorkspaceScope(CNet& net, ExecutionWorkspace& workspace) : net(net), previous(net.getWorkspace()) {
+		net.bindWorkspace(workspace);
+	}
+	~WorkspaceScope() {
+		if (previous)
+			net.bindWorkspace(*previous);
+		else
+			net.unbindWorkspace();
+	}
+private:
+	CNet& net;
+	ExecutionWorkspace* previous;
+};
 /* Dynamically relinks the chain at runtime.
 */
 void CNet::linkChain(){
-	if (getLayerNumber() > 1) {
+	if (getLayerNumber() > 0) {
 		// set lowest and highest layer links
 		getFirst()->connectBelow(NULL);
 		getLast()->connectAbove(NULL);
@@ -163,14 +279,128 @@ void CNet::linkChain(){
 		// make elements reset their hierarchy
 		getFirst()->checkHierarchy(true);
 	}
+	bindLayers();
+	planStep();
+	linked = true;
+	linkedLayers = getLayerNumber();
+}
+/* Ticks follow backProp: each layer takes its output buffer and gives back the one it was handed (CNetLayer::passOn).
+*  The convolution kernels write into the arena's buffers, their own scratch (per-thread partial sums, workspaces) only grows - backProp counts that growth into the arena's misses.
+*/
+void CNet::planStep() {
+	stepPlan.clear();
+	if (getLayerNumber() == 0)
+		return;
+	size_t tick = 0;
+	// (1) Forward: the copy of the input, then the output of each layer
+	stepPlan.push_back(BufferLife{ NIN, 0, tick, tick });
+	size_t carried = 0;
+	for (size_t l = 0; l < getLayerNumber(); ++l) {
+		++tick;
+		if (!isInPlace(l)) {
+			stepPlan[carried].last = tick;
+			stepPlan.push_back(BufferLife{ layers[l]->getNOUT(), 0, tick, tick });
+			carried = stepPlan.size() - 1;
+		}
+	}
+	size_t prediction = carried;
+	// (2) Backward: the error matrix, then the delta each layer hands down
+	++tick;
+	stepPlan.push_back(BufferLife{ getNOUT(), 0, tick, tick });
+	carried = stepPlan.size() - 1;
+	for (size_t l = getLayerNumber() - 1; l > 0; --l) {
+		++tick;
+		if (!isInPlace(l)) {
+			stepPlan[carried].last = tick;
+			stepPlan.push_back(BufferLife{ layers[l]->getNIN(), 0, tick, tick });
+			carried = stepPlan.size() - 1;
+		}
+	}
+	size_t delta = carried;
+	// (3) Update: the weight gradient with the activation below, then the bias gradient
+	for (size_t l = 0; l < getLayerNumber(); ++l) {
+		if (isPhysical(l)) {
+			MATIND W = dynamic_cast<PhysicalLayer*>(layers[l])->WDimensions();
+			++tick;
+			stepPlan.push_back(BufferLife{ W.rows, W.cols, tick, tick });
+			if (l > 0)
+				stepPlan.push_back(BufferLife{ layers[l - 1]->getNOUT(), 0, tick, tick });
+			++tick;
+			stepPlan.push_back(BufferLife{ layers[l]->getNOUT(), 1, tick, tick });
+		}
+	}
+	// prediction and delta are given back at the end of the step
+	++tick;
+	stepPlan[prediction].last = tick;
+	stepPlan[delta].last = tick;
+}
+size_t CNet::getArenaMisses() const {
+	return activeArena->getMisses();
+}
+/* Layers added since the last linkChain, layers loaded from file, or a net that relinked shared layers into its own chain
+*  leave the links stale. Comparing the links costs a pointer check per layer, much less than relinking.
+*/
+bool CNet::isLinked() const {
+	if (!linked || linkedLayers != getLayerNumber())
+		return false;
+	for (size_t l = 0; l < getLayerNumber(); ++l) {
+		if (layers[l]->getBelow() != (l > 0 ? layers[l - 1] : nullptr)
+			|| layers[l]->getAbove() != (l + 1 < getLayerNumber() ? layers[l + 1] : nullptr))
+			return false;
+	}
+	return true;
+}
+void CNet::ensureLinked() {
+	if (!isLinked())
+		linkChain();
+}
+
+/* Autotuner
+*  Layers of equal geometry share one measurement. Cached decisions are applied without timing.
+*/
+size_t CNet::tune(string cacheFile, size_t repetitions) {
+	linkChain(); // tuning times the delta path only where it runs
+	ConvTuneCache cache(cacheFile);
+	size_t timed = 0;
+	convalgo_t algorithm, gradAlgorithm;
+	for (size_t i = 0; i < getLayerNumber(); ++i) {
+		if (layers[i]->whoAmI() == layer_t::convolutional) {
+			ConvolutionalLayer* layer = dynamic_cast<ConvolutionalLayer*>(layers[i]);
+			string key = layer->tuneKey() + (layer->getHierachy() == hierarchy_t::input ? "|input" : "");
+			if (cache.lookup(key, algorithm, gradAlgorithm)) {
+				layer->setAlgorithm(algorithm, gradAlgorithm);
+			} else {
+				layer->tune(repetitions);
+				cache.store(key, layer->getAlgorithm(), layer->getGradAlgorithm());
+				++timed;
+			}
+		} else if (layers[i]->whoAmI() == layer_t::antiConvolutional) {
+			AntiConvolutionalLayer* layer = dynamic_cast<AntiConvolutionalLayer*>(layers[i]);
+			string key = layer->tuneKey() + (layer->getHierachy() == hierarchy_t::input ? "|input" : "");
+			if (cache.lookup(key, algorithm, gradAlgorithm)) {
+				layer->setAlgorithm(algorithm, gradAlgorithm);
+			} else {
+				layer->tune(repetitions);
+				cache.store(key, layer->getAlgorithm(), layer->getGradAlgorithm());
+				++timed;
+			}
+		}
+	}
+	cache.save();
+	++generation; // the replicas copied the old kernel paths
+	return timed;
 }
 
 // Destructor
 CNet::~CNet() {
 	for (vector< CNetLayer* >::iterator it = layers.begin(); it != layers.end(); ++it) {
-		delete *it;
+		if (std::find(borrowed.begin(), borrowed.end(), *it) == borrowed.end())
+			delete *it;
 	}
 	layers.clear();
+	for (CNet* replica : replicas) {
+		delete replica;
+	}
 }
 
 size_t CNet::getNOUT() const {
@@ -201,6 +431,8 @@ void CNet::loadFromFile_layer(string filePath, uint32_t layerNr) {
 	ifstream file(filePath + "\\CNetLayer_" + to_string(layerNr) + ".dat");
 	if (file.is_open()) {
 		file >> (*layers[layerNr]);
+		linked = false; // the file brings its own hierarchy
+		++generation; // ... and possibly another shape
 	}
 	file.close();
 }
@@ -254,12 +486,22 @@ size_t CNet::layerDimensionError() const{
 }
 // Simply output the network
 fREAL CNet::forProp(MAT& in, const MAT& outDesired, bool saveAct) {
-
+	bindLayers();
 	// (1) Forward propagation
 	getFirst()->forProp(in, saveAct, true);
 	// (2) return the error 
 	return l2_error(l2_errorMatrix(in- outDesired));
 }
+fREAL CNet::forProp(MAT& in, const MAT& outDesired, bool saveAct, ExecutionWorkspace& workspace) {
+	WorkspaceScope scope(*this, workspace);
+	return forProp(in, outDesired, saveAct);
+}
+fREAL CNet::infer(MAT& in, const MAT& outDesired, InferenceContext& context) const {
+	context.reserve(getLayerNumber());
+	for (size_t l = 0; l < getLayerNumber(); ++l)
+		layers[l]->infer(in, context, l);
+	return l2_error(l2_errorMatrix(in - outDesired));
+}
 
 // Prefeeding function
 void CNet::preFeedSideChannel(const MAT& sideChannelInput) {
@@ -293,17 +535,21 @@ fREAL CNet::backProp(MAT& input, MAT& outDesired, const learnPars& pars, bool de
 	// ... 
 	// ...
 	
-	// (0.5) Initialize error and difference matrix
-	MAT diffMatrix;
+	// (0.5) Initialize error and difference matrix - all buffers of the step come from the arena
+	bindLayers();
+	activeArena->prepare(stepPlan, input.cols());
+	size_t kernelBuffersBefore = kernelBuffers();
 	fREAL errorOut = 0.0f;
 	
 	// (1) Propagate in forward direction (with saveActivations == true)
-	MAT outPredicted(input);
+	MAT outPredicted = activeArena->take(input.rows(), input.cols());
+	outPredicted = input;
 	getFirst()->forProp(outPredicted, true, true);
 	
 	// (2) calculate error matrix and error
+	MAT diffMatrix = activeArena->take(outDesired.rows(), outDesired.cols());
 	if (!deltaProvided)
-		diffMatrix = move(l2_errorMatrix(outPredicted - outDesired)); // delta =  estimate - target
+		diffMatrix.noalias() = outPredicted - outDesired; // delta =  estimate - target
 	else
 		diffMatrix = outDesired;
 	errorOut = l2_error(diffMatrix);
@@ -316,10 +562,204 @@ fREAL CNet::backProp(MAT& input, MAT& outDesired, const learnPars& pars, bool de
 	
 	// (5) Write predicted output to output matrix
 	outDesired = outPredicted;
+	activeArena->give(outPredicted);
+	activeArena->give(diffMatrix);
+	activeArena->countKernelBuffers(kernelBuffers() - kernelBuffersBefore);
 
 	// DONE
 	return errorOut;
 } 
+fREAL CNet::backProp(MAT& input, MAT& outDesired, const learnPars& pars, ExecutionWorkspace& workspace, bool deltaProvided) {
+	WorkspaceScope scope(*this, workspace);
+	return backProp(input, outDesired, pars, deltaProvided);
+}
+/* Data-parallel backpropagation
+*/
+fREAL CNet::backPropParallel(MAT& input, MAT& outDesired, const learnPars& pars, bool deltaProvided) {
+	size_t samples = input.cols();
+	size_t shards = std::min(workers, samples);
+	if (shards < 2)
+		return backProp(input, outDesired, pars, deltaProvided);
+
+	// (1) Every replica starts from the current weights
+	prepareReplicas(shards);
+	for (size_t r = 0; r < shards; ++r) {
+		size_t first = r*samples / shards, count = (r + 1)*samples / shards - first;
+		pullReplica(*replicas[r], first, count, samples);
+	}
+
+	// (2) Forward and backward pass of the shards - the replicas only accumulate gradients
+	learnPars shardPars = pars;
+	shardPars.batch_update = 1;
+	vector<fREAL> errors(shards);
+	int32_t n = static_cast<int32_t>(shards);
+#pragma omp parallel for num_threads(shards) schedule(static, 1)
+	for (int32_t r = 0; r < n; ++r) {
+		size_t first = r*samples / shards, count = (r + 1)*samples / shards - first;
+		MAT shardIn = input.middleCols(first, count);
+		MAT shardOut = outDesired.middleCols(first, count);
+		errors[r] = replicas[r]->backProp(shardIn, shardOut, shardPars, deltaProvided);
+		outDesired.middleCols(first, count) = shardOut; // predicted output, disjoint columns
+	}
+
+	// (3) Reduce the gradients in worker order and step
+	fREAL errorSquares = 0;
+	for (size_t r = 0; r < shards; ++r) {
+		for (size_t l = 0; l < getLayerNumber(); ++l) {
+			if (isPhysical(l))
+				dynamic_cast<PhysicalLayer*>(layers[l])->mergeGradients(*dynamic_cast<PhysicalLayer*>(replicas[r]->layers[l]));
+		}
+		errorSquares += errors[r] * errors[r];
+	}
+	learnPars stepPars = pars;
+	stepPars.accept = false; // the gradients are in already
+	getFirst()->applyUpdate(stepPars, input, true);
+
+	return sqrt(errorSquares); // each shard returned 0.5*sqrt(sum of its squares)
+}
+/* Hogwild backpropagation
+*  The replicas read the net's W and b in place (PhysicalLayer::readWeightsOf) - no copy per sample.
+*  Weight and spectral normalization are not supported (backPropCNetBatch rejects them).
+*/
+fREAL CNet::backPropHogwild(MAT& input, MAT& outDesired, const learnPars& pars, bool deltaProvided) {
+	size_t samples = input.cols();
+	size_t threads = std::max<size_t>(std::min(workers, samples), 1);
+	assert(!pars.weight_normalization && !pars.spectral_normalization);
+	prepareReplicas(threads);
+	for (size_t r = 0; r < threads; ++r) { // the gradient buffers are empty - pushStep and mergeGradients clear them
+		for (size_t l = 0; l < getLayerNumber(); ++l) {
+			if (isPhysical(l))
+				dynamic_cast<PhysicalLayer*>(replicas[r]->layers[l])->readWeightsOf(dynamic_cast<PhysicalLayer*>(layers[l]));
+		}
+	}
+
+	learnPars samplePars = pars;
+	samplePars.batch_update = 1; // the replicas accumulate, pushStep steps
+	vector<fREAL> errorSquares(threads, 0);
+	int32_t n = static_cast<int32_t>(threads);
+#pragma omp parallel for num_threads(threads) schedule(static, 1)
+	for (int32_t r = 0; r < n; ++r) {
+		CNet& replica = *replicas[r];
+		for (size_t s = r; s < samples; s += threads) {
+			feedReplica(replica, s, 1, samples);
+			MAT x = input.col(s);
+			MAT y = outDesired.col(s);
+			fREAL error = replica.backProp(x, y, samplePars, deltaProvided);
+			errorSquares[r] += error*error;
+			outDesired.col(s) = y; // predicted output, disjoint columns
+			for (size_t l = 0; l < getLayerNumber(); ++l) {
+				if (isPhysical(l))
+					dynamic_cast<PhysicalLayer*>(replica.layers[l])->pushStep(*dynamic_cast<PhysicalLayer*>(layers[l]), samplePars);
+			}
+		}
+	}
+	for (size_t r = 0; r < threads; ++r) {
+		for (size_t l = 0; l < getLayerNumber(); ++l) {
+			if (isPhysical(l))
+				dynamic_cast<PhysicalLayer*>(replicas[r]->layers[l])->readWeightsOf(nullptr);
+		}
+	}
+	fREAL sum = 0;
+	for (fREAL e : errorSquares)
+		sum += e;
+	return sqrt(sum);
+}
+/* (Re)build the replicas if the replicated layers changed since: other layers, types or shapes, a load or a tune.
+*  A relink of the same layers (switching between nets that share layers) keeps them.
+*/
+void CNet::prepareReplicas(size_t count) {
+	ensureLinked();
+	if (!replicas.empty() && !replicasCurrent()) {
+		for (CNet* replica : replicas)
+			delete replica;
+		replicas.clear();
+	}
+	replicaGeneration = generation;
+	replicaSources = layers;
+	while (replicas.size() < count)
+		replicas.push_back(new CNet(*this));
+}
+// A layer shared with another net may have been loaded or tuned through that one - the shapes are compared as well
+bool CNet::replicasCurrent() const {
+	if (replicaGeneration != generation || replicaSources != layers)
+		return false;
+	for (const CNet* replica : replicas) {
+		for (size_t l = 0; l < getLayerNumber(); ++l) {
+			const CNetLayer* copy = replica->layers[l];
+			if (copy->whoAmI() != layers[l]->whoAmI() || copy->getNIN() != layers[l]->getNIN() || copy->getNOUT() != layers[l]->getNOUT())
+				return false;
+		}
+	}
+	return true;
+}
+// A side channel input with one column per sample is split like the batch, a single column is shared.
+void CNet::pullReplica(CNet& replica, size_t first, size_t count, size_t samples) const {
+	for (size_t l = 0; l < getLayerNumber(); ++l)
+		replica.layers[l]->pullWeights(*layers[l]);
+	feedReplica(replica, first, count, samples);
+}
+void CNet::feedReplica(CNet& replica, size_t first, size_t count, size_t samples) const {
+	for (size_t l = 0; l < getLayerNumber(); ++l) {
+		if (layers[l]->whoAmI() == layer_t::sideChannel) {
+			const MAT& side = dynamic_cast<SideChannel*>(layers[l])->getSideChannelMatrix();
+			dynamic_cast<SideChannel*>(replica.layers[l])->preFeed(static_cast<size_t>(side.cols()) == samples ? MAT(side.middleCols(first, count)) : side);
+		}
+	}
+}
+/* Benchmark of the training modes
+*  The three nets start from the same weights and see the same batches. Plain descent - Hogwild takes a step per sample.
+*/
+MAT benchmarkTrainingModes(size_t NIN, size_t hidden, size_t NOUT, size_t samples, size_t batchSize, size_t workers, size_t epochs, fREAL eta) {
+	typedef std::chrono::steady_clock CLOCK;
+	batchSize = std::max<size_t>(std::min(batchSize, samples), 1);
+	MAT results(3, 2);
+	MAT X, Y;
+	vector<MAT> initialWeights;
+	for (size_t mode = 0; mode < 3; ++mode) {
+		CNet net(NIN);
+		net.addFullyConnectedLayer(hidden, actfunc_t::TANH);
+		net.addFullyConnectedLayer(hidden, actfunc_t::TANH);
+		net.addFullyConnectedLayer(NOUT, actfunc_t::NONE);
+		net.linkChain();
+		net.setWorkers(mode == 0 ? 1 : workers);
+		for (size_t l = 0; l < net.getLayerNumber(); ++l) {
+			size_t rows = 0, cols = 0;
+			net.inquireDimensions(l, rows, cols);
+			if (mode == 0) {
+				initialWeights.push_back(MAT(cols, rows)); // copyNthLayer hands out the transpose
+				net.copyNthLayer(l, initialWeights[l].data());
+			} else {
+				net.setNthLayer(l, initialWeights[l].transpose());
+			}
+		}
+		if (mode == 0) { // smooth random target
+			MAT A = MAT::Random(NOUT, NIN) / sqrt(fREAL(NIN));
+			X = MAT::Random(NIN, samples);
+			Y = (A*X).unaryExpr(&Tanh);
+		}
+		learnPars pars;
+		pars.eta = eta;
+		pars.lastTrain = 99;
+
+		CLOCK::time_point start = CLOCK::now();
+		for (size_t epoch = 0; epoch < epochs; ++epoch) {
+			for (size_t first = 0; first < samples; first += batchSize) {
+				size_t count = std::min(batchSize, samples - first);
+				MAT x = X.middleCols(first, count);
+				MAT y = Y.middleCols(first, count);
+				switch (mode) {
+				case 0: net.backProp(x, y, pars); break;
+				case 1: net.backPropParallel(x, y, pars); break;
+				case 2: net.backPropHogwild(x, y, pars); break;
+				}
+			}
+		}
+		results(mode, 0) = fREAL(std::chrono::duration<double, std::milli>(CLOCK::now() - start).count() / std::max<size_t>(epochs, 1));
+		MAT x = X;
+		results(mode, 1) = net.forProp(x, Y, false);
+	}
+	return results;
+}
 /* Train the Discriminator
 */
 void CNet::train_GAN_D(MAT& in_copy, MAT &in, MAT& res, bool real, const learnPars& pars) {
@@ -328,10 +768,9 @@ void CNet::train_GAN_D(MAT& in_copy, MAT &in, MAT& res, bool real, const learnPa
 	*	d_loss = tf.reduce_mean(tf.nn.softplus(d_fake) + tf.nn.softplus(-d_real))
 	*	g_loss = tf.reduce_mean(tf.nn.softplus(-d_fake))
 	*/
-	static bool softPlusLoss = false;
+	const bool softPlusLoss = false;
 
-	static MAT labels(getNOUT(), 1);
-	static MAT cross_entropy_gradient(getNOUT(), 1);
+	MAT cross_entropy_gradient;
 
 	getFirst()->forProp(in_copy, true, true);
 	// check for NaN's & Infinities.
@@ -348,6 +787,7 @@ void CNet::train_GAN_D(MAT& in_copy, MAT &in, MAT& res, bool real, const learnPa
 		}
 	} else {
 
+		MAT labels(in_copy.rows(), in_copy.cols());
 		if (real) {
 			labels.setOnes();
 		} else {
@@ -367,14 +807,13 @@ void CNet::train_GAN_D(MAT& in_copy, MAT &in, MAT& res, bool real, const learnPa
 }
 /* Prepare the training of the generator
 */
-void CNet::train_GAN_G_D(MAT& in_copy,  MAT& res, const learnPars& pars) {
+void CNet::train_GAN_G_D(MAT& in_copy,  MAT& res, const learnPars& /*pars*/) {
 	/*	The ICML 2017 workshop uses softplus as the cost .. see below.
 	*	d_loss = tf.reduce_mean(tf.nn.softplus(d_fake) + tf.nn.softplus(-d_real))
 	*	g_loss = tf.reduce_mean(tf.nn.softplus(-d_fake))
 	*/
-	static MAT labels(getNOUT(), 1);
-	static MAT cross_entropy_gradient(getNOUT(), 1);
-	static bool softPlusLoss = false;
+	MAT cross_entropy_gradient;
+	const bool softPlusLoss = false;
 
 	getFirst()->forProp(in_copy, true, true);
 
@@ -384,7 +823,7 @@ void CNet::train_GAN_G_D(MAT& in_copy,  MAT& res, const learnPars& pars) {
 		res(0, 0) = (-in_copy).unaryExpr(&SoftPlus).mean();
 		cross_entropy_gradient = (-in_copy).unaryExpr(&DSoftPlus);// Generator loss
 	} else {
-		labels.setOnes();
+		MAT labels = MAT::Ones(in_copy.rows(), in_copy.cols());
 		// Calculate the generator loss
 		res(0, 0) = (in_copy - in_copy.unaryExpr(&LogExp)).mean();
 		cross_entropy_gradient = move(sigmoid_GEN_loss(labels, in_copy));// Generator loss
@@ -457,7 +896,7 @@ void CNet::setNthLayer(size_t layer, const MAT& newLayer) {
 		}
 	}
 }
-MAT CNet::l2_errorMatrix(const MAT& diff) {
+MAT CNet::l2_errorMatrix(const MAT& diff) const {
 	return diff; // force Visual C++ to return without temporary - since RVO doesn't work ???!
 }
 MAT CNet::l1_errorMatrix(const MAT& diff) {
@@ -484,8 +923,8 @@ MAT CNet::entropyRegularizer(const MAT& out) {
 	static const fREAL eps = 1E-8;
 	return  (out).unaryExpr(&logP1_fREAL);
 }
-fREAL CNet::l2_error(const MAT& diff) {
-	fREAL sum = cumSum(matNorm(diff));
+fREAL CNet::l2_error(const MAT& diff) const {
+	fREAL sum = diff.squaredNorm();
 	//if (sum > 0.0f)
 		return 0.5f*sqrt(sum); //  / sqrt(sum)
 	//else
@@ -4,6 +4,7 @@
 #include <memory>
 #include "CNETLayer.h"
 #include "MixtureDensityModel.h"
+#include "InferenceContext.h"
 //typedef std::unique_ptr<CNetLayer> layerPtr; // currently not in use.
  
 
@@ -16,14 +17,24 @@
 class CNet {
 	public:
 		CNet(size_t NIN);
+		CNet(size_t NINY, size_t NINX, size_t channels); // rectangular input of channels NINY x NINX planes
 		~CNet();
 		// Physical Layers (i.e. layers with weight parameters)
 		void addFullyConnectedLayer(size_t NOUT, actfunc_t type);
-		void addConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type);
-		void addAntiConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride,  size_t outChannels, size_t inChannels, actfunc_t type);
+		void addConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation = 1, size_t groups = 1);
+		void addAntiConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride,  size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation = 1, size_t groups = 1);
+		// Rectangular versions - the input planes are taken from the layer below (or the input geometry)
+		void addConvolutionalLayer(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, 
+			size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation = 1, size_t groups = 1);
+		void addAntiConvolutionalLayer(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, 
+			size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation = 1, size_t groups = 1);
+		void addSeparableConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type);
+		void addSeparableConvolutionalLayer(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
+			size_t outChannels, size_t inChannels, actfunc_t type);
 
 		// Discarnate Layers (i.e. layers without weight parameters)
 		void addPoolingLayer(size_t maxOverXY, size_t channels, pooling_t type);
+		void addPoolingLayer(size_t maxOverY, size_t maxOverX, size_t channels, pooling_t type);
 		void addDropoutLayer(fREAL ratio);
 		void addPassOnLayer(actfunc_t type);
 		void addMixtureDensity(size_t NOUT, size_t features, size_t BlockXY);
@@ -31,16 +42,40 @@ class CNet {
 		void addSideChannel(size_t sideChannelSize);
 		void addGaussianReparametrization();
 
-		// Share Layer Functionality
+		// Share Layer Functionality - the layers stay owned by otherNet, which has to outlive this net
 		void shareLayers(CNet* const otherNet, uint32_t firstLayer, uint32_t lastLayer);
+		bool lendsTo(const CNet& otherNet) const; // otherNet borrowed a layer this net owns
+		// Keep the activations and deltas of all layers in workspace until another one is bound (see ExecutionWorkspace).
+		// With a workspace per net, the state a shared layer saved for one net survives the passes of the other.
+		void bindWorkspace(ExecutionWorkspace& workspace);
+		void unbindWorkspace(); // back to the layers' own storage
+		inline ExecutionWorkspace* getWorkspace() const { return boundWorkspace; }; // nullptr if none is bound
 		// Initialization Routines
 		void initToUnitVariance(size_t batchSize);
 		size_t layerDimensionError() const;
 
 		// Propagate input matrix through entire network. Results are stored in "in".
+		// in may hold a minibatch of B samples as (NIN,B) columns - outDesired is (NOUT,B) then and the error covers the whole batch.
 		fREAL forProp(MAT& in, const MAT& outDesired, bool saveAct);
-		// Backpropagate through network. 
+		fREAL forProp(MAT& in, const MAT& outDesired, bool saveAct, ExecutionWorkspace& workspace); // forProp on workspace - the previous binding is restored
+		// Re-entrant forward pass - the weights are only read and all per-call buffers live in context.
+		// Threads may infer on the same net at the same time as long as each brings its own context and nobody trains meanwhile.
+		fREAL infer(MAT& in, const MAT& outDesired, InferenceContext& context) const;
+		// Backpropagate through network. A minibatch contributes one gradient per layer, summed over its samples. 
 		fREAL backProp(MAT& in, MAT& outDesired, const learnPars& pars, bool deltaProvided=false); // set bool to 'true' if you outDesired contains delta's from other network
+		fREAL backProp(MAT& in, MAT& outDesired, const learnPars& pars, ExecutionWorkspace& workspace, bool deltaProvided = false); // backProp on workspace - the previous binding is restored
+		// Data-parallel backProp - the minibatch columns are split into contiguous shards, one per worker.
+		// Each worker runs a replica of the chain with its own activations and deltas. The gradients are merged in worker order
+		// before the (single) step, so the result does not depend on the thread schedule. The layers of this net keep no activations.
+		fREAL backPropParallel(MAT& in, MAT& outDesired, const learnPars& pars, bool deltaProvided = false);
+		// Asynchronous (Hogwild) backProp - the workers take every workers-th sample of the minibatch and train their replica
+		// on one sample at a time. Each sample's step goes straight into the shared W and b, without locks. The replicas read the
+		// shared weights before every sample. Plain descent, momentum, RMSprop or ADAM per worker - no weight or spectral normalization.
+		fREAL backPropHogwild(MAT& in, MAT& outDesired, const learnPars& pars, bool deltaProvided = false);
+		inline void setWorkers(size_t n) { workers = std::max<size_t>(n, 1); };
+		inline size_t getWorkers() const { return workers; };
+		inline void setAsynchronous(bool on) { asynchronous = on; }; // opt-in switch between the two modes for callers like the DLL
+		inline bool isAsynchronous() const { return asynchronous; };
 
 		// Specialized functions for training GANs
 		void train_GAN_D(MAT& in_copy, MAT &in, MAT& res, bool real, const learnPars& pars);
@@ -61,10 +96,20 @@ class CNet {
 		// (Re) link the chain must be called directly before forward/backward propagation
 		// this enables dynamical switching of layers.
 		void linkChain();
+		// Relink only if needed - each net keeps track of its own linked state, so alternating between nets costs no relinking
+		bool isLinked() const;
+		void ensureLinked();
+		// Heap buffers of the training steps so far - allocated by the step arena or by the kernels (StepArena::getMisses)
+		size_t getArenaMisses() const;
+		// Time the convolution paths on the actual layer shapes and keep the fastest per (Anti)ConvolutionalLayer.
+		// Decisions are looked up in and written back to cacheFile (keyed by geometry and CPU) - returns the number of layers timed.
+		size_t tune(string cacheFile, size_t repetitions);
 
 		// Getter functions
 		inline size_t getLayerNumber() const { return layers.size(); };
 		inline size_t getNIN() const { return NIN; };
+		inline size_t getNINY() const { return inputY; }; // 0 if the input has no geometry
+		inline size_t getNINX() const { return inputX; };
 		void copyNthLayer(size_t layer, fREAL* const toCopyTo) const;
 		void setNthLayer(size_t layer, const MAT& newLayer);
 		void copyNthActivation(size_t layer, fREAL* const toCopyTo) const;
@@ -74,14 +119,26 @@ class CNet {
 		void inquireDimensions (size_t layer, size_t& rows, size_t& cols) const;
 
 	private:
+		CNet(const CNet& master); // replica of the chain for backPropParallel
+		void prepareReplicas(size_t count);
+		bool replicasCurrent() const; // the replicas still match the layers of the chain
+		// The replica takes over the weights, and the side channel input of samples [first, first+count) of a batch of samples
+		void pullReplica(CNet& replica, size_t first, size_t count, size_t samples) const;
+		void feedReplica(CNet& replica, size_t first, size_t count, size_t samples) const; // side channel input only
 
 		inline CNetLayer* getLast() const { return layers.back(); };
 		inline CNetLayer* getFirst() const { return layers.front(); };
+		// Planes (per channel) a new layer with "channels" input channels sees
+		void planesBelow(size_t channels, size_t& NINY, size_t& NINX) const;
+		// Lifetimes of the buffers of one backProp, from the layer chain - called by linkChain
+		void planStep();
+		// Point every layer at the state and arena of the bound workspace (or at their own)
+		void bindLayers();
 
 		// error related functions
-		MAT l2_errorMatrix(const MAT& diff);
+		MAT l2_errorMatrix(const MAT& diff) const;
 		MAT l1_errorMatrix(const MAT& diff);
-		fREAL l2_error(const MAT& diff);
+		fREAL l2_error(const MAT& diff) const;
 		fREAL l1_error(const MAT& diff);
 		// GAN Error
 		fREAL sigmoid_cross_entropy_with_logits(const MAT& logits, const MAT& labels);
@@ -95,12 +152,40 @@ class CNet {
 			return (layers[layer]->whoAmI()	== layer_t::fullyConnected
 				|| layers[layer]->whoAmI()	== layer_t::convolutional
 				|| layers[layer]->whoAmI()	== layer_t::antiConvolutional
+				|| layers[layer]->whoAmI()	== layer_t::separableConvolutional
+				);
+		}
+		inline bool isInPlace(size_t layer) const { // passes its input buffer on
+			return (layers[layer]->whoAmI()	== layer_t::passOn
+				|| layers[layer]->whoAmI()	== layer_t::dropout
+				|| layers[layer]->whoAmI()	== layer_t::reshape
+				|| layers[layer]->whoAmI()	== layer_t::mixtureDensity
+				|| layers[layer]->whoAmI()	== layer_t::batchNorm
 				);
 		}
 		
 		
 		size_t NIN;
+		size_t inputY; // input geometry, 0 if unknown (square planes are assumed)
+		size_t inputX;
 		vector<CNetLayer*> layers;
+		vector<CNetLayer*> borrowed; // layers from shareLayers - not deleted by this net
+		bool linked; // false once the topology changed (layers loaded) since the last linkChain
+		size_t linkedLayers; // layer count at the last linkChain - layers added since make the links stale as well
+		size_t generation; // bumped by loads and tune - the layers may have changed shape, type or kernel path
+		size_t workers; // workers in backPropParallel and backPropHogwild
+		bool asynchronous;
+		vector<CNet*> replicas; // one per worker, created on demand
+		size_t replicaGeneration; // generation the replicas were built at
+		vector<CNetLayer*> replicaSources; // layers the replicas were copied from
+		StepArena arena; // buffers of the training steps
+		ExecutionWorkspace* boundWorkspace; // nullptr - the layers keep their own state
+		StepArena* activeArena; // arena, or the one of the bound workspace
+		vector<BufferLife> stepPlan;
 };
 
+// Throughput and convergence of the training modes on a random FC regression task of samples samples.
+// Rows: sequential backProp, backPropParallel, backPropHogwild - columns: ms per epoch, error over all samples after the last epoch
+MAT benchmarkTrainingModes(size_t NIN, size_t hidden, size_t NOUT, size_t samples, size_t batchSize, size_t workers, size_t epochs, fREAL eta);
+
 #endif 
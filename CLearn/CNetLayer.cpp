@@ -1,29 +1,29 @@
 #include "stdafx.h"
 #include "CNetLayer.h"
 
-CNetLayer::CNetLayer(size_t _NOUT, size_t _NIN) : NOUT(_NOUT), NIN(_NIN), actSave(_NOUT, 1), deltaSave(_NOUT, 1){
+CNetLayer::CNetLayer(size_t _NOUT, size_t _NIN) : NOUT(_NOUT), NIN(_NIN), ownState(), state(&ownState), arena(nullptr){
 	assignActFunc(actfunc_t::NONE);
-	actSave.setZero();
-	deltaSave.setZero();
+	actSave() = MAT::Zero(_NOUT, 1);
+	deltaSave() = MAT::Zero(_NOUT, 1);
 	below = NULL;
 	above = NULL;
 	hierarchy = hierarchy_t::input;
 	layerNumber = 0;
 }
 
-CNetLayer::CNetLayer(size_t _NOUT, size_t _NIN, actfunc_t type) : NOUT(_NOUT), NIN(_NIN), actSave(_NOUT, 1), deltaSave(_NOUT, 1) {
+CNetLayer::CNetLayer(size_t _NOUT, size_t _NIN, actfunc_t type) : NOUT(_NOUT), NIN(_NIN), ownState(), state(&ownState), arena(nullptr) {
 	assignActFunc(type);
-	actSave.setZero();
-	deltaSave.setZero();
+	actSave() = MAT::Zero(_NOUT, 1);
+	deltaSave() = MAT::Zero(_NOUT, 1);
 	below = NULL;
 	above = NULL;
 	hierarchy = hierarchy_t::input;
 	layerNumber = 0;
 }
 
-CNetLayer::CNetLayer(size_t _NOUT, actfunc_t type, CNetLayer& lower): NOUT(_NOUT), actSave(_NOUT, 1), deltaSave(_NOUT, 1) {
-	actSave.setZero();
-	deltaSave.setZero();
+CNetLayer::CNetLayer(size_t _NOUT, actfunc_t type, CNetLayer& lower): NOUT(_NOUT), ownState(), state(&ownState), arena(nullptr) {
+	actSave() = MAT::Zero(_NOUT, 1);
+	deltaSave() = MAT::Zero(_NOUT, 1);
 	assignActFunc(type);
 	NIN = lower.getNOUT();
 	below = &lower;
@@ -32,16 +32,55 @@ CNetLayer::CNetLayer(size_t _NOUT, actfunc_t type, CNetLayer& lower): NOUT(_NOUT
 	hierarchy = hierarchy_t::output;
 }
 
+CNetLayer::CNetLayer(const CNetLayer& other) : below(other.below), above(other.above), act(other.act), dact(other.dact),
+	activationType(other.activationType), hierarchy(other.hierarchy), NOUT(other.NOUT), NIN(other.NIN), layerNumber(other.layerNumber),
+	ownState(), state(&ownState), arena(nullptr) {}
+
+void CNetLayer::outputPlanes(size_t channels, size_t& NOUTY, size_t& NOUTX) const {
+	if (!planeShape(NOUTY, NOUTX) || NOUTY*NOUTX*channels != NOUT) {
+		// no (matching) geometry known - interpret the output as square planes
+		NOUTY = sqrt(NOUT / channels);
+		NOUTX = NOUTY;
+	}
+}
+
 MAT CNetLayer::getDACT() const {
-	return actSave.unaryExpr(dact);
+	return actSave().unaryExpr(dact);
 }
 
 MAT CNetLayer::getACT() const {
-	return actSave.unaryExpr(act);
+	return actSave().unaryExpr(act);
 }
 
 MAT CNetLayer::getDelta() const {
-	return deltaSave;
+	return deltaSave();
+}
+
+void CNetLayer::bindState(LayerState* _state) {
+	state = _state ? _state : &ownState;
+}
+
+void CNetLayer::bindArena(StepArena* _arena) {
+	arena = _arena;
+}
+
+MAT CNetLayer::takeBuffer(size_t rows, size_t cols) const {
+	return arena ? arena->take(rows, cols) : MAT(rows, cols);
+}
+
+void CNetLayer::giveBuffer(MAT& buffer) const {
+	if (arena)
+		arena->give(buffer);
+}
+// Swapping keeps both storages alive - nothing is copied or freed
+void CNetLayer::passOn(MAT& in, MAT& out) const {
+	in.swap(out);
+	giveBuffer(out);
+}
+
+void CNetLayer::takeBelowACT(MAT& buffer) const {
+	buffer = takeBuffer(below->actSave().rows(), below->actSave().cols());
+	buffer = below->actSave().unaryExpr(below->act);
 }
 
 void CNetLayer::connectAbove(CNetLayer* ptr) {
@@ -146,10 +185,8 @@ void CNetLayer::reconstructMother(ifstream& in) {
 	// the linkChain function will reset the network structure.
 	in >> layerNumber; //... and also the layerNumber
 
-	actSave = MAT(NOUT, 1);
-	deltaSave = MAT(NOUT, 1);
-	actSave.setZero();
-	deltaSave.setZero();
+	actSave() = MAT::Zero(NOUT, 1);
+	deltaSave() = MAT::Zero(NOUT, 1);
 }
 
 void CNetLayer::changeActFunc( CNetLayer& changeMyActivation, actfunc_t type)
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "defininitions.h"
+#include "ExecutionWorkspace.h"
+#include "StepArena.h"
 
 #ifndef CNET_CNETLAYER
 #define CNET_CNETLAYER
+class InferenceContext;
 
 /* Abstract base class for a layer of weights.
  * This means that this class sits in between nodes and forwards input or
@@ -15,16 +18,22 @@ class CNetLayer {
 		CNetLayer(size_t _NOUT, size_t _NIN);
 		CNetLayer(size_t _NOUT, size_t _NIN, actfunc_t type);
 		CNetLayer(size_t _NOUT, actfunc_t type, CNetLayer& lower);
-		// Delete Copy- and Move CTORs
-		CNetLayer(const CNetLayer& other) = delete;
+		// Delete Move CTOR - copies are only made by replicate()
 		CNetLayer(CNetLayer&& other) = delete;
 		
 		virtual ~CNetLayer() {}; 
 
 		// type
 		virtual layer_t whoAmI() const = 0;
-		// forProp
+		// Replica for data-parallel training: same parameters and geometry, but its own activations and deltas.
+		// The replica is linked into its own chain (CNet::linkChain).
+		virtual CNetLayer* replicate() const = 0;
+		// Take over the parameters of the layer this one replicates - nothing to do for layers without parameters
+		virtual void pullWeights(const CNetLayer& /*master*/) {};
+		// forProp - in is an (NIN,B) minibatch, one sample per column
 		virtual void forProp(MAT& in, bool training, bool recursive) = 0; // recursive
+		// Re-entrant forward pass without training - reads the layer only, buffers come from context at position layer of the net
+		virtual void infer(MAT& in, InferenceContext& context, size_t layer) const = 0;
 		// backprop
 		virtual void backPropDelta(MAT& delta, bool recursive) = 0; // recursive
 		virtual void applyUpdate(const learnPars& pars, MAT& input, bool recursive) =0 ; // recursive
@@ -34,23 +43,43 @@ class CNetLayer {
 		inline size_t getNOUT() const { return NOUT; };
 		inline size_t getLayerNumber() const { return layerNumber; };
 		inline hierarchy_t getHierachy() const { return hierarchy; };
+		// Spatial shape of one output channel - layers without a plane structure return false
+		virtual bool planeShape(size_t& /*NOUTY*/, size_t& /*NOUTX*/) const { return false; };
+		// Shape of the planes a layer with "channels" input channels sees on top of this one (square if unknown)
+		void outputPlanes(size_t channels, size_t& NOUTY, size_t& NOUTX) const;
 
 		MAT getDACT() const; // derivative of activation function
 		MAT getACT() const; // activation function
 		MAT getDelta() const; // get backpropagated delta
+		// Keep activations and deltas in state (an ExecutionWorkspace entry) from now on - nullptr returns to the layer's own
+		void bindState(LayerState* state);
+		// Take the buffers of training steps from arena (CNet::linkChain) - nullptr allocates them
+		void bindArena(StepArena* arena);
 
 		// Connect to layer above and change hierarchy from output to hidden
 		void connectAbove(CNetLayer* ptr);
 		void connectBelow(CNetLayer* ptr);
 		void checkHierarchy(bool recursive);
+		inline const CNetLayer* getBelow() const { return below; };
+		inline const CNetLayer* getAbove() const { return above; };
 
 		// save to file
 		friend ostream& operator<<(ostream& os, const CNetLayer& toSave); // almost virtual member
 		friend ifstream& operator >> (ifstream& in, CNetLayer& toReconstruct);
 
 	protected:
-		MAT actSave; // keep activation before propagation
-		MAT deltaSave; // store deltas for backprop
+		CNetLayer(const CNetLayer& other); // for replicate() only - the copy starts out on its own, empty state
+		// State of the current pass - the bound workspace entry or the layer's own
+		inline MAT& actSave() { return state->act; }; // keep activation before propagation
+		inline const MAT& actSave() const { return state->act; };
+		inline MAT& deltaSave() { return state->delta; }; // store deltas for backprop
+		inline const MAT& deltaSave() const { return state->delta; };
+		inline LayerState& passState() { return *state; };
+		// Buffers from the bound arena, plain allocations without one
+		MAT takeBuffer(size_t rows, size_t cols) const;
+		void giveBuffer(MAT& buffer) const;
+		void passOn(MAT& in, MAT& out) const; // in becomes out, the old buffer of in goes back to the arena
+		void takeBelowACT(MAT& buffer) const; // activation of the layer below in a buffer from the arena
 		// saving functions
 		void saveMother(ostream& os) const;
 		void reconstructMother(ifstream& in) ;
@@ -71,6 +100,9 @@ class CNetLayer {
 
 		size_t layerNumber;
 
+		LayerState ownState;
+		LayerState* state; // &ownState unless bound to a workspace
+		StepArena* arena;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include "stdafx.h"
+#include "ConvAutotuner.h"
+#include "SimdKernels.h"
+#include <sstream>
+
+ConvTuneCache::ConvTuneCache(const string& _filePath) : filePath(_filePath), cpu(cpuSignature()) {
+	if (filePath.empty())
+		return;
+	ifstream file(filePath);
+	string line;
+	while (std::getline(file, line)) {
+		std::istringstream entry(line);
+		string key;
+		int algorithm, gradAlgorithm;
+		if (entry >> key >> algorithm >> gradAlgorithm
+			&& algorithm >= convalgo_t::directConv && algorithm <= convalgo_t::fftConv
+			&& gradAlgorithm >= convalgo_t::directConv && gradAlgorithm <= convalgo_t::fftConv) {
+			entries[key] = std::make_pair(convalgo_t(algorithm), convalgo_t(gradAlgorithm));
+		}
+	}
+}
+bool ConvTuneCache::lookup(const string& layerKey, convalgo_t& algorithm, convalgo_t& gradAlgorithm) const {
+	auto it = entries.find(cpu + "|" + layerKey);
+	if (it == entries.end())
+		return false;
+	algorithm = it->second.first;
+	gradAlgorithm = it->second.second;
+	return true;
+}
+void ConvTuneCache::store(const string& layerKey, convalgo_t algorithm, convalgo_t gradAlgorithm) {
+	entries[cpu + "|" + layerKey] = std::make_pair(algorithm, gradAlgorithm);
+}
+// Entries of other machines are written back unchanged.
+void ConvTuneCache::save() const {
+	if (filePath.empty())
+		return;
+	ofstream file(filePath);
+	for (auto it = entries.begin(); it != entries.end(); ++it)
+		file << it->first << " " << it->second.first << " " << it->second.second << endl;
+}
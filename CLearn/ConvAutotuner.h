@@ -0,0 +1,39 @@
+#pragma once
+#include "defininitions.h"
+#include <chrono>
+#include <map>
+#ifndef CNET_CONVAUTOTUNER
+#define CNET_CONVAUTOTUNER
+
+/* Persistent record of the fastest convolution algorithms per layer geometry and machine.
+*  One line per entry: "<key> <algorithm> <gradAlgorithm>", where the key joins cpuSignature() and the layer's tuneKey().
+*  Unknown or malformed lines are skipped, so a cache can be shared between library versions and machines.
+*/
+class ConvTuneCache {
+public:
+	ConvTuneCache(const string& filePath); // empty path: keep decisions in memory only
+	bool lookup(const string& layerKey, convalgo_t& algorithm, convalgo_t& gradAlgorithm) const;
+	void store(const string& layerKey, convalgo_t algorithm, convalgo_t gradAlgorithm);
+	void save() const;
+	inline size_t size() const { return entries.size(); };
+
+private:
+	string filePath;
+	string cpu;
+	std::map<string, std::pair<convalgo_t, convalgo_t>> entries;
+};
+
+// Best (minimum) wall time of repetitions calls of f in milliseconds - one extra untimed call warms buffers and plans.
+template<typename F> double bestTime(F f, size_t repetitions) {
+	typedef std::chrono::steady_clock CLOCK;
+	f();
+	double best = 0;
+	for (size_t r = 0; r < std::max(repetitions, size_t(1)); ++r) {
+		CLOCK::time_point start = CLOCK::now();
+		f();
+		double ms = std::chrono::duration<double, std::milli>(CLOCK::now() - start).count();
+		best = r == 0 ? ms : std::min(best, ms);
+	}
+	return best;
+}
+#endif
@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "ConvolutionalLayer.h"
 #include "BatchBuffer.h"
+#include "ConvAutotuner.h"
+#include "InferenceContext.h"
 
 
 /* Convolutional layer Constructors
@@ -11,47 +13,50 @@ which bypass the convolution. I refer to these input channels as "sidechannels".
 
 They are intended to be passed on to some dense layer where they can be incorporated in the stream of information.
 * - The CNetLayer::NOUT variable contains information about the number of features.
+* - A dilation d > 1 spreads the kernel taps d pixels apart: the kernel covers (kernel-1)*d+1 pixels with the same number of weights.
+* - With groups > 1 the channels are split into groups, out-channels only see the in-channels of their group. This divides
+*   the number of kernels (features) by groups.
 */
 ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTX, size_t _NOUTY, size_t _NINX, size_t _NINY, size_t _kernelX, size_t _kernelY, size_t _strideY, size_t _strideX,
-	size_t _outChannels, size_t _inChannels, actfunc_t type)
+	size_t _outChannels, size_t _inChannels, actfunc_t type, size_t _dilationY, size_t _dilationX, size_t _groups)
 	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX), 
-	inChannels(_inChannels), outChannels(_outChannels), features(_inChannels*_outChannels),
-	PhysicalLayer(_outChannels*_NOUTX*_NOUTY, _inChannels*_NINX*_NINY, type, MATIND{ _kernelY, _inChannels*_outChannels*_kernelX }, MATIND{ _kernelY, _inChannels*_outChannels*_kernelX },
-		MATIND{ 1,_inChannels*_outChannels }, MATIND{ _kernelY, _inChannels*_outChannels*_kernelX }) {
+	dilationY(_dilationY), dilationX(_dilationX), groups(_groups), inChannels(_inChannels), outChannels(_outChannels), features(_inChannels*_outChannels/_groups),
+	PhysicalLayer(_outChannels*_NOUTX*_NOUTY, _inChannels*_NINX*_NINY, type, MATIND{ _kernelY, _inChannels*_outChannels/_groups*_kernelX }, MATIND{ _kernelY, _inChannels*_outChannels/_groups*_kernelX },
+		MATIND{ 1,_inChannels*_outChannels/_groups }, MATIND{ _kernelY, _inChannels*_outChannels/_groups*_kernelX }) {
 	// the layer matrix will act as convolutional kernel
 	init();
 	assertGeometry();
 }
 
 ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTX, size_t _NOUTY, size_t _NINX, size_t _NINY, size_t _kernelX, size_t _kernelY, size_t _strideY, size_t _strideX,
-	size_t _outChannels, size_t _inChannels, actfunc_t type, CNetLayer& lower)
-	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX), inChannels(_inChannels), 
-	outChannels(_outChannels), features(_inChannels*_outChannels), PhysicalLayer(_outChannels*_NOUTX*_NOUTY, type, MATIND{ _kernelY, _inChannels*_outChannels*_kernelX }, 
-		MATIND{ _kernelY, _inChannels*_outChannels*_kernelX },
-		MATIND{ 1,_inChannels*_outChannels }, MATIND{ _kernelY,_inChannels*_outChannels*_kernelX }, lower) {
+	size_t _outChannels, size_t _inChannels, actfunc_t type, CNetLayer& lower, size_t _dilationY, size_t _dilationX, size_t _groups)
+	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX),
+	dilationY(_dilationY), dilationX(_dilationX), groups(_groups), inChannels(_inChannels), 
+	outChannels(_outChannels), features(_inChannels*_outChannels/_groups), PhysicalLayer(_outChannels*_NOUTX*_NOUTY, type, MATIND{ _kernelY, _inChannels*_outChannels/_groups*_kernelX }, 
+		MATIND{ _kernelY, _inChannels*_outChannels/_groups*_kernelX },
+		MATIND{ 1,_inChannels*_outChannels/_groups }, MATIND{ _kernelY,_inChannels*_outChannels/_groups*_kernelX }, lower) {
 
 	init();
 	assertGeometry();
 }
 // second most convenient constructor
-ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTXY, size_t _NINXY, size_t _kernelXY, size_t _stride, size_t _outChannels, size_t _inChannels, actfunc_t type)
+ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTXY, size_t _NINXY, size_t _kernelXY, size_t _stride, size_t _outChannels, size_t _inChannels, actfunc_t type, size_t _dilation, size_t _groups)
 	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), NINX(_NINXY), NINY(_NINXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride), 
-	inChannels(_inChannels), outChannels(_outChannels), features(_inChannels*_outChannels), PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, _inChannels*_NINXY*_NINXY, type,
-		MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY }, MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY },
-		MATIND{ 1, _inChannels*_outChannels}, MATIND{_kernelXY, _inChannels*_outChannels*_kernelXY}) {
+	dilationY(_dilation), dilationX(_dilation), groups(_groups), inChannels(_inChannels), outChannels(_outChannels), features(_inChannels*_outChannels/_groups), PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, _inChannels*_NINXY*_NINXY, type,
+		MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY }, MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY },
+		MATIND{ 1, _inChannels*_outChannels/_groups}, MATIND{_kernelXY, _inChannels*_outChannels/_groups*_kernelXY}) {
 	init();
 	assertGeometry();
 }
 
 // most convenient constructor
-ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY, size_t _stride, size_t _outChannels, size_t _inChannels, actfunc_t type, CNetLayer& lower)
-	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride), outChannels(_outChannels), inChannels(_inChannels), features(_inChannels*_outChannels),
-	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, type, MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY }, MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY },
-		MATIND{ 1,_inChannels*_outChannels }, MATIND{ _kernelXY, _inChannels*_outChannels*_kernelXY }, lower) {
+ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY, size_t _stride, size_t _outChannels, size_t _inChannels, actfunc_t type, CNetLayer& lower, size_t _dilation, size_t _groups)
+	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride), dilationY(_dilation), dilationX(_dilation), groups(_groups), outChannels(_outChannels), inChannels(_inChannels), features(_inChannels*_outChannels/_groups),
+	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, type, MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY }, MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY },
+		MATIND{ 1,_inChannels*_outChannels/_groups }, MATIND{ _kernelXY, _inChannels*_outChannels/_groups*_kernelXY }, lower) {
 
 	// We need to know how to interpre the inputs geometrically. Thus, we request number of features.
-	NINX = sqrt((lower.getNOUT()) / inChannels); // sqrt(2* 5*5/2) = 5 
-	NINY = NINX; // this is only for squares.
+	lower.outputPlanes(inChannels, NINY, NINX); // planes of the layer below, squares if it has none
 
 	init();
 	assertGeometry();
@@ -59,26 +64,106 @@ ConvolutionalLayer::ConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY, size_t
 // destructor
 ConvolutionalLayer::~ConvolutionalLayer() {}
 
+bool ConvolutionalLayer::planeShape(size_t& planeY, size_t& planeX) const {
+	planeY = NOUTY;
+	planeX = NOUTX;
+	return true;
+}
+
 layer_t ConvolutionalLayer::whoAmI() const {
 	return layer_t::convolutional;
 }
+// The replica rebuilds its kernel buffers lazily instead of keeping copies of the master's
+CNetLayer* ConvolutionalLayer::replicate() const {
+	ConvolutionalLayer* replica = new ConvolutionalLayer(*this);
+	replica->setAlgorithm(algorithm, gradAlgorithm);
+	return replica;
+}
 void ConvolutionalLayer::assertGeometry() {
 	assert(outChannels*NOUTX*NOUTY == getNOUT());
 	assert(NINX*NINY*inChannels == getNIN());
-	// Feature dimensions
-	assert((strideX*NOUTX - strideX - NINX + kernelX) % 2 == 0);
-	assert((strideY*NOUTY - strideY - NINY + kernelY) % 2 == 0);
+	// Feature dimensions - a dilated kernel pads like a dense kernel of its extent
+	assert(dilationX > 0 && dilationY > 0);
+	assert(groups > 0 && inChannels % groups == 0 && outChannels % groups == 0);
+	assert((strideX*NOUTX - strideX - NINX + dilatedSize(kernelX, dilationX)) % 2 == 0);
+	assert((strideY*NOUTY - strideY - NINY + dilatedSize(kernelY, dilationY)) % 2 == 0);
 }
 void ConvolutionalLayer::init() {
 	W.unaryExpr(&abs<fREAL>);
 
-	padY = padSize(NOUTY, NINY, kernelY, strideY);
-	padX = padSize(NOUTX, NINX, kernelX, strideX);
+	padY = padSize(NOUTY, NINY, dilatedSize(kernelY, dilationY), strideY);
+	padX = padSize(NOUTX, NINX, dilatedSize(kernelX, dilationX), strideX);
+	selectAlgorithm();
 
-	deltaSave = MAT(getNOUT(), 1);
-	deltaSave.setZero();
-	actSave = MAT(getNOUT(), 1);
-	actSave.setZero();
+	deltaSave() = MAT(getNOUT(), 1);
+	deltaSave().setZero();
+	actSave() = MAT(getNOUT(), 1);
+	actSave().setZero();
+}
+// Choose between the direct loops, im2col + GEMM, Winograd and FFT for this geometry.
+void ConvolutionalLayer::selectAlgorithm() {
+	setAlgorithm(selectConvAlgorithm(NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, dilationY, dilationX, outChannels, inChannels, groups),
+		selectConvGradAlgorithm(NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, dilationY, dilationX, outChannels, inChannels, groups));
+}
+// Paths the geometry does not support fall back to the direct loops.
+void ConvolutionalLayer::setAlgorithm(convalgo_t _algorithm, convalgo_t _gradAlgorithm) {
+	algorithm = convAlgorithmSupported(_algorithm, false, kernelY, kernelX, strideY, strideX, dilationY, dilationX, groups) ? _algorithm : convalgo_t::directConv;
+	gradAlgorithm = convAlgorithmSupported(_gradAlgorithm, true, kernelY, kernelX, strideY, strideX, dilationY, dilationX, groups) ? _gradAlgorithm : convalgo_t::directConv;
+	directKernel = selectConvKernel(kernelY, kernelX, strideY, strideX);
+	// Fuse where the delta takes the direct loops and the gradient does not profit from a big GEMM
+	static const size_t maxFusedPlane = 64 * 64;
+	bool winogradDelta = algorithm == convalgo_t::winogradConv && padY < kernelY && padX < kernelX;
+	bool directDelta = !winogradDelta && algorithm != convalgo_t::fftConv;
+	fusedBackward = directDelta && (gradAlgorithm == convalgo_t::directConv || (gradAlgorithm == convalgo_t::im2colConv && NINY*NINX <= maxFusedPlane));
+	colBuffer = MAT(0, 0); // allocated lazily
+	winogradBuffer = MAT(0, 0);
+	flippedW = MAT(0, 0);
+	fftEngine.clearCache();
+}
+string ConvolutionalLayer::tuneKey() const {
+	return "conv|" + to_string(NOUTY) + "x" + to_string(NOUTX) + "|" + to_string(NINY) + "x" + to_string(NINX) + "|k" + to_string(kernelY) + "x" + to_string(kernelX)
+		+ "|s" + to_string(strideY) + "x" + to_string(strideX) + "|d" + to_string(dilationY) + "x" + to_string(dilationX) + "|c" + to_string(outChannels) + "x" + to_string(inChannels) + "|g" + to_string(groups);
+}
+/* Time one training step of the convolutions (forward, delta unless this is the input layer, kernel gradient) on random tensors
+*  of this geometry for every supported pair of paths and keep the fastest. Works on local tensors - the bound state is not touched.
+*/
+void ConvolutionalLayer::tune(size_t repetitions) {
+	MAT input = MAT::Random(getNIN(), 1);
+	MAT delta = MAT::Random(getNOUT(), 1);
+	MAT preAct(getNOUT(), 1);
+	MAT out(getNOUT(), 1);
+	MAT deltaBelow(getNIN(), 1);
+	MAT grad(kernelY, kernelX*features);
+	bool withDelta = getHierachy() != hierarchy_t::input;
+	// the fused path writes its kernel gradient to fusedGrad - keep the one of a pending update
+	MAT pendingGrad;
+	pendingGrad.swap(fusedGrad);
+	bool pending = hasFusedGrad;
+	convalgo_t bestAlgorithm = algorithm;
+	convalgo_t bestGradAlgorithm = gradAlgorithm;
+	double best = -1;
+	for (int a = convalgo_t::directConv; a <= convalgo_t::fftConv; ++a) {
+		for (int g = convalgo_t::directConv; g <= convalgo_t::fftConv; ++g) {
+			if (!convAlgorithmSupported(convalgo_t(a), false, kernelY, kernelX, strideY, strideX, dilationY, dilationX, groups) || !convAlgorithmSupported(convalgo_t(g), true, kernelY, kernelX, strideY, strideX, dilationY, dilationX, groups))
+				continue;
+			setAlgorithm(convalgo_t(a), convalgo_t(g));
+			double time = bestTime([&]() {
+				forwardConv(input, 0, out.data(), ConvEpilogue(b, act, &preAct));
+				if (withDelta)
+					deltaConv(delta, input, 0, deltaBelow.data());
+				if (!withDelta || !fusedBackward)
+					kernelGrad(input, delta, 0, grad, false);
+			}, repetitions);
+			if (best < 0 || time < best) {
+				best = time;
+				bestAlgorithm = convalgo_t(a);
+				bestGradAlgorithm = convalgo_t(g);
+			}
+		}
+	}
+	setAlgorithm(bestAlgorithm, bestGradAlgorithm);
+	fusedGrad.swap(pendingGrad);
+	hasFusedGrad = pending;
 }
 // Select submatrix of ith feature
 const MAT& ConvolutionalLayer::getIthFeature(size_t i) {
@@ -156,24 +241,44 @@ MAT ConvolutionalLayer::snorm_dWt(MAT& grad){
 void ConvolutionalLayer::forProp(MAT& inBelow, bool training, bool recursive) {
 
 
-	// (1) Reshape the remaining input
-
-	inBelow.resize(NINY, inChannels*NINX);
-	inBelow = conv_(inBelow, W, NOUTY, NOUTX, strideY, strideX, padY, padX, features, outChannels, inChannels);
-	inBelow.resize(getNOUT(), 1);
-	inBelow += b; // add bias term
+	// (1) Convolve a tensor view of each sample - the result is a flat (NOUT,B) tensor.
+	// Bias and activation are applied by the kernel (ConvEpilogue), which keeps the pre-activation in actSave when training.
+	hasFusedGrad = false;
+	size_t samples = inBelow.cols();
+	if (training)
+		actSave().resize(getNOUT(), samples);
+	MAT out = takeBuffer(getNOUT(), samples);
+	for (size_t s = 0; s < samples; ++s) {
+		forwardConv(inBelow, s, out.col(s).data(), ConvEpilogue(bias(), act, training ? &actSave() : nullptr, s));
+	}
+	passOn(inBelow, out);
 
-	if (training) {
-		actSave = inBelow;
-		inBelow = move(getACT());
-		if (recursive && getHierachy() != hierarchy_t::output) {
-			above->forProp(inBelow, true, true);
-		}
+	if (recursive && getHierachy() != hierarchy_t::output) {
+		above->forProp(inBelow, training, true);
+	}
+}
+// The layer's workspaces are only written by training-side calls - infer brings its own.
+void ConvolutionalLayer::infer(MAT& in, InferenceContext& context, size_t layer) const {
+	LayerScratch& scratch = context.scratch(layer);
+	MAT out(getNOUT(), in.cols());
+	for (size_t s = 0; s < in.cols(); ++s) {
+		forwardConv(in, s, out.col(s).data(), ConvEpilogue(bias(), act, nullptr), scratch.colBuffer, scratch.winogradBuffer, scratch.fftEngine);
+	}
+	in = move(out);
+}
+// Dispatch the forward convolution on a tensor view of one sample of the flat input.
+void ConvolutionalLayer::forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue) {
+	forwardConv(input, sample, result, epilogue, colBuffer, winogradBuffer, fftEngine);
+}
+void ConvolutionalLayer::forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue, MAT& cols, MAT& winograd, FFTConvolution& fft) const {
+	if (algorithm == convalgo_t::winogradConv) {
+		convWinograd_(tensorView(input, NINY, NINX, inChannels, sample), weights(), result, winograd, NOUTY, NOUTX, padY, padX, outChannels, inChannels, epilogue);
+	} else if (algorithm == convalgo_t::fftConv) {
+		fft.conv(tensorView(input, NINY, NINX, inChannels, sample), weights(), result, NOUTY, NOUTX, padY, padX, features, outChannels, inChannels, epilogue);
+	} else if (algorithm == convalgo_t::im2colConv) {
+		convIm2col_(tensorView(input, NINY, NINX, inChannels, sample), weights(), result, cols, NOUTY, NOUTX, strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups, epilogue);
 	} else {
-		inBelow = inBelow.unaryExpr(act);
-		if (recursive && getHierachy() != hierarchy_t::output) {
-			above->forProp(inBelow, false, true);
-		}
+		directKernel(tensorView(input, NINY, NINX, inChannels, sample), weights(), result, NOUTY, NOUTX, strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups, epilogue);
 	}
 }
 uint32_t ConvolutionalLayer::getOutChannels() const {
@@ -187,49 +292,96 @@ void ConvolutionalLayer::constrainToMax(MAT & mues, MAT & maxVec) {
 // backprop
 void ConvolutionalLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
 
-	deltaAbove = deltaAbove.cwiseProduct(getDACT());
-	deltaSave = deltaAbove; // just overwrite this matrix with an (NOUT-sideChannel)-sized vector
+	deltaAbove.array() *= actSave().unaryExpr(dact).array();
+	deltaSave() = deltaAbove; // just overwrite this matrix with an (NOUT-sideChannel)-sized vector
 
 	if (getHierachy() != hierarchy_t::input) { // ... this is not an input layer.
 		
-		deltaAbove.resize(NOUTY, outChannels*NOUTX); // keep track of this!!!
-		deltaAbove = antiConv_(deltaAbove, W, NINY, NINX, strideY, strideX, padY, padX, features, inChannels, outChannels);
-		deltaAbove.resize(getNIN(), 1);
+		MAT fromBelow;
+		if (fusedBackward)
+			takeBelowACT(fromBelow); // only the fused path reads the input
+		MAT deltaBelow = takeBuffer(getNIN(), deltaAbove.cols());
+		for (size_t s = 0; s < deltaAbove.cols(); ++s) {
+			deltaConv(deltaAbove, fromBelow, s, deltaBelow.col(s).data());
+		}
+		giveBuffer(fromBelow);
+		passOn(deltaAbove, deltaBelow);
 
 		if (recursive) {
 			below->backPropDelta(deltaAbove, true); // cascade...
 		}
 	}
 }
-// Gradient of convolution matrix
-MAT ConvolutionalLayer::w_grad(MAT& input) { // deltaSave: (NOUT-sideChannel) sized vector
-	deltaSave.resize(NOUTY, outChannels*NOUTX);
-	if (getHierachy() == hierarchy_t::input) {
-
-		input.resize(NINY, inChannels*NINX);
-
-		MAT convoluted = convGrad_(input, deltaSave, kernelY, kernelX, strideY, strideX, padY, padX, features, outChannels, inChannels);
-		deltaSave.resize(getNOUT(), 1); // make sure to resize to NOUT-sideChannels
-		input.resize(getNIN(), 1);
-
-		return convoluted;
+// Dispatch the delta propagation (transposed convolution) of one sample. The fused path also computes the kernel gradient from input.
+void ConvolutionalLayer::deltaConv(const MAT& delta, const MAT& input, size_t sample, fREAL* result) {
+	if (fusedBackward) {
+		// kernel gradient in the same sweep over the delta, summed over the batch - applyUpdate uses it instead of w_grad
+		hasFusedGrad = true;
+		convBackward_(tensorView(input, NINY, NINX, inChannels, sample), tensorView(delta, NOUTY, NOUTX, outChannels, sample), weights(), result, fusedGrad, sample > 0,
+			strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups);
+	} else if (algorithm == convalgo_t::winogradConv && padY < kernelY && padX < kernelX) {
+		// stride 1: the transposed convolution is a convolution with the flipped kernel - flipped once per pass, at the first sample
+		if (sample == 0)
+			flipKernel_(weights(), flippedW, kernelY, kernelX, outChannels, inChannels);
+		convWinograd_(tensorView(delta, NOUTY, NOUTX, outChannels, sample), flippedW, result, winogradBuffer, NINY, NINX,
+			kernelY - 1 - padY, kernelX - 1 - padX, inChannels, outChannels);
+	} else if (algorithm == convalgo_t::fftConv) {
+		fftEngine.antiConv(tensorView(delta, NOUTY, NOUTX, outChannels, sample), weights(), result, NINY, NINX, padY, padX, features, inChannels, outChannels);
 	} else {
-		MAT fromBelow = below->getACT();
-
-		fromBelow.resize(NINY, inChannels*NINX);
-
-		MAT convoluted = convGrad_(fromBelow, deltaSave, kernelY, kernelX, strideY, strideX, padY, padX, features, outChannels, inChannels);
-
-		deltaSave.resize(getNOUT(), 1);  // make sure to resize to NOUT-sideChannels
-
-		return convoluted;
+		antiConv_(tensorView(delta, NOUTY, NOUTX, outChannels, sample), weights(), result, NINY, NINX, strideY, strideX, dilationY, dilationX, padY, padX, features, inChannels, outChannels, groups);
+	}
+}
+// Gradient of convolution matrix, summed over the samples
+MAT ConvolutionalLayer::w_grad(MAT& input) { // deltaSave: (NOUT-sideChannel, B) sized matrix
+	MAT act;
+	if (getHierachy() != hierarchy_t::input)
+		takeBelowACT(act);
+	const MAT& fromBelow = getHierachy() == hierarchy_t::input ? input : act;
+	MAT grad;
+	if (gradAlgorithm == convalgo_t::im2colConv) {
+		// One product over the batch: the im2col blocks of the samples are stacked, in chunks that keep the buffer bounded like in gemmOrDirect
+		static const size_t maxBufferBytes = 128 * 1024 * 1024;
+		size_t samples = deltaSave().cols();
+		size_t depth = kernelY*kernelX*inChannels;
+		size_t chunk = std::min(samples, std::max<size_t>(1, maxBufferBytes / (NOUTY*NOUTX*depth*sizeof(fREAL))));
+		grad = takeBuffer(kernelY, kernelX*features);
+		MAT cols = takeBuffer(chunk*NOUTY*NOUTX, depth);
+		MAT deltas = takeBuffer(chunk*NOUTY*NOUTX, outChannels);
+		for (size_t first = 0; first < samples; first += chunk) {
+			convGradIm2colBatch_(fromBelow, deltaSave(), first, std::min(chunk, samples - first), cols, deltas, grad, first > 0,
+				NINY, NINX, NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups);
+		}
+		giveBuffer(cols);
+		giveBuffer(deltas);
+	} else {
+		grad = takeBuffer(kernelY, kernelX*features);
+		for (size_t s = 0; s < deltaSave().cols(); ++s) {
+			kernelGrad(fromBelow, deltaSave(), s, grad, s > 0);
+		}
+	}
+	giveBuffer(act);
+	return grad;
+}
+// Dispatch the gradient kernel on tensor views of one sample of the flat input and delta - into grad, or onto it if accumulate is set.
+void ConvolutionalLayer::kernelGrad(const MAT& input, const MAT& delta, size_t sample, MAT& grad, bool accumulate) {
+	if (gradAlgorithm == convalgo_t::fftConv) {
+		fftEngine.convGrad(tensorView(input, NINY, NINX, inChannels, sample), tensorView(delta, NOUTY, NOUTX, outChannels, sample), grad, accumulate,
+			kernelY, kernelX, padY, padX, features, outChannels, inChannels);
+	} else if (gradAlgorithm == convalgo_t::im2colConv) {
+		convGradIm2col_(tensorView(input, NINY, NINX, inChannels, sample), tensorView(delta, NOUTY, NOUTX, outChannels, sample), grad, accumulate, colBuffer,
+			kernelY, kernelX, strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups);
+	} else {
+		convGrad_(tensorView(input, NINY, NINX, inChannels, sample), tensorView(delta, NOUTY, NOUTX, outChannels, sample), grad, accumulate,
+			kernelY, kernelX, strideY, strideX, dilationY, dilationX, padY, padX, features, outChannels, inChannels, groups);
 	}
 }
 MAT ConvolutionalLayer::b_grad() {
-	return deltaSave;
+	MAT grad = takeBuffer(getNOUT(), 1);
+	grad.noalias() = deltaSave().rowwise().sum();
+	return grad;
 }
 void ConvolutionalLayer::saveToFile(ostream& os) const {
-	os << NOUTY << " " << NOUTX << " " << NINY << " " << NINX << " " << kernelY << " " << kernelX << " " << strideY << " " << strideX << " " << outChannels << " " << inChannels<< endl;
+	os << NOUTY << " " << NOUTX << " " << NINY << " " << NINX << " " << kernelY << " " << kernelX << " " << strideY << " " << strideX << " " << outChannels << " " << inChannels << " " << dilationY << " " << dilationX << " " << groups << endl;
 	os << spectralNormMode << " " << weightNormMode << endl;
 
 	MAT temp = W;
@@ -257,10 +409,12 @@ void ConvolutionalLayer::loadFromFile(ifstream& in) {
 	in >> strideX;
 	in >> outChannels;
 	in >> inChannels;
-	features = outChannels*inChannels;
+	readConvOptions(in, dilationY, dilationX, groups);
+	features = outChannels*inChannels / groups;
 
-	padY = padSize(NOUTY, NINY, kernelY, strideY);
-	padX = padSize(NOUTX, NINX, kernelX, strideX);
+	padY = padSize(NOUTY, NINY, dilatedSize(kernelY, dilationY), strideY);
+	padX = padSize(NOUTX, NINX, dilatedSize(kernelX, dilationX), strideX);
+	selectAlgorithm();
 
 	W = MAT(kernelY*features*kernelX, 1); // initialize as a column vector
 	b = MAT(getNOUT(), 1);
@@ -1,6 +1,7 @@
 #pragma once
 #include "defininitions.h"
 #include "PhysicalLayer.h"
+#include "FFTConvolution.h"
 
 #ifndef CNET_CONVOLAYER
 #define CNET_CONVOLAYER
@@ -11,17 +12,19 @@
 class ConvolutionalLayer : public PhysicalLayer{
 	public:
 		ConvolutionalLayer(size_t NOUTX, size_t NOUTY, size_t NINX, size_t NINY, size_t kernelX, size_t kernelY, size_t strideY, size_t strideX,
-			size_t outChannels, size_t inChannels, actfunc_t type);
+			size_t outChannels, size_t inChannels, actfunc_t type, size_t dilationY = 1, size_t dilationX = 1, size_t groups = 1);
 		ConvolutionalLayer(size_t NOUTX, size_t NOUTY, size_t NINX, size_t NINY, size_t kernelX, size_t kernelY, size_t strideY, size_t strideX,
-			size_t outChannels, size_t inChannels, actfunc_t type, CNetLayer& lower);
-		ConvolutionalLayer(size_t NOUTXY, size_t NINXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type);
-		ConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type, CNetLayer& lower);
+			size_t outChannels, size_t inChannels, actfunc_t type, CNetLayer& lower, size_t dilationY = 1, size_t dilationX = 1, size_t groups = 1);
+		ConvolutionalLayer(size_t NOUTXY, size_t NINXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type, size_t dilation = 1, size_t groups = 1);
+		ConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type, CNetLayer& lower, size_t dilation = 1, size_t groups = 1);
 		~ConvolutionalLayer();
 		
 		layer_t whoAmI() const;
+		CNetLayer* replicate() const;
 		// propagation 
 		// forProp
 		void forProp(MAT& in, bool training, bool recursive);
+		void infer(MAT& in, InferenceContext& context, size_t layer) const;
 		MAT w_grad(MAT& input);
 		MAT b_grad();
 		void backPropDelta(MAT& delta, bool recursive);
@@ -32,7 +35,17 @@ class ConvolutionalLayer : public PhysicalLayer{
 		inline size_t getNINY() const { return NINY; };
 		inline size_t getKernelX() const { return kernelX; };
 		inline size_t getKernelY() const { return kernelY; };
+		inline size_t getDilationX() const { return dilationX; };
+		inline size_t getDilationY() const { return dilationY; };
+		inline size_t getGroups() const { return groups; };
+		bool planeShape(size_t& planeY, size_t& planeX) const;
 		uint32_t getOutChannels() const;
+		// Execution paths - heuristic at construction, measured by tune() (see CNet::tune)
+		void setAlgorithm(convalgo_t algorithm, convalgo_t gradAlgorithm);
+		inline convalgo_t getAlgorithm() const { return algorithm; };
+		inline convalgo_t getGradAlgorithm() const { return gradAlgorithm; };
+		string tuneKey() const;
+		void tune(size_t repetitions);
 		//Initialization Routine
 		void constrainToMax(MAT& mues, MAT& sigma);
 
@@ -66,11 +79,30 @@ class ConvolutionalLayer : public PhysicalLayer{
 		size_t kernelY;
 		size_t strideX;
 		size_t strideY;
+		size_t dilationX; // spacing of the kernel taps, 1 for a dense kernel
+		size_t dilationY;
+		size_t groups; // channel groups, 1 connects every in-channel to every out-channel
 		size_t inChannels;
 		size_t outChannels;
 		size_t features;
 		void assertGeometry();
 
+		// Execution paths of the forward/delta convolutions and of the kernel gradient
+		convalgo_t algorithm;
+		convalgo_t gradAlgorithm;
+		CONVFUNC directKernel; // conv_ or a specialized instance
+		bool fusedBackward; // delta and kernel gradient in one pass (convBackward_)
+		MAT colBuffer; // im2col buffer, kept alive between calls
+		MAT winogradBuffer; // Winograd workspace, shared by forward and delta propagation
+		MAT flippedW; // W flipped for the Winograd delta propagation (flipKernel_)
+		FFTConvolution fftEngine; // keeps plans and kernel spectra
+		void selectAlgorithm();
+		// on sample column "sample" of a minibatch, into result (a column of the output) or onto grad
+		void forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue);
+		void forwardConv(const MAT& input, size_t sample, fREAL* result, const ConvEpilogue& epilogue, MAT& cols, MAT& winograd, FFTConvolution& fft) const; // on given workspaces
+		void deltaConv(const MAT& delta, const MAT& input, size_t sample, fREAL* result);
+		void kernelGrad(const MAT& input, const MAT& delta, size_t sample, MAT& grad, bool accumulate);
+
 		// File functions
 		void saveToFile(ostream& os) const;
 		void loadFromFile(ifstream& in);
@@ -4,47 +4,43 @@
 
 // Constructors
 DropoutLayer::DropoutLayer(fREAL _ratio, size_t NIN ) : ratio(_ratio), DiscarnateLayer(NIN, NIN, actfunc_t::NONE) {
-	init();
 	assertGeometry();
 }
 
 DropoutLayer::DropoutLayer(fREAL _ratio, CNetLayer& lower) : ratio(_ratio), DiscarnateLayer(lower.getNOUT(), actfunc_t::NONE, lower) {
-	init();
 	assertGeometry();
 }
-
-void DropoutLayer::init() {
-	/* This matrix type is automatically initialized.
-	*/
-	//permut = PermutationMatrix<Dynamic, Dynamic>(getNIN());
-	//permut.setIdentity();
-	zeroOne = MAT(getNIN(), 1);
-	zeroOne.setOnes();
-}
 layer_t DropoutLayer::whoAmI() const {
 	return layer_t::dropout;
 }
-void DropoutLayer::round() {
-	for (size_t i = 0; i < getNIN(); ++i) {
-		zeroOne(i, 0) = abs(zeroOne(i, 0)) < ratio ? 0.0f : 1.0f;
+CNetLayer* DropoutLayer::replicate() const { return new DropoutLayer(*this); }
+bool DropoutLayer::planeShape(size_t& NOUTY, size_t& NOUTX) const {
+	return below && below->planeShape(NOUTY, NOUTX); // element-wise - same geometry as the layer below
+}
+void DropoutLayer::round(MAT& mask) const {
+	for (size_t s = 0; s < static_cast<size_t>(mask.cols()); ++s) {
+		for (size_t i = 0; i < getNIN(); ++i) {
+			mask(i, s) = abs(mask(i, s)) < ratio ? 0.0f : 1.0f;
+		}
 	}
-
 }
-void DropoutLayer::randomize() {
-	zeroOne.setRandom(); // [-1,1]
-	round();
+void DropoutLayer::randomize(MAT& mask, size_t samples) const {
+	mask.resize(getNIN(), samples); // keeps the storage at a steady batch size
+	mask.setRandom(); // [-1,1]
+	round(mask);
 }
 void DropoutLayer::forProp(MAT& in, bool saveActivation, bool recursive) {
 	if (saveActivation) {
-		// (1) shuffle indices
-		randomize();
+		// (1) shuffle indices - the mask stays in the layer state for backPropDelta
+		MAT& mask = passState().noise;
+		randomize(mask, in.cols());
 		//(2) Set stuff to zero
 		//setZeroAtIndex(in, permut.indices().cast<size_t>(), (size_t)(ratio*getNIN()));
-		in.cwiseProduct(zeroOne);
+		in.array() *= mask.array();
 		//(3) Resize down to NOUT (conserves top rows)
 		in *= (1.0f + ratio);
 		// (4) Pass on
-		actSave = in;
+		actSave() = in;
 		if (getHierachy() != hierarchy_t::output && recursive)
 			above->forProp(in, saveActivation, recursive);
 	} else {
@@ -53,9 +49,11 @@ void DropoutLayer::forProp(MAT& in, bool saveActivation, bool recursive) {
 	}
 	
 }
+// Dropout is the identity outside of training.
+void DropoutLayer::infer(MAT& /*in*/, InferenceContext& /*context*/, size_t /*layer*/) const {}
 
 void DropoutLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
-	deltaSave = deltaAbove;
+	deltaSave() = deltaAbove;
 
 	if (getHierachy() != hierarchy_t::input) {
 		// we make use of a C++11 construct below
@@ -65,7 +63,7 @@ void DropoutLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
 		//deltaSave = permut.indices().unaryExpr(deltaAbove).cast<fREAL>();
 		/////// DOESN'T Work with VC
 		//setZeroAtIndex(deltaAbove, permut.indices().cast<size_t>(), (size_t)(ratio*getNIN()));
-		deltaAbove.cwiseProduct(zeroOne);
+		deltaAbove.array() *= passState().noise.array(); // the masks of the forward pass
 		deltaAbove *=(1.0f+ratio); 
 		
 		if (recursive) {
@@ -15,26 +15,23 @@ public:
 
 	~DropoutLayer();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
+	bool planeShape(size_t& NOUTY, size_t& NOUTX) const;
 
 	// propagation
 	void forProp(MAT& in, bool saveActivation, bool recursive);
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 	inline fREAL getRatio() const { return ratio; };
 
 private:
 	void saveToFile(ostream& os) const;
 	void loadFromFile(ifstream& in);
-	void init();
 	//void shuffleIndices();
-	void randomize();
-	void round();
+	void randomize(MAT& mask, size_t samples) const; // a fresh mask for every sample of the batch
+	void round(MAT& mask) const;
 	void assertGeometry();
 	fREAL ratio;
-	/* Keep a list of indices 
-	* and shuffle before every forward pass
-	* then, only forward the first NOUT indices.
-	*/
-	MAT zeroOne;
 	//PermutationMatrix<Dynamic,Dynamic> permut;
 };
 #endif
\ No newline at end of file
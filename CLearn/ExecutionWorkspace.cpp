@@ -0,0 +1,11 @@
+#include "stdafx.h"
+#include "ExecutionWorkspace.h"
+
+ExecutionWorkspace::ExecutionWorkspace() {
+	states = std::deque<LayerState>();
+}
+
+void ExecutionWorkspace::reserve(size_t layers) {
+	if (states.size() < layers)
+		states.resize(layers);
+}
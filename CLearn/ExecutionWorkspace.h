@@ -0,0 +1,45 @@
+#pragma once
+#include "defininitions.h"
+#include "StepArena.h"
+#include <deque>
+#ifndef CNET_EXECUTIONWORKSPACE
+#define CNET_EXECUTIONWORKSPACE
+
+/* What a training pass leaves in a layer for the passes that follow it.
+*  forProp saves the pre-activations, backPropDelta the deltas, applyUpdate reads both.
+*/
+struct LayerState {
+	MAT act; // pre-activation (NOUT,B) - actSave
+	MAT delta; // delta (NOUT,B) - deltaSave
+	MAT spatial; // separable convolution: depthwise output (NOUTY*NOUTX*inChannels, B)
+	MAT spatialDelta; // separable convolution: delta of the depthwise output
+	MATINDEX indexX; // max pooling: argmax positions (NOUTY, channels*NOUTX*B)
+	MATINDEX indexY;
+	MAT mixture; // mixture density: the parameters the network put out (NIN,B)
+	MAT noise; // dropout: mask (NIN,B), Gaussian reparametrization: eps (NOUT,B) - one column per sample
+};
+
+/* Caller-owned activations and deltas of CNet::forProp/backProp
+*  Without a workspace, every layer keeps its own LayerState. A layer shared between nets (CNet::shareLayers) then holds the
+*  state of whichever net ran last. Bound to a workspace (CNet::bindWorkspace), the layers of a net keep their state in it instead,
+*  one entry per layer position. With a workspace per net, or per pass that is still in flight, the state of a shared layer
+*  survives the passes of other nets and nothing has to be recomputed.
+*  A workspace belongs to one net (or to nets of the same length). Its entries keep their addresses when it grows.
+*  The layers point into the workspace until another one is bound - unbind (CNet::unbindWorkspace) before destroying it.
+*  The forProp/backProp overloads that take a workspace bind it for that pass only and restore the previous binding.
+*/
+class ExecutionWorkspace {
+public:
+	ExecutionWorkspace();
+	// Called by CNet::bindWorkspace - adds fresh (empty) entries up to layers
+	void reserve(size_t layers);
+	inline LayerState& state(size_t layer) { return states[layer]; };
+	inline size_t size() const { return states.size(); };
+	inline StepArena& stepArena() { return arena; }; // buffers of the training steps run on this workspace
+
+private:
+	std::deque<LayerState> states; // deque - growing does not move the bound entries
+	StepArena arena;
+};
+
+#endif
@@ -0,0 +1,286 @@
+#include "stdafx.h"
+#include "FFTConvolution.h"
+#include <omp.h>
+
+FFTConvolution::FFTConvolution() {}
+
+/* Smallest transform size >= minSize that is a multiple of 4 (fast real transforms) with prime factors 2, 3, 5 only.
+*/
+size_t FFTConvolution::transformSize(size_t minSize) {
+	for (size_t n = std::max(minSize, size_t(4));; ++n) {
+		if (n % 4 != 0)
+			continue;
+		size_t rest = n;
+		while (rest % 2 == 0) rest /= 2;
+		while (rest % 3 == 0) rest /= 3;
+		while (rest % 5 == 0) rest /= 5;
+		if (rest == 1)
+			return n;
+	}
+}
+void FFTConvolution::clearCache() {
+	cachedKernel = MAT(0, 0);
+	kernelSpectra.clear();
+}
+/* Convolution with stride 1 - same as conv_.
+*  out[outF](j,i) = sum_inF sum_m,n k[f](m,n) in[inF](j+m-paddingY, i+n-paddingX) is a correlation: IFFT(conj(K) .* IN) at (j-paddingY, i-paddingX).
+*/
+void FFTConvolution::conv(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t paddingY, size_t paddingX,
+	size_t features, size_t outChannels, size_t inChannels, const ConvEpilogue& epilogue) {
+
+	// (1) Geometry of the situation - the correlation is nonzero on [-(kernel-1), NIN-1]
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t kernelY = kernel.rows();
+	size_t kernelX = kernel.cols() / features;
+	size_t PY = transformSize(std::max(NINY, NOUTY) + std::max(kernelY - 1, paddingY));
+	size_t PX = transformSize(std::max(NINX, NOUTX) + std::max(kernelX - 1, paddingX));
+	prepareLines(PY, PX);
+
+	// (2) Spectra
+	const std::vector<CMAT>& kernelSpec = getKernelSpectra(kernel, features, PY, PX);
+	std::vector<CMAT>& inSpec = convInput;
+	planeSpectra(in, NINY, NINX, inChannels, PY, PX, inSpec);
+
+	// (3) Multiply and transform back
+	MATMAP out(result, NOUTY, NOUTX*outChannels);
+	int32_t outF = 0;
+	#pragma omp parallel for private(outF) shared(out, kernelSpec, inSpec)
+	for (outF = 0; outF < outChannels; ++outF) {
+		Lines& scratch = threadLines();
+		CMATMAP acc(scratch.acc.data(), PY / 2 + 1, PX);
+		acc.setZero();
+		for (size_t inF = 0; inF < inChannels; ++inF) {
+			acc += kernelSpec[inF + outF*inChannels].conjugate().cwiseProduct(inSpec[inF]);
+		}
+		inverse2D(engine(), scratch, acc, PY, PX, -int32_t(paddingY), -int32_t(paddingX), NOUTY, NOUTX, &out(0, outF*NOUTX), NOUTY, false);
+		epilogue(result, outF*NOUTY*NOUTX, (outF + 1)*NOUTY*NOUTX);
+	}
+}
+/* Anticonvolution with stride 1 - same as antiConv_.
+*  out[outF](y,x) = sum_inF sum_m,n k[f](m,n) in[inF](y+paddingY-m, x+paddingX-n) is a true convolution: IFFT(K .* IN) at (y+paddingY, x+paddingX).
+*/
+void FFTConvolution::antiConv(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t paddingY, size_t paddingX,
+	size_t features, size_t outChannels, size_t inChannels, const ConvEpilogue& epilogue) {
+
+	// (1) Geometry of the situation - the convolution is nonzero on [0, NIN+kernel-2]
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t kernelY = kernel.rows();
+	size_t kernelX = kernel.cols() / features;
+	size_t PY = transformSize(std::max(NINY + kernelY - 1, NOUTY + paddingY));
+	size_t PX = transformSize(std::max(NINX + kernelX - 1, NOUTX + paddingX));
+	prepareLines(PY, PX);
+
+	// (2) Spectra
+	const std::vector<CMAT>& kernelSpec = getKernelSpectra(kernel, features, PY, PX);
+	std::vector<CMAT>& inSpec = antiConvInput;
+	planeSpectra(in, NINY, NINX, inChannels, PY, PX, inSpec);
+
+	// (3) Multiply and transform back
+	MATMAP out(result, NOUTY, NOUTX*outChannels);
+	int32_t outF = 0;
+	#pragma omp parallel for private(outF) shared(out, kernelSpec, inSpec)
+	for (outF = 0; outF < outChannels; ++outF) {
+		Lines& scratch = threadLines();
+		CMATMAP acc(scratch.acc.data(), PY / 2 + 1, PX);
+		acc.setZero();
+		for (size_t inF = 0; inF < inChannels; ++inF) {
+			acc += kernelSpec[outF + inF*outChannels].cwiseProduct(inSpec[inF]);
+		}
+		inverse2D(engine(), scratch, acc, PY, PX, int32_t(paddingY), int32_t(paddingX), NOUTY, NOUTX, &out(0, outF*NOUTX), NOUTY, false);
+		epilogue(result, outF*NOUTY*NOUTX, (outF + 1)*NOUTY*NOUTX);
+	}
+}
+/* Kernel gradient of conv with stride 1 - same as convGrad_.
+*  grad[f](j,i) = sum_m,n delta[outF](m,n) in[inF](j+m-paddingY, i+n-paddingX): IFFT(conj(DELTA) .* IN) at (j-paddingY, i-paddingX).
+*/
+void FFTConvolution::convGrad(const MATREF& in, const MATREF& delta, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t paddingY, size_t paddingX,
+	size_t features, size_t outChannels, size_t inChannels) {
+
+	// (1) Geometry of the situation - the correlation is nonzero on [-(deltaY-1), NINY-1]
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t deltaY = delta.rows();
+	size_t deltaX = delta.cols() / outChannels;
+	size_t PY = transformSize(std::max(NINY, kernelY) + std::max(deltaY - 1, paddingY));
+	size_t PX = transformSize(std::max(NINX, kernelX) + std::max(deltaX - 1, paddingX));
+	prepareLines(PY, PX);
+
+	// (2) Spectra
+	std::vector<CMAT>& inSpec = gradInput;
+	std::vector<CMAT>& deltaSpec = gradDelta;
+	planeSpectra(in, NINY, NINX, inChannels, PY, PX, inSpec);
+	planeSpectra(delta, deltaY, deltaX, outChannels, PY, PX, deltaSpec);
+
+	// (3) Multiply and transform back
+	if (!accumulate)
+		kernelGrad.resize(kernelY, kernelX*features);
+	int32_t f = 0;
+	#pragma omp parallel for private(f) shared(kernelGrad, inSpec, deltaSpec)
+	for (f = 0; f < features; ++f) {
+		size_t inF = f % inChannels; // f = inF + outF*inChannels
+		size_t outF = f / inChannels;
+		Lines& scratch = threadLines();
+		CMATMAP acc(scratch.acc.data(), PY / 2 + 1, PX);
+		acc = deltaSpec[outF].conjugate().cwiseProduct(inSpec[inF]);
+		inverse2D(engine(), scratch, acc, PY, PX, -int32_t(paddingY), -int32_t(paddingX), kernelY, kernelX, &kernelGrad(0, f*kernelX), kernelY, accumulate);
+	}
+}
+/* Kernel gradient of antiConv with stride 1 - same as antiConvGrad_.
+*  grad[f](j,i) = sum_m,n in[inF](m,n) delta[outF](j+m-paddingY, i+n-paddingX): IFFT(conj(IN) .* DELTA) at (j-paddingY, i-paddingX).
+*/
+void FFTConvolution::antiConvGrad(const MATREF& delta, const MATREF& in, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t paddingY, size_t paddingX,
+	size_t features, size_t outChannels, size_t inChannels) {
+
+	// (1) Geometry of the situation - the correlation is nonzero on [-(NINY-1), deltaY-1]
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t deltaY = delta.rows();
+	size_t deltaX = delta.cols() / outChannels;
+	size_t PY = transformSize(std::max(deltaY, kernelY) + std::max(NINY - 1, paddingY));
+	size_t PX = transformSize(std::max(deltaX, kernelX) + std::max(NINX - 1, paddingX));
+	prepareLines(PY, PX);
+
+	// (2) Spectra
+	std::vector<CMAT>& inSpec = gradInput;
+	std::vector<CMAT>& deltaSpec = gradDelta;
+	planeSpectra(in, NINY, NINX, inChannels, PY, PX, inSpec);
+	planeSpectra(delta, deltaY, deltaX, outChannels, PY, PX, deltaSpec);
+
+	// (3) Multiply and transform back
+	if (!accumulate)
+		kernelGrad.resize(kernelY, kernelX*features);
+	int32_t f = 0;
+	#pragma omp parallel for private(f) shared(kernelGrad, inSpec, deltaSpec)
+	for (f = 0; f < features; ++f) {
+		size_t outF = f % outChannels; // f = outF + inF*outChannels
+		size_t inF = f / outChannels;
+		Lines& scratch = threadLines();
+		CMATMAP acc(scratch.acc.data(), PY / 2 + 1, PX);
+		acc = inSpec[inF].conjugate().cwiseProduct(deltaSpec[outF]);
+		inverse2D(engine(), scratch, acc, PY, PX, -int32_t(paddingY), -int32_t(paddingX), kernelY, kernelX, &kernelGrad(0, f*kernelX), kernelY, accumulate);
+	}
+}
+// Size v to at least n elements - returns 1 if that allocated
+template<typename T>
+static size_t grow(std::vector<T>& v, size_t n) {
+	if (v.size() >= n)
+		return 0;
+	size_t allocated = v.capacity() < n ? 1 : 0;
+	v.resize(n);
+	return allocated;
+}
+/* Engines and lines of every thread for transforms of size (PY, PX).
+*  Called before the parallel regions, so that growth is counted on the calling thread.
+*/
+void FFTConvolution::prepareLines(size_t PY, size_t PX) {
+	size_t threads = omp_get_max_threads();
+	if (engines.size() < threads) {
+		engines.resize(threads, FFT<fREAL>(FFT<fREAL>::impl_type(), FFT<fREAL>::Flag(FFT<fREAL>::HalfSpectrum | FFT<fREAL>::Unscaled)));
+	}
+	if (lines.size() < threads) {
+		lines.resize(threads);
+	}
+	size_t grown = 0;
+	for (Lines& scratch : lines) {
+		grown += grow(scratch.acc, (PY / 2 + 1)*PX) + grow(scratch.row, PX) + grow(scratch.rowTransform, PX) + grow(scratch.column, PY);
+	}
+	countKernelBuffers(grown);
+}
+/* Kernel spectra for transform size (PY, PX). Cached until the kernel changes, then recomputed in place.
+*/
+const std::vector<CMAT>& FFTConvolution::getKernelSpectra(const MATREF& kernel, size_t features, size_t PY, size_t PX) {
+	if (cachedKernel.rows() != kernel.rows() || cachedKernel.cols() != kernel.cols() || cachedKernel != kernel) {
+		cachedKernel = kernel;
+		for (std::pair<const std::pair<size_t, size_t>, KernelSpectra>& entry : kernelSpectra)
+			entry.second.current = false;
+	}
+	KernelSpectra& spectra = kernelSpectra[std::pair<size_t, size_t>(PY, PX)]; // new entries are not current
+	if (!spectra.current) {
+		planeSpectra(kernel, kernel.rows(), kernel.cols() / features, features, PY, PX, spectra.planes);
+		spectra.current = true;
+	}
+	return spectra.planes;
+}
+/* Spectra of all channel planes of a tensor view, into spectra. Only reallocates if the transform size changed.
+*/
+void FFTConvolution::planeSpectra(const MATREF& in, size_t NY, size_t NX, size_t channels, size_t PY, size_t PX, std::vector<CMAT>& spectra) {
+	size_t grown = spectra.capacity() < channels ? 1 : 0;
+	spectra.resize(channels);
+	for (CMAT& spectrum : spectra) {
+		if (static_cast<size_t>(spectrum.rows()) != PY / 2 + 1 || static_cast<size_t>(spectrum.cols()) != PX) {
+			spectrum.resize(PY / 2 + 1, PX);
+			++grown;
+		}
+	}
+	countKernelBuffers(grown);
+	int32_t c = 0;
+	#pragma omp parallel for private(c) shared(spectra, in)
+	for (c = 0; c < channels; ++c) {
+		forward2D(engine(), threadLines(), in.data() + c*NX*in.outerStride(), in.outerStride(), NY, NX, PY, PX, spectra[c]);
+	}
+}
+FFT<fREAL>& FFTConvolution::engine() {
+	return engines[omp_get_thread_num()];
+}
+FFTConvolution::Lines& FFTConvolution::threadLines() {
+	return lines[omp_get_thread_num()];
+}
+/* Real 2D transform of a zero-padded (PY, PX) plane. Only the non-negative frequencies along y are kept: spectrum is (PY/2+1, PX).
+*/
+void FFTConvolution::forward2D(FFT<fREAL>& fft, Lines& scratch, const fREAL* plane, size_t ld, size_t NY, size_t NX, size_t PY, size_t PX, CMAT& spectrum) {
+	// (1) Real transforms along the contiguous columns
+	fREAL* column = scratch.column.data();
+	std::fill(column + NY, column + PY, fREAL(0));
+	for (size_t i = 0; i < NX; ++i) {
+		std::copy(plane + i*ld, plane + i*ld + NY, column);
+		fft.fwd(&spectrum(0, i), column, PY);
+	}
+	spectrum.rightCols(PX - NX).setZero();
+
+	// (2) Complex transforms along the rows
+	CPLX* row = scratch.row.data();
+	CPLX* rowSpectrum = scratch.rowTransform.data();
+	for (size_t j = 0; j < spectrum.rows(); ++j) {
+		for (size_t i = 0; i < PX; ++i)
+			row[i] = spectrum(j, i);
+		fft.fwd(rowSpectrum, row, PX);
+		for (size_t i = 0; i < PX; ++i)
+			spectrum(j, i) = rowSpectrum[i];
+	}
+}
+/* Inverse of forward2D. Writes the (NY, NX) window starting at (shiftY, shiftX) of the circular result into plane, or adds it if accumulate is set.
+*  spectrum is overwritten.
+*/
+void FFTConvolution::inverse2D(FFT<fREAL>& fft, Lines& scratch, CMATMAP& spectrum, size_t PY, size_t PX, int32_t shiftY, int32_t shiftX, size_t NY, size_t NX, fREAL* plane, size_t ld, bool accumulate) {
+	// (1) Complex transforms along the rows
+	CPLX* row = scratch.row.data();
+	CPLX* rowSignal = scratch.rowTransform.data();
+	for (size_t j = 0; j < spectrum.rows(); ++j) {
+		for (size_t i = 0; i < PX; ++i)
+			row[i] = spectrum(j, i);
+		fft.inv(rowSignal, row, PX);
+		for (size_t i = 0; i < PX; ++i)
+			spectrum(j, i) = rowSignal[i];
+	}
+
+	// (2) Real transforms along the columns that are needed
+	const fREAL scale = fREAL(1) / (PY*PX); // transforms are unscaled
+	fREAL* column = scratch.column.data();
+	for (size_t i = 0; i < NX; ++i) {
+		int32_t x = (int32_t(i) + shiftX) % int32_t(PX);
+		if (x < 0)
+			x += PX;
+		fft.inv(column, &spectrum(0, x), PY);
+		for (size_t j = 0; j < NY; ++j) {
+			int32_t y = (int32_t(j) + shiftY) % int32_t(PY);
+			if (y < 0)
+				y += PY;
+			if (accumulate)
+				plane[j + i*ld] += scale*column[y];
+			else
+				plane[j + i*ld] = scale*column[y];
+		}
+	}
+}
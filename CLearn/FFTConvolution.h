@@ -0,0 +1,60 @@
+#pragma once
+#include "defininitions.h"
+#include "unsupported/Eigen/FFT"
+#include <complex>
+#include <map>
+#ifndef CNET_FFTCONVOLUTION
+#define CNET_FFTCONVOLUTION
+
+typedef std::complex<fREAL> CPLX;
+typedef Matrix<CPLX, Dynamic, Dynamic> CMAT;
+typedef Map<CMAT> CMATMAP;
+
+/* FFT-based engine for stride-1 convolutions with large kernels.
+*  conv, antiConv, convGrad and antiConvGrad compute the same flat tensors as conv_, antiConv_, convGrad_ and antiConvGrad_ with stride 1,
+*  into caller-provided memory like those.
+*  - Planes are zero-padded to a transform size with prime factors 2, 3, 5 only, large enough to avoid circular wrap-around.
+*  - Plans (twiddle factors) are kept by the FFT objects, one per thread.
+*  - Kernel spectra are cached per transform size until the kernel changes, so forward and delta propagation share them.
+*  - Kernel spectra are refreshed in place and the input spectra are kept per method - a layer calls each method with one geometry.
+*    Accumulators and transform lines are per thread and only grow. Only growth allocates (counted with countKernelBuffers).
+*/
+class FFTConvolution {
+public:
+	FFTConvolution();
+
+	void conv(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, const ConvEpilogue& epilogue = ConvEpilogue());
+	void antiConv(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, const ConvEpilogue& epilogue = ConvEpilogue());
+	void convGrad(const MATREF& in, const MATREF& delta, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels);
+	void antiConvGrad(const MATREF& delta, const MATREF& in, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels);
+
+	static size_t transformSize(size_t minSize);
+	void clearCache();
+
+private:
+	struct Lines { // scratch of one thread
+		std::vector<CPLX> acc; // spectral products (PY/2+1, PX)
+		std::vector<CPLX> row;
+		std::vector<CPLX> rowTransform;
+		std::vector<fREAL> column;
+	};
+	struct KernelSpectra {
+		bool current; // false once the kernel changed
+		std::vector<CMAT> planes;
+	};
+	std::vector<FFT<fREAL>> engines; // one per thread
+	std::vector<Lines> lines; // one per thread
+	MAT cachedKernel;
+	std::map<std::pair<size_t, size_t>, KernelSpectra> kernelSpectra;
+	std::vector<CMAT> convInput, antiConvInput, gradInput, gradDelta; // input spectra of the methods
+
+	void prepareLines(size_t PY, size_t PX);
+	const std::vector<CMAT>& getKernelSpectra(const MATREF& kernel, size_t features, size_t PY, size_t PX);
+	void planeSpectra(const MATREF& in, size_t NY, size_t NX, size_t channels, size_t PY, size_t PX, std::vector<CMAT>& spectra);
+	FFT<fREAL>& engine();
+	Lines& threadLines();
+	void forward2D(FFT<fREAL>& fft, Lines& scratch, const fREAL* plane, size_t ld, size_t NY, size_t NX, size_t PY, size_t PX, CMAT& spectrum);
+	void inverse2D(FFT<fREAL>& fft, Lines& scratch, CMATMAP& spectrum, size_t PY, size_t PX, int32_t shiftY, int32_t shiftX, size_t NY, size_t NX, fREAL* plane, size_t ld, bool accumulate);
+};
+
+#endif
@@ -19,14 +19,15 @@ FullyConnectedLayer::~FullyConnectedLayer() {}
 layer_t FullyConnectedLayer::whoAmI() const {
 	return layer_t::fullyConnected;
 }
+CNetLayer* FullyConnectedLayer::replicate() const { return new FullyConnectedLayer(*this); }
 // init
 void FullyConnectedLayer::init() {
 
 	//W /= getNIN(); //sqrt(sqrt(getNOUT()*getNIN())); // ... but small.
 	//b.setZero(); // set bias terms zero
 
-	assert(actSave.rows() == getNOUT());
-	assert(deltaSave.rows() == getNOUT());
+	assert(actSave().rows() == getNOUT());
+	assert(deltaSave().rows() == getNOUT());
 	assert(W.rows() == getNOUT());
 	assert(W.cols() == getNIN());
 }
@@ -98,7 +99,9 @@ MAT FullyConnectedLayer::wnorm_vGrad(const MAT& grad, MAT& ggrad) {
 }
 
 MAT FullyConnectedLayer::b_grad() {
-	return deltaSave;
+	MAT grad = takeBuffer(getNOUT(), 1);
+	grad.noalias() = deltaSave().rowwise().sum();
+	return grad;
 }
 /* Initialization Routine
 */
@@ -109,14 +112,23 @@ void FullyConnectedLayer::constrainToMax(MAT & mues, MAT & maxVec) {
 	}
 }
 
+void FullyConnectedLayer::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const {
+	MAT out = weights()*in;
+	out.colwise() += bias().col(0);
+	in = out.unaryExpr(act);
+}
 void FullyConnectedLayer::forProp(MAT& inBelow, bool training, bool recursive) {
 
+	// A minibatch (NIN,B) turns the matrix-vector product into a single GEMM.
 	if (training) {
 		/* normal training forward pass
 		*/
 		// Eigen assumes aliasing by default for matrix products A*B type situations
-		actSave.noalias() = W*inBelow + b; // save the activations before non-linearity
-		inBelow = move(getACT());
+		actSave() = bias().replicate(1, inBelow.cols());
+		actSave().noalias() += weights()*inBelow; // save the activations before non-linearity
+		MAT out = takeBuffer(getNOUT(), inBelow.cols());
+		out = actSave().unaryExpr(act);
+		passOn(inBelow, out);
 		if (recursive&& getHierachy() != hierarchy_t::output)
 			above->forProp(inBelow, true, true);
 		
@@ -125,8 +137,11 @@ void FullyConnectedLayer::forProp(MAT& inBelow, bool training, bool recursive) {
 		*/
 		//MAT temp;
 		// Eigen assumes aliasing by default for matrix products A*B type situations
-		inBelow = (W*inBelow + b).unaryExpr(act);
-		//inBelow = move(temp);
+		MAT out = takeBuffer(getNOUT(), inBelow.cols());
+		out.noalias() = weights()*inBelow;
+		out.colwise() += bias().col(0);
+		out = out.unaryExpr(act);
+		passOn(inBelow, out);
 		if (recursive && getHierachy() != hierarchy_t::output)
 			above->forProp(inBelow, false, true);
 		
@@ -135,11 +150,13 @@ void FullyConnectedLayer::forProp(MAT& inBelow, bool training, bool recursive) {
 
 void FullyConnectedLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
 	//DACT(inAct).cwiseProduct(hiddenLayers[0].leftCols(hiddenLayers[0].cols() - 1).transpose()*hiddenDeltas[0]);
-	deltaAbove = deltaAbove.cwiseProduct(getDACT());
-	deltaSave = deltaAbove;
+	deltaAbove.array() *= actSave().unaryExpr(dact).array();
+	deltaSave() = deltaAbove;
 
 	if (getHierachy() != hierarchy_t::input) {
-		deltaAbove =  W.transpose() * deltaAbove; // (NIN,1) cw* (NOUT, NIN).T x (NOUT, 1) = (NIN,1) cw* (NIN, 1) = (NIN,1) 
+		MAT newDelta = takeBuffer(getNIN(), deltaAbove.cols());
+		newDelta.noalias() = weights().transpose() * deltaAbove; // (NIN,1) cw* (NOUT, NIN).T x (NOUT, 1) = (NIN,1) cw* (NIN, 1) = (NIN,1) 
+		passOn(deltaAbove, newDelta);
 		if (recursive)
 			below->backPropDelta(deltaAbove, true);
 	}
@@ -147,17 +164,22 @@ void FullyConnectedLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
 /* Same dimensionality as layer.
 */
 MAT FullyConnectedLayer::w_grad(MAT& input) {
+	MAT grad = takeBuffer(W.rows(), W.cols());
 	if (getHierachy() == hierarchy_t::input) {
-		return deltaSave*(input.transpose()); //(NOUT, 1) x (NIN+1,1).T = (NOUT, NIN+1)
+		grad.noalias() = deltaSave()*(input.transpose()); //(NOUT, B) x (NIN, B).T = (NOUT, NIN) - summed over the batch
 	} else {
 		//if (kappa > 0.0f) {
 		//	MAT temp = appendOneInline(below->getACT()).transpose();
 		//	return (deltaSave + kappa*getDACT())*temp;
 		//} else { // if no l2-reg applied, don't even store the temp matrix
-		return deltaSave*((below->getACT()).transpose());
+		MAT fromBelow;
+		takeBelowACT(fromBelow);
+		grad.noalias() = deltaSave()*(fromBelow.transpose());
+		giveBuffer(fromBelow);
 		//}
 
 	}
+	return grad;
 }
 /* Implementation of spectral norm functions
 */
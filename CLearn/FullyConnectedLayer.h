@@ -11,9 +11,11 @@ class FullyConnectedLayer : public PhysicalLayer {
 		FullyConnectedLayer(size_t NOUT,  actfunc_t type, CNetLayer& lower);
 		~FullyConnectedLayer();
 		layer_t whoAmI() const;
+		CNetLayer* replicate() const;
 
 		// forProp
 		void forProp(MAT& in, bool training, bool recursive);
+		void infer(MAT& in, InferenceContext& context, size_t layer) const;
 
 		// backprop
 		void backPropDelta(MAT& delta, bool recursive);
@@ -1,12 +1,12 @@
 #include "stdafx.h"
 #include "GaussianReparametrizationLayer.h"
 
-GaussianReparametrizationLayer::GaussianReparametrizationLayer(size_t NOUT) : ones(NOUT, 1), eps(NOUT, 1), DiscarnateLayer(NOUT, 2*NOUT)
+GaussianReparametrizationLayer::GaussianReparametrizationLayer(size_t NOUT) : ones(NOUT, 1), DiscarnateLayer(NOUT, 2*NOUT)
 {
 	init();
 }
 
-GaussianReparametrizationLayer::GaussianReparametrizationLayer(CNetLayer & lower) : ones(lower.getNOUT()/2, 1), eps(lower.getNOUT()/2, 1), DiscarnateLayer(lower.getNOUT()/2, actfunc_t::NONE, lower)
+GaussianReparametrizationLayer::GaussianReparametrizationLayer(CNetLayer & lower) : ones(lower.getNOUT()/2, 1), DiscarnateLayer(lower.getNOUT()/2, actfunc_t::NONE, lower)
 {
 	init();
 }
@@ -19,45 +19,52 @@ layer_t GaussianReparametrizationLayer::whoAmI() const
 {
 	return layer_t::gaussreparam;
 }
+CNetLayer* GaussianReparametrizationLayer::replicate() const { return new GaussianReparametrizationLayer(*this); }
 
 void GaussianReparametrizationLayer::forProp(MAT & in, bool saveActivation, bool recursive)
 {
 
-	//PRECON in has to be of shape (NOUT, 2) where the zeroth column decodes mu, while the first contains log(sigma)
-	// (0) redraw eps - think about the sequence of this
-	// (0.5) resize in
-	in.resize(getNOUT(), 2); // should leave the values intact
-	// (1) Build out
+	//PRECON in has to be of shape (2*NOUT, B) where the top half of each sample decodes mu, while the bottom half contains log(sigma)
+	// (0) redraw eps for every sample - training keeps it in the layer state for backPropDelta
+	MAT eps;
+	MAT& sampleEps = saveActivation ? passState().noise : eps;
 	if (saveActivation) {
-		actSave = in;
-		in = move(actSave.leftCols(1) + actSave.rightCols(2).unaryExpr(&exp_fREAL).cwiseProduct(eps)); // (NOUT,1) vector
-	} 
-	else 
-	{
-		eps.unaryExpr(&std_normal);
-		in = move(in.leftCols(1) + in.rightCols(1).unaryExpr(&exp_fREAL).cwiseProduct(eps)); // (NOUT,1) vector
+		actSave() = in;
 	}
+	drawEps(sampleEps, in.cols());
+	// (1) Build out
+	MAT out = takeBuffer(getNOUT(), in.cols());
+	out = in.topRows(getNOUT()) + in.bottomRows(getNOUT()).unaryExpr(&exp_fREAL).cwiseProduct(sampleEps); // (NOUT,B)
+	passOn(in, out);
 	
 	if (getHierachy() != hierarchy_t::output && recursive)
 		above->forProp(in, saveActivation, recursive);
 }
 
+// The mean mu - drawing eps would share the random generator between concurrent callers.
+void GaussianReparametrizationLayer::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const
+{
+	MAT out = in.topRows(getNOUT()); // (NOUT,B)
+	in = move(out);
+}
+
 void GaussianReparametrizationLayer::backPropDelta(MAT & delta, bool recursive)
 {
-	// (0) Delta is an (NOUT, 1)-shaped matrix by contract
+	// (0) Delta is an (NOUT, B)-shaped matrix by contract
 	// We need to derive the deltas for {mu, log sigma} and then pass that moster on
-	deltaSave = delta;
+	deltaSave() = delta;
 	static fREAL beta = 0.1;
 	if (getHierachy() != hierarchy_t::input) {
-		MAT newDelta(getNOUT(), 2);
+		size_t samples = delta.cols();
+		MAT newDelta = takeBuffer(2 * getNOUT(), samples);
 
 		// And, like, you know, about this KL-term, 
 		// we simply add the gradient of the Kullback-Leibler divergence, right? 
 
-		newDelta.leftCols(1) = move(beta*delta - actSave.leftCols(1)); // dz/dmu = 1 -> delta = deltahere*deltaAbove = 1*deltaAbove
-		newDelta.rightCols(1) = move(beta*delta.cwiseProduct(actSave.rightCols(1).cwiseProduct(eps))- 0.5f*(actSave.rightCols(1).unaryExpr(&exp_fREAL) - ones)); // dz/dlogsigma = sigma*eps
-		newDelta.resize(2 * getNOUT(), 1); // should leave coeffs untouched
-		delta = newDelta; // (2*NOUT, 1)
+		newDelta.topRows(getNOUT()) = beta*delta - actSave().topRows(getNOUT()); // dz/dmu = 1 -> delta = deltahere*deltaAbove = 1*deltaAbove
+		newDelta.bottomRows(getNOUT()) = beta*delta.cwiseProduct(actSave().bottomRows(getNOUT()).cwiseProduct(passState().noise))
+			- 0.5f*(actSave().bottomRows(getNOUT()).unaryExpr(&exp_fREAL) - ones.replicate(1, samples)); // dz/dlogsigma = sigma*eps
+		passOn(delta, newDelta); // (2*NOUT, B)
 		if (recursive) {
 			below->backPropDelta(delta, true); // cascade...
 		}
@@ -67,10 +74,15 @@ void GaussianReparametrizationLayer::backPropDelta(MAT & delta, bool recursive)
 void GaussianReparametrizationLayer::init()
 {
 	assert(getNIN() == 2 * getNOUT());
-	actSave.resize(getNOUT(), 2);
-	actSave.setZero();
+	actSave().resize(2 * getNOUT(), 1);
+	actSave().setZero();
 	ones.setOnes();
-	eps.unaryExpr(&std_normal);
+}
+
+void GaussianReparametrizationLayer::drawEps(MAT& eps, size_t samples) const
+{
+	eps.resize(getNOUT(), samples); // keeps the storage at a steady batch size
+	eps = eps.unaryExpr(&std_normal);
 }
 
 void GaussianReparametrizationLayer::saveToFile(ostream & os) const
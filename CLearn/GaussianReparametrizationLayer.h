@@ -14,16 +14,18 @@ public:
 
 	~GaussianReparametrizationLayer();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
 
 	// propagation
 	void forProp(MAT& in, bool saveActivation, bool recursive);
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 
 private:
 	void init();
 	void saveToFile(ostream& os) const;
 	void loadFromFile(ifstream& in);
-	MAT eps;
+	void drawEps(MAT& eps, size_t samples) const; // one standard normal column per sample
 	MAT ones;
 };
 
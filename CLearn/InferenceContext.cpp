@@ -0,0 +1,15 @@
+#include "stdafx.h"
+#include "InferenceContext.h"
+
+InferenceContext::InferenceContext() {
+	scratches = vector<LayerScratch>();
+}
+
+void InferenceContext::preFeedSideChannel(const MAT& _sideChannel) {
+	sideChannel = _sideChannel;
+}
+
+void InferenceContext::reserve(size_t layers) {
+	if (scratches.size() < layers)
+		scratches.resize(layers);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "defininitions.h"
+#include "FFTConvolution.h"
+
+#ifndef CNET_INFERENCECONTEXT
+#define CNET_INFERENCECONTEXT
+/* Caller-owned state of CNet::infer
+*  infer only reads the layers. Whatever a forward pass writes - convolution workspaces, FFT kernel spectra, the side channel input -
+*  lives in a context instead, one set of buffers per layer. Threads can therefore run predictions on the same net concurrently,
+*  each one with its own context. A context keeps its buffers between calls, so it should be reused rather than recreated.
+*/
+struct LayerScratch {
+	MAT colBuffer; // im2col
+	MAT winogradBuffer;
+	MAT spatialBuffer; // separable convolution: depthwise output
+	FFTConvolution fftEngine; // plans and kernel spectra of this context
+};
+
+class InferenceContext {
+public:
+	InferenceContext();
+	// Side channel input of this context (a column per sample or one for all) - without it, the net's own (CNet::preFeedSideChannel) is used
+	void preFeedSideChannel(const MAT& sideChannel);
+	inline const MAT& getSideChannel() const { return sideChannel; };
+	// Called by CNet::infer before the pass - references into the context stay valid during the pass
+	void reserve(size_t layers);
+	inline LayerScratch& scratch(size_t layer) { return scratches[layer]; };
+
+private:
+	vector<LayerScratch> scratches;
+	MAT sideChannel;
+};
+
+#endif
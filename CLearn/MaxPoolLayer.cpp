@@ -2,44 +2,67 @@
 #include "stdafx.h"
 #include "MaxPoolLayer.h"
 
+// Output size of pooling the planes of lower
+static size_t pooledSize(const CNetLayer& lower, size_t maxOverY, size_t maxOverX, size_t channels) {
+	size_t NINY, NINX;
+	lower.outputPlanes(channels, NINY, NINX);
+	return channels*(NINY / maxOverY)*(NINX / maxOverX);
+}
+
 // Constructors
-MaxPoolLayer::MaxPoolLayer(size_t NINXY, size_t _maxOverXY, size_t _channels)
-	: channels(_channels), NINX(NINXY), NINY(NINXY), maxOverX(_maxOverXY), maxOverY(_maxOverXY), NOUTX((NINXY / _maxOverXY)), NOUTY((NINXY / _maxOverXY)), 
-	DiscarnateLayer(((int)(NINXY / _maxOverXY))*((int)(NINXY / _maxOverXY)),NINXY*NINXY, actfunc_t::NONE){
+MaxPoolLayer::MaxPoolLayer(size_t _NINY, size_t _NINX, size_t _maxOverY, size_t _maxOverX, size_t _channels)
+	: channels(_channels), NINX(_NINX), NINY(_NINY), maxOverX(_maxOverX), maxOverY(_maxOverY), NOUTX(_NINX / _maxOverX), NOUTY(_NINY / _maxOverY),
+	DiscarnateLayer(_channels*(_NINY / _maxOverY)*(_NINX / _maxOverX), _channels*_NINY*_NINX, actfunc_t::NONE) {
 	init();
 	assertGeometry();
 }
-// This constructor assumes a square input NINX x NINY.
-// However, we 
-MaxPoolLayer::MaxPoolLayer(size_t _maxOverXY, size_t _channels, CNetLayer& lower)
-	: channels(_channels), NINX((int)sqrt(lower.getNOUT()/ _channels)), NINY((int)sqrt(lower.getNOUT() / _channels)),
-	maxOverX(_maxOverXY), maxOverY(_maxOverXY), NOUTX(((int)sqrt(lower.getNOUT() / _channels)) / _maxOverXY), NOUTY(((int)sqrt(lower.getNOUT() / _channels)) / _maxOverXY),
-	DiscarnateLayer(_channels*((int)sqrt(lower.getNOUT() / _channels) / _maxOverXY)*((int)sqrt(lower.getNOUT() / _channels) / _maxOverXY), actfunc_t::NONE, lower) {
+MaxPoolLayer::MaxPoolLayer(size_t _NINY, size_t _NINX, size_t _maxOverY, size_t _maxOverX, size_t _channels, CNetLayer& lower)
+	: channels(_channels), NINX(_NINX), NINY(_NINY), maxOverX(_maxOverX), maxOverY(_maxOverY), NOUTX(_NINX / _maxOverX), NOUTY(_NINY / _maxOverY),
+	DiscarnateLayer(_channels*(_NINY / _maxOverY)*(_NINX / _maxOverX), actfunc_t::NONE, lower) {
 	init();
 	assertGeometry();
 }
+// The input planes are taken from the layer below - squares if it has no geometry of its own.
+MaxPoolLayer::MaxPoolLayer(size_t _maxOverY, size_t _maxOverX, size_t _channels, CNetLayer& lower)
+	: channels(_channels), maxOverX(_maxOverX), maxOverY(_maxOverY),
+	DiscarnateLayer(pooledSize(lower, _maxOverY, _maxOverX, _channels), actfunc_t::NONE, lower) {
+	lower.outputPlanes(channels, NINY, NINX);
+	NOUTY = NINY / maxOverY;
+	NOUTX = NINX / maxOverX;
+	init();
+	assertGeometry();
+}
+MaxPoolLayer::MaxPoolLayer(size_t NINXY, size_t _maxOverXY, size_t _channels) : MaxPoolLayer::MaxPoolLayer(NINXY, NINXY, _maxOverXY, _maxOverXY, _channels) {}
+MaxPoolLayer::MaxPoolLayer(size_t _maxOverXY, size_t _channels, CNetLayer& lower) : MaxPoolLayer::MaxPoolLayer(_maxOverXY, _maxOverXY, _channels, lower) {}
 MaxPoolLayer::MaxPoolLayer(size_t _channels, CNetLayer& lower) : MaxPoolLayer::MaxPoolLayer(2, _channels, lower) {}
 
 MaxPoolLayer::~MaxPoolLayer(){}
 
 void MaxPoolLayer::assertGeometry() {
-	assert(NOUTY*NOUTX*inFeatures == getNOUT());
-	assert(inFeatures*NINX*NINY == getNIN());
+	assert(NOUTY*NOUTX*channels == getNOUT());
+	assert(channels*NINX*NINY == getNIN());
+}
+
+bool MaxPoolLayer::planeShape(size_t& planeY, size_t& planeX) const {
+	planeY = NOUTY;
+	planeX = NOUTX;
+	return true;
 }
 
 void MaxPoolLayer::init() {
-	indexX = MATINDEX(NOUTY, channels*NOUTX);
-	indexX.setConstant(0);
-	indexY = MATINDEX(NOUTY, channels*NOUTX);
-	indexY.setConstant(0);
-	actSave = MAT(getNOUT(), 1); 
-	actSave.setConstant(0);
-	deltaSave = MAT(1, 1);
-	deltaSave.setConstant(0);
+	indexX() = MATINDEX(NOUTY, channels*NOUTX);
+	indexX().setConstant(0);
+	indexY() = MATINDEX(NOUTY, channels*NOUTX);
+	indexY().setConstant(0);
+	actSave() = MAT(getNOUT(), 1); 
+	actSave().setConstant(0);
+	deltaSave() = MAT(1, 1);
+	deltaSave().setConstant(0);
 } 
 layer_t MaxPoolLayer::whoAmI() const {
 	return layer_t::maxPooling;
 }
+CNetLayer* MaxPoolLayer::replicate() const { return new MaxPoolLayer(*this); }
 
 
 void MaxPoolLayer::saveToFile(ostream& os) const {
@@ -56,44 +79,64 @@ void MaxPoolLayer::loadFromFile(ifstream& in) {
 }
 
 void MaxPoolLayer::forProp(MAT& inBelow,  bool training, bool recursive) {
-	inBelow.resize(NINY, channels* NINX);
-	inBelow = maxPool(inBelow, training);
-	inBelow.resize(getNOUT(), 1);
+	size_t samples = inBelow.cols();
+	if (training && (indexX().rows() != NOUTY || indexX().cols() != channels*NOUTX*samples)) {
+		indexX().resize(NOUTY, channels*NOUTX*samples);
+		indexY().resize(NOUTY, channels*NOUTX*samples);
+	}
+	MAT out = takeBuffer(getNOUT(), samples);
+	for (size_t s = 0; s < samples; ++s) {
+		maxPool(tensorView(inBelow, NINY, NINX, channels, s), out.col(s).data(), training ? &indexX() : nullptr, training ? &indexY() : nullptr, s); // flat (NOUT,B) tensor
+	}
+	passOn(inBelow, out);
 	
 	if (training)
-		actSave = inBelow;
+		actSave() = inBelow;
 	if (getHierachy() != hierarchy_t::output) {
 		if(recursive)
 			above->forProp(inBelow,  training, true);
 	}
 }
 
+void MaxPoolLayer::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const {
+	MAT out(getNOUT(), in.cols());
+	for (size_t s = 0; s < in.cols(); ++s) {
+		maxPool(tensorView(in, NINY, NINX, channels, s), out.col(s).data(), nullptr, nullptr, s);
+	}
+	in = move(out);
+}
 void MaxPoolLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
-	deltaSave = deltaAbove;
+	deltaSave() = deltaAbove;
 	if (getHierachy() != hierarchy_t::input) { // ... this is not an input layer.
-		deltaAbove.resize(NOUTY, channels*NOUTX);
-
-		MAT newDelta(NINY, channels*NINX);
+		MAT newDelta = takeBuffer(getNIN(), deltaAbove.cols());
 		newDelta.setConstant(0);
-		for (size_t f = 0; f < channels; ++f) {
-			for (size_t m = 0; m < NOUTY; ++m) {
+		const MATINDEX& maxX = indexX(); // argmax positions of the forward pass
+		const MATINDEX& maxY = indexY();
+		for (size_t s = 0; s < deltaAbove.cols(); ++s) {
+			MATMAP delta = tensorView(deltaAbove, NOUTY, NOUTX, channels, s);
+			MATMAP newDeltaView = tensorView(newDelta, NINY, NINX, channels, s);
+			size_t offset = s*channels*NOUTX; // index planes of this sample
+			for (size_t f = 0; f < channels; ++f) {
 				for (size_t n = 0; n < NOUTX; ++n) {
-					if (indexY(m, n+f*NOUTX) >= 0 && indexY(m, n + f*NOUTX) < NINY
-						&& indexX(m, n + f*NOUTX) >= 0 && indexX(m, n + f*NOUTX) < NINX)
-						newDelta(indexY(m, n + f*NOUTX), indexX(m, n + f*NOUTX)) = deltaAbove(m, n + f*NOUTX);
+					for (size_t m = 0; m < NOUTY; ++m) { // run along the contiguous columns of each plane
+						size_t k = offset + n + f*NOUTX;
+						if (maxY(m, k) >= 0 && maxY(m, k) < NINY
+							&& maxX(m, k) >= 0 && maxX(m, k) < NINX)
+							newDeltaView(maxY(m, k), maxX(m, k) + f*NINX) = delta(m, n + f*NOUTX);
+					}
 				}
 			}
 		}
-		newDelta.resize(getNIN(), 1);
-		deltaAbove = std::move(newDelta); 
+		passOn(deltaAbove, newDelta);
 		if(recursive)
 			below->backPropDelta(deltaAbove, true);
 		
 	}
 }
 
-MAT MaxPoolLayer::maxPool(const MAT& in, bool saveIndices){
-	MAT out( NOUTY, channels*NOUTX );
+void MaxPoolLayer::maxPool(const MATREF& in, fREAL* result, MATINDEX* indicesX, MATINDEX* indicesY, size_t sample) const {
+	bool saveIndices = indicesX && indicesY;
+	MATMAP out(result, NOUTY, channels*NOUTX);
 	static const fREAL initNegative = -1000;
 	
 	fREAL curMax = initNegative;
@@ -102,8 +145,8 @@ MAT MaxPoolLayer::maxPool(const MAT& in, bool saveIndices){
 	size_t jj = -1;
 
 	for (size_t f = 0; f < channels; ++f) {
-		for (size_t j = 0; j < NOUTY; ++j) {
-			for (size_t i = 0; i < NOUTX; ++i) {
+		for (size_t i = 0; i < NOUTX; ++i) {
+			for (size_t j = 0; j < NOUTY; ++j) { // run along the contiguous columns of each plane
 				for (size_t k = 0; k < maxOverY; ++k) {
 					for (size_t l = 0; l < maxOverX; ++l) {
 						if (maxOverY*j + k < NINY && maxOverX*i + l < NINX 
@@ -119,8 +162,8 @@ MAT MaxPoolLayer::maxPool(const MAT& in, bool saveIndices){
 				}
 				out(j, i + f*NOUTX) = curMax;
 				if (saveIndices) {
-					indexX(j, i + f*NOUTX) = ii;
-					indexY(j, i + f*NOUTX) = jj;
+					(*indicesX)(j, i + f*NOUTX + sample*channels*NOUTX) = ii;
+					(*indicesY)(j, i + f*NOUTX + sample*channels*NOUTX) = jj;
 					ii = -1;
 					jj = -1;
 				}
@@ -128,5 +171,4 @@ MAT MaxPoolLayer::maxPool(const MAT& in, bool saveIndices){
 			}
 		}
 	}
-	return out;
 }
\ No newline at end of file
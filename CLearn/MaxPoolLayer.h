@@ -9,22 +9,28 @@
 class MaxPoolLayer : public DiscarnateLayer{
 
 public:
+	MaxPoolLayer(size_t NINY, size_t NINX, size_t maxOverY, size_t maxOverX, size_t channels);
+	MaxPoolLayer(size_t NINY, size_t NINX, size_t maxOverY, size_t maxOverX, size_t channels, CNetLayer& lower);
+	MaxPoolLayer(size_t maxOverY, size_t maxOverX, size_t channels, CNetLayer& lower);
 	MaxPoolLayer(size_t NINXY, size_t maxOver, size_t channels);
 	MaxPoolLayer(size_t maxOver, size_t channels, CNetLayer& lower);
 	MaxPoolLayer(size_t channels, CNetLayer& lower);
 
 	~MaxPoolLayer();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
 	// forProp
 	void forProp(MAT& in, bool saveActivation, bool recursive); // recursive
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 	
-	inline size_t getMaxOverX() { return maxOverX; }
-	inline size_t getMaxOverY() { return maxOverY; }
-	inline size_t getNINX() { return NINX; };
-	inline size_t getNINY() { return NINY; };
-	inline size_t getNOUTX() { return NOUTX; };
-	inline size_t getNOUTY() { return NOUTY; };
+	inline size_t getMaxOverX() const { return maxOverX; }
+	inline size_t getMaxOverY() const { return maxOverY; }
+	inline size_t getNINX() const { return NINX; };
+	inline size_t getNINY() const { return NINY; };
+	inline size_t getNOUTX() const { return NOUTX; };
+	inline size_t getNOUTY() const { return NOUTY; };
+	bool planeShape(size_t& planeY, size_t& planeX) const;
 
 
 private:
@@ -34,11 +40,11 @@ private:
 	size_t NINY;
 	size_t NOUTX;
 	size_t NOUTY;
-	MATINDEX indexX;
-	MATINDEX indexY;
+	inline MATINDEX& indexX() { return passState().indexX; }; // (NOUTY, channels*NOUTX*B) - the planes of all samples side by side
+	inline MATINDEX& indexY() { return passState().indexY; };
 	size_t channels;
 
-	MAT maxPool(const MAT& in,  bool saveIndices);
+	void maxPool(const MATREF& in, fREAL* result, MATINDEX* indicesX, MATINDEX* indicesY, size_t sample) const; // into result (flat), indices are only kept if given
 	void assertGeometry();
 	void saveToFile(ostream& os) const;
 	void loadFromFile(ifstream& in);
@@ -89,28 +89,51 @@ MixtureDensityModel::~MixtureDensityModel()
 layer_t MixtureDensityModel::whoAmI() const {
 	return layer_t::mixtureDensity;
 }
+CNetLayer* MixtureDensityModel::replicate() const { return new MixtureDensityModel(*this); }
 void MixtureDensityModel::forProp(MAT & in, bool saveActivation, bool recursive)
 {
-	updateParameters(in);
-	// Choose what to ouput - 2 choices: Conditional mean of all modes
-	// or the mode with the highest likelihood.
-	maxMixtureCoefficient(in); // Size: (L,1)
+	// The mixture parameters are kept per layer, so the samples go through one by one.
+	// backPropDelta rebuilds the parameters of each sample from the saved network output.
+	if (saveActivation)
+		passState().mixture = in;
+	MAT out(getNOUT(), in.cols());
+	for (size_t s = 0; s < static_cast<size_t>(in.cols()); ++s) {
+		MAT sample = in.col(s);
+		updateParameters(sample);
+		// Choose what to ouput - 2 choices: Conditional mean of all modes
+		// or the mode with the highest likelihood.
+		maxMixtureCoefficient(sample); // Size: (L,1)
+		out.col(s) = sample;
+	}
+	in = move(out);
 
 	// Save the output - we need it if we backprop later...
 	if (saveActivation)
-		actSave = in;
+		actSave() = in;
 
 	// Propagate the max mixture coefficient OR conditional mean to the next layer
 	if (getHierachy() != hierarchy_t::output && recursive) {
 		above->forProp(in, saveActivation, true);
 	}
 }
+// The mixture parameters are written on every pass, so inference runs on a private copy of the layer.
+void MixtureDensityModel::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const
+{
+	MixtureDensityModel local(*this);
+	local.forProp(in, false, false); // sample by sample
+}
 
 void MixtureDensityModel::backPropDelta(MAT & delta, bool recursive) {
-	deltaSave = delta;
+	deltaSave() = delta;
 	if (getHierachy() != hierarchy_t::input) { // ... should be true
-		MAT t = reconstructTarget(delta);
-		delta = computeErrorGradient(t);
+		MAT errorGrad(getNIN(), delta.cols());
+		for (size_t s = 0; s < static_cast<size_t>(delta.cols()); ++s) {
+			MAT params = passState().mixture.col(s);
+			updateParameters(params);
+			MAT t = reconstructTarget(delta, s);
+			errorGrad.col(s) = computeErrorGradient(t);
+		}
+		delta = move(errorGrad);
 		if (recursive)
 			below->backPropDelta(delta, true);
 	} 
@@ -124,7 +147,7 @@ void MixtureDensityModel::conditionalMean( MAT& networkOut) {
 	networkOut.resize(NOUTY, NOUTX); // L == Blocks*LBlock
 	MU.resize(NOUTY, K*NOUTX);
 	PI.resize(Blocks, K);
-	static MAT block(BlockY, BlockX);
+	MAT block(BlockY, BlockX);
 
 	//Compute the sum of the weighted means
 	// [(K,1)^T x (K,LBLock)]^T = (LBlock,1)
@@ -213,12 +236,12 @@ void MixtureDensityModel::updateParameters(MAT& networkOut) {
 MAT MixtureDensityModel::computeErrorGradient(MAT& t) {
 
 	static const fREAL epsilon = 1E-14;
-	static MAT GAMMA(Blocks, K);
+	MAT GAMMA(Blocks, K); // not static - replicas run this concurrently
 	MAT errorGrad(K*Blocks*(LBlock + 2),1);
 	
-	static MAT errorGrad_MU(NOUTY, NOUTX*K);
-	static MAT errorGrad_SIG(Blocks, K);
-	static MAT errorGrad_PI(Blocks, K);
+	MAT errorGrad_MU(NOUTY, NOUTX*K);
+	MAT errorGrad_SIG(Blocks, K);
+	MAT errorGrad_PI(Blocks, K);
 
 	// Resize matrices to make submatrix selection easier (or even possible)
 	t.resize(NOUTY, NOUTX); //  target 
@@ -279,10 +302,10 @@ MAT MixtureDensityModel::computeErrorGradient(MAT& t) {
 	return errorGrad; 
 }
 
-MAT MixtureDensityModel::reconstructTarget(const MAT & diffMatrix)
+MAT MixtureDensityModel::reconstructTarget(const MAT & diffMatrix, size_t sample)
 {
-	assert(diffMatrix.size() == getNOUT());
-	return actSave - diffMatrix; // target = estimate - delta
+	assert(static_cast<size_t>(diffMatrix.rows()) == getNOUT());
+	return actSave().col(sample) - diffMatrix.col(sample); // target = estimate - delta
 }
 
 fREAL MixtureDensityModel::negativeLogLikelihood(MAT& t)
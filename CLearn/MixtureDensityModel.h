@@ -42,9 +42,11 @@ public:
 	MixtureDensityModel(size_t _NOUTX, size_t _NOUTY, size_t _features, size_t _BlockX, size_t _BlockY);
 	~MixtureDensityModel();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
 
 	// Overwrite virtual functions from Discarnatelayer
 	void forProp(MAT& in, bool saveActivation, bool recursive);
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive);
 
 	fREAL negativeLogLikelihood(MAT& t);
@@ -56,7 +58,7 @@ private:
 	void updateParameters(MAT& networkOut);
 	void getParameters(MAT& toCopyTo); // output function
 	MAT computeErrorGradient(MAT& t);
-	MAT reconstructTarget(const MAT& diffMatrix);
+	MAT reconstructTarget(const MAT& diffMatrix, size_t sample);
 
 	// 2D index function
 	inline size_t _BLOCKY(size_t b) const { return b % (uint32_t)sqrt(Blocks); };
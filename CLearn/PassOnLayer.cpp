@@ -14,6 +14,11 @@ PassOnLayer::PassOnLayer(actfunc_t type, CNetLayer& lower) : DiscarnateLayer(low
 layer_t PassOnLayer::whoAmI() const {
 	return layer_t::passOn;
 }
+CNetLayer* PassOnLayer::replicate() const { return new PassOnLayer(*this); }
+
+bool PassOnLayer::planeShape(size_t& NOUTY, size_t& NOUTX) const {
+	return below && below->planeShape(NOUTY, NOUTX); // element-wise - same geometry as the layer below
+}
 
 PassOnLayer::~PassOnLayer() {}
 void PassOnLayer::init() {
@@ -21,18 +26,21 @@ void PassOnLayer::init() {
 }
 void PassOnLayer::forProp(MAT& inBelow, bool training, bool recursive) {
 	if (training) {
-		actSave = inBelow;
+		actSave() = inBelow;
 	}
 	inBelow = inBelow.unaryExpr(act);
 	if (getHierachy() != hierarchy_t::output && recursive) {
 			above->forProp(inBelow, training, true);
 	} 
 }
+void PassOnLayer::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const {
+	in = in.unaryExpr(act);
+}
 
 void PassOnLayer::backPropDelta(MAT& delta, bool recursive) {
 	
-	delta = (getDACT()).cwiseProduct(delta); // need this to collect delta
-	deltaSave = delta;
+	delta.array() *= actSave().unaryExpr(dact).array(); // need this to collect delta
+	deltaSave() = delta;
 	if(getHierachy() != hierarchy_t::input && recursive)
 		below->backPropDelta(delta, true);
 }
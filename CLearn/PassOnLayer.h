@@ -14,8 +14,11 @@ public:
 
 	~PassOnLayer();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
+	bool planeShape(size_t& NOUTY, size_t& NOUTX) const;
 	// forProp
 	void forProp(MAT& in, bool saveActivation, bool recursive); // recursive
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 
 private:
@@ -23,6 +23,12 @@ PhysicalLayer::PhysicalLayer(size_t _NOUT, actfunc_t type, MATIND _WIndex, MATIN
 }
 PhysicalLayer::~PhysicalLayer() {
 }
+// W is the effective weight matrix under weight and spectral normalization as well - that is all a replica reads
+PhysicalLayer::PhysicalLayer(const PhysicalLayer& other) : CNetLayer(other),
+	w_batch(other.WDimensions(), other.getNOUT(), other.getNIN()), b_batch(MATIND{ other.getNOUT(), 1 }, other.getNOUT(), other.getNIN()),
+	w_stepper(other.WDimensions()), b_stepper(MATIND{ other.getNOUT(), 1 }), wnorm_Vstepper(MATIND{ 0, 0 }), wnorm_Gstepper(MATIND{ 0, 0 }),
+	W(other.W), b(other.b), weightNormMode(false), spectralNormMode(false), sigma(other.sigma), lambdaBatch(0), lambdaCount(0), hasFusedGrad(false), weightSource(nullptr) {
+}
 
 void PhysicalLayer::init() {
 	// Spectral normalization
@@ -46,7 +52,8 @@ void PhysicalLayer::init() {
 	VInversNorm.setOnes();
 	weightNormMode = false;
 	spectralNormMode = false;
-
+	hasFusedGrad = false;
+	weightSource = nullptr;
 }
 MAT PhysicalLayer::copyW() const {
 	return MAT(W);
@@ -75,16 +82,27 @@ void PhysicalLayer::applyUpdate(const learnPars& pars, MAT& input, bool recursiv
 	/* new version of this function
 	*/
 	// Get gradient
-	bool isDense = whoAmI() == layer_t::fullyConnected;
-
 	if (inRange(getLayerNumber(), pars.firstTrain, pars.lastTrain)) {
 		if (pars.accept) {
-			w_batch.swallowGradient(w_grad(input));
-			b_batch.swallowGradient(b_grad());
+			// the gradients are summed over the sample columns of the minibatch
+			size_t samples = deltaSave().cols();
+			if (hasFusedGrad) {
+				w_batch.swallowGradient(fusedGrad, samples);
+			} else {
+				MAT wGrad = w_grad(input); // from the arena - given back once swallowed
+				w_batch.swallowGradient(wGrad, samples);
+				giveBuffer(wGrad);
+			}
+			hasFusedGrad = false;
+			MAT bGrad = b_grad();
+			b_batch.swallowGradient(bGrad, samples);
+			giveBuffer(bGrad);
 		// TODO ------ -------- Put this abomination of a hack into order. 
 			if ( pars.spectral_normalization) { // collect special batch information for spectral normalization
-				lambdaBatch += (deltaSave.transpose()*(actSave - b)).sum(); // store this value
-				++lambdaCount;
+				for (size_t s = 0; s < samples; ++s) {
+					lambdaBatch += (deltaSave().col(s).transpose()*(actSave().col(s) - b)).sum(); // store this value
+				}
+				lambdaCount += samples;
 			}
 		}
 		if (0 == pars.batch_update) {
@@ -158,6 +176,37 @@ void PhysicalLayer::applyUpdate(const learnPars& pars, MAT& input, bool recursiv
 	}
 
 }
+// The replica starts its shard from the master's weights and with empty gradient buffers.
+void PhysicalLayer::pullWeights(const CNetLayer& master) {
+	const PhysicalLayer& other = dynamic_cast<const PhysicalLayer&>(master);
+	W = other.W; // same size - no reallocation
+	b = other.b;
+	w_batch.clearGradients();
+	b_batch.clearGradients();
+	lambdaBatch = 0;
+	lambdaCount = 0;
+	hasFusedGrad = false;
+}
+void PhysicalLayer::mergeGradients(PhysicalLayer& replica) {
+	w_batch.mergeGradients(replica.w_batch);
+	b_batch.mergeGradients(replica.b_batch);
+	lambdaBatch += replica.lambdaBatch;
+	lambdaCount += replica.lambdaCount;
+	replica.lambdaBatch = 0;
+	replica.lambdaCount = 0;
+}
+// Other threads read and step the same W and b meanwhile - races are accepted (Hogwild).
+void PhysicalLayer::pushStep(PhysicalLayer& master, const learnPars& pars) {
+	if (w_batch.stillToCome() == 0) // not trained (range, accept)
+		return;
+	w_stepper.stepLayer(master.W, w_batch.avgGradient(), pars);
+	b_stepper.stepLayer(master.b, b_batch.avgGradient(), pars);
+	w_batch.clearGradients();
+	b_batch.clearGradients();
+}
+void PhysicalLayer::readWeightsOf(const PhysicalLayer* master) {
+	weightSource = master;
+}
 MATIND PhysicalLayer::WDimensions() const {
 	size_t rows_ = W.rows();
 	size_t cols_ = W.cols();
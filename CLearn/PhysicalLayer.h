@@ -25,6 +25,7 @@ public:
 	*  Implementation on child class level.
 	*/
 	virtual void forProp(MAT& in, bool training, bool recursive) = 0; // recursive
+	// Gradients summed over the sample columns of the last backward pass
 	virtual MAT w_grad(MAT& input) = 0;
 	virtual MAT b_grad() = 0;
 	
@@ -33,6 +34,18 @@ public:
 	*/
 	virtual void backPropDelta(MAT& delta, bool recursive) = 0; // recursive
 	void applyUpdate(const learnPars& pars, MAT& input, bool recursive); // recursive
+	/* Data-parallel training
+	* A replica pulls W and b before its shard and accumulates gradients only (batch_update != 0).
+	* The master then merges the replica's gradients into its own batch buffers and takes the step.
+	* Replicas copy W and b only, with fresh batch buffers and steppers - the normalization state (V, G, W_temp, u1, v1)
+	* and the master's stepper moments stay with the master.
+	*/
+	void pullWeights(const CNetLayer& master);
+	void mergeGradients(PhysicalLayer& replica);
+	// Hogwild: step the master's W and b with this replica's gradients and its own stepper state - without locks
+	void pushStep(PhysicalLayer& master, const learnPars& pars);
+	// Hogwild: the passes read the master's W and b in place instead of a copy - nullptr returns to the layer's own
+	void readWeightsOf(const PhysicalLayer* master);
 	/* Initialization Routine
 	*/
 	virtual void constrainToMax(MAT& mues, MAT& max) = 0;
@@ -80,6 +93,9 @@ protected:
 	*/
 	MAT W; // actual layer
 	MAT b;
+	// What forward and delta passes read - W and b, or those of the master (readWeightsOf)
+	inline const MAT& weights() const { return weightSource ? weightSource->W : W; };
+	inline const MAT& bias() const { return weightSource ? weightSource->b : b; };
 	/* Subclasses 
 	* initialized in derived classes
 	*/
@@ -89,7 +105,17 @@ protected:
 	BatchBuffer w_batch; // BatchNormalization instance
 	BatchBuffer b_batch; // BatchNormalization instance
 
+	/* Fused backward pass
+	* Layers with a fused backward kernel compute the weight gradient in backPropDelta, in the same sweep over the delta.
+	* applyUpdate then swallows fusedGrad instead of calling w_grad. Invalidated by the next forward pass.
+	*/
+	MAT fusedGrad;
+	bool hasFusedGrad;
+	const PhysicalLayer* weightSource; // nullptr - the layer's own W and b
+
 	void init(); // initialize all the weight matrices
+	// For replicate() only - see pullWeights
+	PhysicalLayer(const PhysicalLayer& other);
 };
 
 #endif
\ No newline at end of file
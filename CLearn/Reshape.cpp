@@ -12,27 +12,29 @@ Reshape::Reshape(CNetLayer& lower) : DiscarnateLayer(lower.getNOUT(), actfunc_t:
 Reshape::~Reshape() {}
 
 layer_t Reshape::whoAmI() const { return layer_t::reshape; }
+CNetLayer* Reshape::replicate() const { return new Reshape(*this); }
 
-void Reshape::forProp(MAT& in, bool saveActivation, bool recursive) {
+bool Reshape::planeShape(size_t& NOUTY, size_t& NOUTX) const {
+	return below && below->planeShape(NOUTY, NOUTX); // the reversal keeps the plane shape
+}
 
-	size_t squaresize = sqrt(in.size());
-	in.resize(squaresize, squaresize);
-	//in.transposeInPlace();
-	flipUD(in);
-	flipLR(in);
-	in.resize(in.size(), 1);
+void Reshape::forProp(MAT& in, bool saveActivation, bool recursive) {
+	// flipping both axes of the square reshape is a reversal of the flat tensor - works for any geometry
+	for (size_t s = 0; s < in.cols(); ++s)
+		in.col(s).reverseInPlace();
+	if (saveActivation)
+		actSave() = in; // the layer above takes its gradient input from here
 	if (getHierachy() != hierarchy_t::output && recursive)
 		above->forProp(in, saveActivation, true);
 }
+void Reshape::infer(MAT& in, InferenceContext& /*context*/, size_t /*layer*/) const {
+	for (size_t s = 0; s < in.cols(); ++s)
+		in.col(s).reverseInPlace();
+}
 void Reshape::backPropDelta(MAT& delta, bool recursive) {
-
-		size_t squaresize = sqrt(delta.size());
-		delta.resize(squaresize, squaresize);
-		//delta.transposeInPlace();
-		flipUD(delta);
-		flipLR(delta);
-		delta.resize(delta.size(), 1);
-		deltaSave = delta;
+		for (size_t s = 0; s < delta.cols(); ++s)
+			delta.col(s).reverseInPlace();
+		deltaSave() = delta;
 		if (getHierachy() != hierarchy_t::input && recursive)
 			below->backPropDelta(delta, true);
 
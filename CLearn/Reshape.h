@@ -15,9 +15,12 @@ public:
 
 	~Reshape();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
+	bool planeShape(size_t& NOUTY, size_t& NOUTX) const;
 
 	// propagation
 	void forProp(MAT& in, bool saveActivation, bool recursive);
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 	
 private:
@@ -0,0 +1,359 @@
+#include "stdafx.h"
+#include "SeparableConvolutionalLayer.h"
+#include "InferenceContext.h"
+
+/* Depthwise-separable convolutional layer Constructors
+* - NOUTX, NOUTY only refer to the dimensions of a single channel, like for the ConvolutionalLayer.
+* - G holds one scale per spatial kernel (first inChannels entries) and one per pointwise row (last outChannels entries).
+*/
+SeparableConvolutionalLayer::SeparableConvolutionalLayer(size_t _NOUTX, size_t _NOUTY, size_t _NINX, size_t _NINY, size_t _kernelX, size_t _kernelY, size_t _strideY, size_t _strideX,
+	size_t _outChannels, size_t _inChannels, actfunc_t type)
+	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX),
+	inChannels(_inChannels), outChannels(_outChannels),
+	PhysicalLayer(_outChannels*_NOUTX*_NOUTY, _inChannels*_NINX*_NINY, type, MATIND{ _kernelY*_kernelX + _outChannels, _inChannels }, MATIND{ _kernelY*_kernelX + _outChannels, _inChannels },
+		MATIND{ 1, _inChannels + _outChannels }, MATIND{ _kernelY*_kernelX + _outChannels, 2 * _inChannels }) {
+	init();
+	assertGeometry();
+}
+
+SeparableConvolutionalLayer::SeparableConvolutionalLayer(size_t _NOUTX, size_t _NOUTY, size_t _NINX, size_t _NINY, size_t _kernelX, size_t _kernelY, size_t _strideY, size_t _strideX,
+	size_t _outChannels, size_t _inChannels, actfunc_t type, CNetLayer& lower)
+	: NOUTX(_NOUTX), NOUTY(_NOUTY), NINX(_NINX), NINY(_NINY), kernelX(_kernelX), kernelY(_kernelY), strideY(_strideY), strideX(_strideX),
+	inChannels(_inChannels), outChannels(_outChannels),
+	PhysicalLayer(_outChannels*_NOUTX*_NOUTY, type, MATIND{ _kernelY*_kernelX + _outChannels, _inChannels }, MATIND{ _kernelY*_kernelX + _outChannels, _inChannels },
+		MATIND{ 1, _inChannels + _outChannels }, MATIND{ _kernelY*_kernelX + _outChannels, 2 * _inChannels }, lower) {
+	init();
+	assertGeometry();
+}
+// second most convenient constructor
+SeparableConvolutionalLayer::SeparableConvolutionalLayer(size_t _NOUTXY, size_t _NINXY, size_t _kernelXY, size_t _stride, size_t _outChannels, size_t _inChannels, actfunc_t type)
+	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), NINX(_NINXY), NINY(_NINXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride),
+	inChannels(_inChannels), outChannels(_outChannels),
+	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, _inChannels*_NINXY*_NINXY, type, MATIND{ _kernelXY*_kernelXY + _outChannels, _inChannels }, MATIND{ _kernelXY*_kernelXY + _outChannels, _inChannels },
+		MATIND{ 1, _inChannels + _outChannels }, MATIND{ _kernelXY*_kernelXY + _outChannels, 2 * _inChannels }) {
+	init();
+	assertGeometry();
+}
+// most convenient constructor
+SeparableConvolutionalLayer::SeparableConvolutionalLayer(size_t _NOUTXY, size_t _kernelXY, size_t _stride, size_t _outChannels, size_t _inChannels, actfunc_t type, CNetLayer& lower)
+	: NOUTX(_NOUTXY), NOUTY(_NOUTXY), kernelX(_kernelXY), kernelY(_kernelXY), strideY(_stride), strideX(_stride), outChannels(_outChannels), inChannels(_inChannels),
+	PhysicalLayer(_outChannels*_NOUTXY*_NOUTXY, type, MATIND{ _kernelXY*_kernelXY + _outChannels, _inChannels }, MATIND{ _kernelXY*_kernelXY + _outChannels, _inChannels },
+		MATIND{ 1, _inChannels + _outChannels }, MATIND{ _kernelXY*_kernelXY + _outChannels, 2 * _inChannels }, lower) {
+
+	// interpret the inputs geometrically
+	lower.outputPlanes(inChannels, NINY, NINX);
+
+	init();
+	assertGeometry();
+}
+// destructor
+SeparableConvolutionalLayer::~SeparableConvolutionalLayer() {}
+
+bool SeparableConvolutionalLayer::planeShape(size_t& planeY, size_t& planeX) const {
+	planeY = NOUTY;
+	planeX = NOUTX;
+	return true;
+}
+
+layer_t SeparableConvolutionalLayer::whoAmI() const {
+	return layer_t::separableConvolutional;
+}
+CNetLayer* SeparableConvolutionalLayer::replicate() const { return new SeparableConvolutionalLayer(*this); }
+void SeparableConvolutionalLayer::assertGeometry() {
+	assert(outChannels*NOUTX*NOUTY == getNOUT());
+	assert(NINX*NINY*inChannels == getNIN());
+	assert((strideX*NOUTX - strideX - NINX + kernelX) % 2 == 0);
+	assert((strideY*NOUTY - strideY - NINY + kernelY) % 2 == 0);
+}
+void SeparableConvolutionalLayer::init() {
+	// PhysicalLayer draws all weights with stddev 1/sqrt(NIN) - rescale to the fan-in of each stage
+	W.topRows(kernelY*kernelX) *= sqrt(fREAL(getNIN()) / (kernelY*kernelX));
+	W.bottomRows(outChannels) *= sqrt(fREAL(getNIN()) / inChannels);
+
+	padY = padSize(NOUTY, NINY, kernelY, strideY);
+	padX = padSize(NOUTX, NINX, kernelX, strideX);
+
+	deltaSave() = MAT(getNOUT(), 1);
+	deltaSave().setZero();
+	actSave() = MAT(getNOUT(), 1);
+	actSave().setZero();
+	spatialSave() = MAT(NOUTY*NOUTX*inChannels, 1);
+	spatialSave().setZero();
+	spatialDeltaSave() = MAT(NOUTY*NOUTX*inChannels, 1);
+	spatialDeltaSave().setZero();
+}
+/* Weight normalization functions
+*  Spatial kernels are the top blocks of the columns, pointwise weights the rows of the bottom block.
+*/
+void SeparableConvolutionalLayer::wnorm_setW() {
+	size_t kernelSize = kernelY*kernelX;
+	W = V.cwiseProduct(VInversNorm);
+	for (size_t c = 0; c < inChannels; ++c)
+		W.col(c).head(kernelSize) *= G(0, c);
+	for (size_t o = 0; o < outChannels; ++o)
+		W.bottomRows(outChannels).row(o) *= G(0, inChannels + o);
+}
+void SeparableConvolutionalLayer::wnorm_initV() {
+	V = W;
+}
+void SeparableConvolutionalLayer::wnorm_normalizeV() {
+	size_t kernelSize = kernelY*kernelX;
+	for (size_t c = 0; c < inChannels; ++c)
+		V.col(c).head(kernelSize) /= normSum(V.col(c).head(kernelSize));
+	for (size_t o = 0; o < outChannels; ++o)
+		V.bottomRows(outChannels).row(o) /= normSum(V.bottomRows(outChannels).row(o));
+}
+void SeparableConvolutionalLayer::wnorm_initG() {
+	size_t kernelSize = kernelY*kernelX;
+	for (size_t c = 0; c < inChannels; ++c)
+		G(0, c) = normSum(W.col(c).head(kernelSize));
+	for (size_t o = 0; o < outChannels; ++o)
+		G(0, inChannels + o) = normSum(W.bottomRows(outChannels).row(o));
+}
+// take cwiseProduct with this matrix to obtain V/||V||
+void SeparableConvolutionalLayer::wnorm_inversVNorm() {
+	size_t kernelSize = kernelY*kernelX;
+	VInversNorm.setOnes();
+	for (size_t c = 0; c < inChannels; ++c)
+		VInversNorm.col(c).head(kernelSize) /= normSum(V.col(c).head(kernelSize));
+	for (size_t o = 0; o < outChannels; ++o)
+		VInversNorm.bottomRows(outChannels).row(o) /= normSum(V.bottomRows(outChannels).row(o));
+}
+MAT SeparableConvolutionalLayer::wnorm_gGrad(const MAT& grad) {
+	size_t kernelSize = kernelY*kernelX;
+	MAT scaled = grad.cwiseProduct(VInversNorm.cwiseProduct(V));
+	MAT ret(1, inChannels + outChannels);
+	for (size_t c = 0; c < inChannels; ++c)
+		ret(0, c) = scaled.col(c).head(kernelSize).sum();
+	for (size_t o = 0; o < outChannels; ++o)
+		ret(0, inChannels + o) = scaled.bottomRows(outChannels).row(o).sum();
+	return ret;
+}
+MAT SeparableConvolutionalLayer::wnorm_vGrad(const MAT& grad, MAT& ggrad) {
+	size_t kernelSize = kernelY*kernelX;
+	// per entry: g/||v|| * grad - g*ggrad/||v||^2 * v
+	MAT gScale(W.rows(), W.cols());
+	MAT ggScale(W.rows(), W.cols());
+	for (size_t c = 0; c < inChannels; ++c) {
+		gScale.col(c).head(kernelSize).setConstant(G(0, c));
+		ggScale.col(c).head(kernelSize).setConstant(G(0, c)*ggrad(0, c));
+	}
+	for (size_t o = 0; o < outChannels; ++o) {
+		gScale.bottomRows(outChannels).row(o).setConstant(G(0, inChannels + o));
+		ggScale.bottomRows(outChannels).row(o).setConstant(G(0, inChannels + o)*ggrad(0, inChannels + o));
+	}
+	MAT out = grad.cwiseProduct(VInversNorm).cwiseProduct(gScale);
+	out -= ggScale.cwiseProduct(VInversNorm.cwiseProduct(VInversNorm)).cwiseProduct(V);
+	return out;
+}
+/* Spectral normalization Functions
+*  The spatial kernels and the pointwise matrix are two operators in a row, so each block is divided by its own spectral norm.
+*  u1 holds the left singular vectors of both blocks one below the other, v1 the right ones (inChannels entries each).
+*/
+fREAL SeparableConvolutionalLayer::snorm_blockNorm(size_t first, size_t rows, size_t block) const {
+	return (u1.middleRows(first, rows).transpose()*(W_temp.middleRows(first, rows)*v1.middleRows(block*inChannels, inChannels)))(0, 0) + fREAL(1e-9);
+}
+void SeparableConvolutionalLayer::snorm_setW() {
+	size_t kernelSize = kernelY*kernelX;
+	W.topRows(kernelSize) = W_temp.topRows(kernelSize) / snorm_blockNorm(0, kernelSize, 0);
+	W.bottomRows(outChannels) = W_temp.bottomRows(outChannels) / snorm_blockNorm(kernelSize, outChannels, 1);
+}
+void SeparableConvolutionalLayer::snorm_updateUVs() {
+	size_t kernelSize = kernelY*kernelX;
+	size_t first[2] = { 0, kernelSize };
+	size_t rows[2] = { kernelSize, outChannels };
+	for (size_t block = 0; block < 2; ++block) {
+		MAT u = u1.middleRows(first[block], rows[block]);
+		MAT v = v1.middleRows(block*inChannels, inChannels);
+		updateSingularVectors(W_temp.middleRows(first[block], rows[block]), u, v, 1);
+		u1.middleRows(first[block], rows[block]) = u;
+		v1.middleRows(block*inChannels, inChannels) = v;
+	}
+}
+// Per block: dL/dW_temp = (grad - <grad, W> u v^T) / sigma with W = W_temp / sigma
+MAT SeparableConvolutionalLayer::snorm_dWt(MAT& grad) {
+	size_t kernelSize = kernelY*kernelX;
+	size_t first[2] = { 0, kernelSize };
+	size_t rows[2] = { kernelSize, outChannels };
+	for (size_t block = 0; block < 2; ++block) {
+		fREAL sigma = snorm_blockNorm(first[block], rows[block], block);
+		fREAL lambda = grad.middleRows(first[block], rows[block]).cwiseProduct(W.middleRows(first[block], rows[block])).sum();
+		grad.middleRows(first[block], rows[block]) -= lambda*(u1.middleRows(first[block], rows[block])*v1.middleRows(block*inChannels, inChannels).transpose());
+		grad.middleRows(first[block], rows[block]) /= sigma;
+	}
+	lambdaBatch = 0; // the batch estimate of PhysicalLayer is not used - lambda is exact per block
+	lambdaCount = 0;
+	return grad;
+}
+/* For/back prop
+*/
+void SeparableConvolutionalLayer::forProp(MAT& inBelow, bool training, bool recursive) {
+	MAT spatial; // the depthwise result is only kept when training
+	if (training)
+		actSave().resize(getNOUT(), inBelow.cols());
+	MAT out = takeBuffer(getNOUT(), inBelow.cols());
+	forward(inBelow, out, training ? spatialSave() : spatial, training ? &actSave() : nullptr);
+	passOn(inBelow, out);
+
+	if (recursive && getHierachy() != hierarchy_t::output) {
+		above->forProp(inBelow, training, true);
+	}
+}
+void SeparableConvolutionalLayer::infer(MAT& in, InferenceContext& context, size_t layer) const {
+	LayerScratch& scratch = context.scratch(layer);
+	MAT out;
+	forward(in, out, scratch.spatialBuffer, nullptr);
+	in = move(out);
+}
+// Both passes of the layer for a flat (NIN,B) minibatch into out, the depthwise result is left in spatial.
+void SeparableConvolutionalLayer::forward(const MAT& inBelow, MAT& out, MAT& spatial, MAT* preActivation) const {
+	size_t pixels = NOUTY*NOUTX;
+	size_t samples = inBelow.cols();
+	spatial.resize(pixels*inChannels, samples);
+	out.resize(getNOUT(), samples);
+	for (size_t s = 0; s < samples; ++s) {
+		// (1) Per-channel spatial convolution of a tensor view of the sample
+		depthwiseConv_(tensorView(inBelow, NINY, NINX, inChannels, s), weights().topRows(kernelY*kernelX), spatial.col(s).data(), kernelY, kernelX, NOUTY, NOUTX,
+			strideY, strideX, padY, padX, inChannels);
+
+		// (2) Pointwise mix: the flat tensors are (pixels, channels) matrices, so this is one (pixels, in) x (in, out) product.
+		// Bias and activation follow, the pre-activation is kept in actSave when training.
+		MATMAP(out.col(s).data(), pixels, outChannels).noalias() = MATMAP_CONST(spatial.col(s).data(), pixels, inChannels) * weights().bottomRows(outChannels).transpose();
+		ConvEpilogue(bias(), act, preActivation, s)(out.col(s).data(), 0, getNOUT());
+	}
+}
+uint32_t SeparableConvolutionalLayer::getOutChannels() const {
+	return outChannels;
+}
+// Initializtion
+void SeparableConvolutionalLayer::constrainToMax(MAT & mues, MAT & maxVec) {
+	W = W / maxVec.maxCoeff();
+}
+// backprop
+void SeparableConvolutionalLayer::backPropDelta(MAT& deltaAbove, bool recursive) {
+
+	deltaAbove.array() *= actSave().unaryExpr(dact).array();
+	deltaSave() = deltaAbove;
+
+	// (1) Back through the pointwise mix - the kernel gradient needs this even in the input layer
+	size_t pixels = NOUTY*NOUTX;
+	size_t samples = deltaSave().cols();
+	MAT& spatialDelta = spatialDeltaSave();
+	spatialDelta.resize(pixels*inChannels, samples);
+	for (size_t s = 0; s < samples; ++s) {
+		MATMAP(spatialDelta.col(s).data(), pixels, inChannels).noalias() = MATMAP_CONST(deltaSave().col(s).data(), pixels, outChannels) * weights().bottomRows(outChannels);
+	}
+
+	if (getHierachy() != hierarchy_t::input) { // ... this is not an input layer.
+		// (2) Back through the spatial convolution
+		MAT deltaBelow = takeBuffer(getNIN(), samples);
+		for (size_t s = 0; s < samples; ++s) {
+			depthwiseAntiConv_(tensorView(spatialDelta, NOUTY, NOUTX, inChannels, s), weights().topRows(kernelY*kernelX), deltaBelow.col(s).data(), kernelY, kernelX, NINY, NINX,
+				strideY, strideX, padY, padX, inChannels);
+		}
+		passOn(deltaAbove, deltaBelow);
+
+		if (recursive) {
+			below->backPropDelta(deltaAbove, true); // cascade...
+		}
+	}
+}
+// Gradient of the weights, summed over the samples
+MAT SeparableConvolutionalLayer::w_grad(MAT& input) {
+	MAT act;
+	if (getHierachy() != hierarchy_t::input)
+		takeBelowACT(act);
+	const MAT& fromBelow = getHierachy() == hierarchy_t::input ? input : act;
+	MAT grad = takeBuffer(W.rows(), W.cols());
+	for (size_t s = 0; s < deltaSave().cols(); ++s) {
+		kernelGrad(fromBelow, s, grad, s > 0);
+	}
+	giveBuffer(act);
+	return grad;
+}
+// Spatial kernels from the input and the spatial delta, pointwise weights from the spatial output and deltaSave (one sample) - into grad, or onto it if accumulate is set.
+void SeparableConvolutionalLayer::kernelGrad(const MAT& input, size_t sample, MAT& grad, bool accumulate) {
+	size_t pixels = NOUTY*NOUTX;
+	depthwiseConvGrad_(tensorView(input, NINY, NINX, inChannels, sample), tensorView(spatialDeltaSave(), NOUTY, NOUTX, inChannels, sample), grad.data(), grad.rows(), accumulate,
+		kernelY, kernelX, strideY, strideX, padY, padX, inChannels);
+	if (accumulate)
+		grad.bottomRows(outChannels).noalias() += MATMAP_CONST(deltaSave().col(sample).data(), pixels, outChannels).transpose() * MATMAP_CONST(spatialSave().col(sample).data(), pixels, inChannels);
+	else
+		grad.bottomRows(outChannels).noalias() = MATMAP_CONST(deltaSave().col(sample).data(), pixels, outChannels).transpose() * MATMAP_CONST(spatialSave().col(sample).data(), pixels, inChannels);
+}
+MAT SeparableConvolutionalLayer::b_grad() {
+	MAT grad = takeBuffer(getNOUT(), 1);
+	grad.noalias() = deltaSave().rowwise().sum();
+	return grad;
+}
+void SeparableConvolutionalLayer::saveToFile(ostream& os) const {
+	os << NOUTY << " " << NOUTX << " " << NINY << " " << NINX << " " << kernelY << " " << kernelX << " " << strideY << " " << strideX << " " << outChannels << " " << inChannels << endl;
+	os << spectralNormMode << " " << weightNormMode << endl;
+
+	MAT temp = W;
+	temp.resize(W.size(), 1);
+	os << temp << endl;
+	os << b << endl;
+	if (weightNormMode) {
+		temp = V;
+		temp.resize(V.size(), 1);
+		os << temp << endl;
+		temp = G;
+		temp.resize(G.size(), 1);
+		os << temp << endl;
+	}
+}
+// first line has been read already
+void SeparableConvolutionalLayer::loadFromFile(ifstream& in) {
+	in >> NOUTY;
+	in >> NOUTX;
+	in >> NINY;
+	in >> NINX;
+	in >> kernelY;
+	in >> kernelX;
+	in >> strideY;
+	in >> strideX;
+	in >> outChannels;
+	in >> inChannels;
+
+	padY = padSize(NOUTY, NINY, kernelY, strideY);
+	padX = padSize(NOUTX, NINX, kernelX, strideX);
+
+	size_t rows = kernelY*kernelX + outChannels;
+	W = MAT(rows*inChannels, 1); // initialize as a column vector
+	b = MAT(getNOUT(), 1);
+	V = MAT(rows, inChannels);
+	G = MAT(1, inChannels + outChannels);
+	spatialSave() = MAT::Zero(NOUTY*NOUTX*inChannels, 1);
+	spatialDeltaSave() = MAT::Zero(NOUTY*NOUTX*inChannels, 1);
+	u1 = MAT(rows, 1); // one singular vector pair per block (spectral normalization)
+	v1 = MAT(2 * inChannels, 1);
+	snorm_initUV();
+
+	V.setZero();
+	G.setZero();
+	w_stepper.reset();
+	b_stepper.reset();
+
+	// Check for normalization flags
+	in >> spectralNormMode;
+	in >> weightNormMode;
+	for (size_t i = 0; i < W.size(); ++i) {
+		in >> W(i, 0);
+	}
+	for (size_t i = 0; i < b.size(); ++i) {
+		in >> b(i, 0);
+	}
+	W.resize(rows, inChannels);
+	if (weightNormMode) {
+		V.resize(V.size(), 1);
+		for (size_t i = 0; i < V.size(); ++i) {
+			in >> V(i, 0);
+		}
+		V.resize(rows, inChannels);
+		for (size_t i = 0; i < G.size(); ++i) {
+			in >> G(0, i);
+		}
+		wnorm_inversVNorm();
+	}
+}
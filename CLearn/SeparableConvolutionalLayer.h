@@ -0,0 +1,90 @@
+#pragma once
+#include "defininitions.h"
+#include "PhysicalLayer.h"
+
+#ifndef CNET_SEPARABLECONVOLAYER
+#define CNET_SEPARABLECONVOLAYER
+/* Depthwise-separable convolutional layer
+*	A per-channel spatial convolution (one kernelY x kernelX kernel per in-channel) followed by a 1x1 pointwise mix of the channels.
+*	Costs kernelY*kernelX*inChannels + inChannels*outChannels per output pixel instead of kernelY*kernelX*inChannels*outChannels.
+*	Weight layout: W is (kernelY*kernelX + outChannels, inChannels). Column c holds the spatial kernel of in-channel c (column-major),
+*	followed by the pointwise weights from in-channel c to every out-channel - i.e. W.bottomRows(outChannels) is the pointwise matrix.
+*	Weight normalization scales every spatial kernel and every pointwise row separately, spectral normalization each of the two blocks.
+*/
+class SeparableConvolutionalLayer : public PhysicalLayer {
+	public:
+		SeparableConvolutionalLayer(size_t NOUTX, size_t NOUTY, size_t NINX, size_t NINY, size_t kernelX, size_t kernelY, size_t strideY, size_t strideX,
+			size_t outChannels, size_t inChannels, actfunc_t type);
+		SeparableConvolutionalLayer(size_t NOUTX, size_t NOUTY, size_t NINX, size_t NINY, size_t kernelX, size_t kernelY, size_t strideY, size_t strideX,
+			size_t outChannels, size_t inChannels, actfunc_t type, CNetLayer& lower);
+		SeparableConvolutionalLayer(size_t NOUTXY, size_t NINXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type);
+		SeparableConvolutionalLayer(size_t NOUTXY, size_t kernelXY, size_t stride, size_t outChannels, size_t inChannels, actfunc_t type, CNetLayer& lower);
+		~SeparableConvolutionalLayer();
+
+		layer_t whoAmI() const;
+		CNetLayer* replicate() const;
+		// propagation
+		void forProp(MAT& in, bool training, bool recursive);
+		void infer(MAT& in, InferenceContext& context, size_t layer) const;
+		MAT w_grad(MAT& input);
+		MAT b_grad();
+		void backPropDelta(MAT& delta, bool recursive);
+
+		inline size_t getNOUTX() const { return NOUTX; };
+		inline size_t getNOUTY() const { return NOUTY; };
+		inline size_t getNINX() const { return NINX; };
+		inline size_t getNINY() const { return NINY; };
+		inline size_t getKernelX() const { return kernelX; };
+		inline size_t getKernelY() const { return kernelY; };
+		bool planeShape(size_t& planeY, size_t& planeX) const;
+		uint32_t getOutChannels() const;
+		// Initialization Routine
+		void constrainToMax(MAT& mues, MAT& sigma);
+
+	private:
+		void forward(const MAT& in, MAT& out, MAT& spatial, MAT* preActivation) const; // shared by forProp and infer
+
+		/* Weight normalization functions
+		*/
+		void wnorm_setW();
+		void wnorm_initV();
+		void wnorm_initG();
+		void wnorm_normalizeV();
+		void wnorm_inversVNorm();
+		MAT wnorm_gGrad(const MAT& grad); // gradient in g's
+		MAT wnorm_vGrad(const MAT& grad, MAT& ggrad); // gradient in V
+
+		/* Spectral Normalization
+		*/
+		void snorm_setW();
+		void snorm_updateUVs();
+		MAT snorm_dWt(MAT& grad);
+		fREAL snorm_blockNorm(size_t first, size_t rows, size_t block) const; // sigma of W_temp.middleRows(first, rows)
+
+		// Geometry
+		size_t NOUTX;
+		size_t NOUTY;
+		size_t NINX;
+		size_t NINY;
+		size_t padX;
+		size_t padY;
+		size_t kernelX;
+		size_t kernelY;
+		size_t strideX;
+		size_t strideY;
+		size_t inChannels;
+		size_t outChannels;
+		void assertGeometry();
+
+		// Intermediate tensor between the spatial and the pointwise stage - both are needed by the weight gradient
+		inline MAT& spatialSave() { return passState().spatial; }; // output of the spatial convolution (NOUTY*NOUTX*inChannels, B), kept when training
+		inline MAT& spatialDeltaSave() { return passState().spatialDelta; }; // delta of the spatial output, set by backPropDelta
+		void kernelGrad(const MAT& input, size_t sample, MAT& grad, bool accumulate); // onto grad if accumulate is set
+
+		// File functions
+		void saveToFile(ostream& os) const;
+		void loadFromFile(ifstream& in);
+
+		void init();
+};
+#endif
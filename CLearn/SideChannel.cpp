@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "SideChannel.h"
+#include "InferenceContext.h"
 
 
 SideChannel::SideChannel(size_t NIN, size_t _sideChannelSize) : sideChannelSize(_sideChannelSize),
@@ -7,40 +8,61 @@ SideChannel::SideChannel(size_t NIN, size_t _sideChannelSize) : sideChannelSize(
 	
 	sideChannelMatrix = MAT(_sideChannelSize, 1);
 	sideChannelMatrix.setZero();
-	deltaSave = MAT(sideChannelSize, 1);
-	deltaSave.setZero();
+	deltaSave() = MAT(sideChannelSize, 1);
+	deltaSave().setZero();
 }
 
 SideChannel::SideChannel(CNetLayer& lower, size_t _sideChannelSize) 
 	: sideChannelSize(_sideChannelSize), DiscarnateLayer(lower.getNOUT()+_sideChannelSize, actfunc_t::NONE, lower){
 	sideChannelMatrix = MAT(_sideChannelSize, 1);
 	sideChannelMatrix.setZero();
-	deltaSave = MAT(sideChannelSize, 1);
-	deltaSave.setZero();
+	deltaSave() = MAT(sideChannelSize, 1);
+	deltaSave().setZero();
 }
 
 SideChannel::~SideChannel() {}
 
 void SideChannel::forProp(MAT& in, bool saveActivation, bool recursive) {
-	in.conservativeResize(getNIN() + sideChannelSize,1);
-	in.bottomRows(sideChannelSize) = sideChannelMatrix;
+	MAT out = takeBuffer(getNOUT(), in.cols());
+	append(in, sideChannelMatrix, out);
+	passOn(in, out);
+	if (saveActivation)
+		actSave() = in; // the layer above takes its gradient input from here
 	if (recursive && getHierachy() != hierarchy_t::output)
 		above->forProp(in, saveActivation, true);
 }
+// Inference takes the side channel fed to the context, the one stored in the layer otherwise.
+void SideChannel::infer(MAT& in, InferenceContext& context, size_t /*layer*/) const {
+	MAT out;
+	append(in, context.getSideChannel().size() > 0 ? context.getSideChannel() : sideChannelMatrix, out);
+	in = move(out);
+}
+void SideChannel::append(const MAT& in, const MAT& side, MAT& out) const {
+	assert(side.rows() == sideChannelSize);
+	out.resize(getNIN() + sideChannelSize, in.cols()); // nothing to do for a buffer of that shape
+	out.topRows(getNIN()) = in;
+	// one side channel input per sample, or the same for the whole batch
+	if (side.cols() == in.cols())
+		out.bottomRows(sideChannelSize) = side;
+	else
+		out.bottomRows(sideChannelSize) = side.col(0).replicate(1, in.cols());
+}
 void SideChannel::backPropDelta(MAT& delta, bool recursive) {
 	//// ATTENTION - WE ONLY COPY SIDE CHANNEL-SPECIFIC DELTAS
 	//// THIS IS SPECIAL BEHAVIOUR TO CUT COMP COST
-	deltaSave = delta.bottomRows(sideChannelSize);
+	deltaSave() = delta.bottomRows(sideChannelSize);
 	// proceed as normal
-	delta.conservativeResize(getNOUT() - sideChannelSize,1);
+	MAT deltaBelow = takeBuffer(getNOUT() - sideChannelSize, delta.cols());
+	deltaBelow = delta.topRows(getNOUT() - sideChannelSize);
+	passOn(delta, deltaBelow);
 	if (recursive && getHierachy() != hierarchy_t::input)
 		below->backPropDelta(delta, true);
 }
 layer_t SideChannel::whoAmI() const { return layer_t::sideChannel; }
+CNetLayer* SideChannel::replicate() const { return new SideChannel(*this); }
 
 void SideChannel::preFeed(const MAT& toStore) {
-	assert(toStore.rows() == sideChannelMatrix.rows());
-	assert(toStore.cols() == sideChannelMatrix.cols());
+	assert(toStore.rows() == sideChannelSize); // (sideChannelSize, 1) or (sideChannelSize, B)
 	sideChannelMatrix = toStore;
 }
 
@@ -16,16 +16,20 @@ public:
 
 	~SideChannel();
 	layer_t whoAmI() const;
+	CNetLayer* replicate() const;
 	void preFeed(const MAT& sideChannelMatrix);
 
 	// propagation
 	void forProp(MAT& in, bool saveActivation, bool recursive);
+	void infer(MAT& in, InferenceContext& context, size_t layer) const;
 	void backPropDelta(MAT& delta, bool recursive); // recursive
 	inline size_t getSidechannelSize() const { return sideChannelSize; };
+	inline const MAT& getSideChannelMatrix() const { return sideChannelMatrix; };
 
 private:
 	size_t sideChannelSize;
 	MAT sideChannelMatrix; // here we store the sidechannel INPUTS that get fed into the chain
+	void append(const MAT& in, const MAT& side, MAT& out) const; // each sample of in with side stacked below it
 	void saveToFile(ostream& os) const;
 	void loadFromFile(ifstream& in);
 };
@@ -0,0 +1,248 @@
+#include "stdafx.h"
+#include "SimdKernels.h"
+#include <atomic>
+#include <chrono>
+#include <omp.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CNET_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__)
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC compiles intrinsics of every level as is, gcc/clang need the target per function.
+#if defined(__GNUC__)
+#define CNET_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CNET_TARGET(isa)
+#endif
+
+/* Scalar kernels - the plain loops, left to the compiler
+*/
+static void axpyScalar(size_t n, fREAL a, const fREAL* x, size_t incx, fREAL* y) {
+	for (size_t j = 0; j < n; ++j)
+		y[j] += a * x[j*incx];
+}
+static fREAL dotScalar(size_t n, const fREAL* x, const fREAL* y, size_t incy) {
+	fREAL sum = 0;
+	for (size_t j = 0; j < n; ++j)
+		sum += x[j] * y[j*incy];
+	return sum;
+}
+
+#ifdef CNET_X86
+/* AVX2 + FMA kernels - 8 lanes, strided x/y through gathers
+*/
+CNET_TARGET("avx2,fma") static void axpyAVX2(size_t n, fREAL a, const fREAL* x, size_t incx, fREAL* y) {
+	__m256 va = _mm256_set1_ps(a);
+	size_t j = 0;
+	if (incx == 1) {
+		for (; j + 8 <= n; j += 8)
+			_mm256_storeu_ps(y + j, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j)));
+	} else {
+		__m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int32_t)incx));
+		for (; j + 8 <= n; j += 8)
+			_mm256_storeu_ps(y + j, _mm256_fmadd_ps(va, _mm256_i32gather_ps(x + j*incx, index, 4), _mm256_loadu_ps(y + j)));
+	}
+	for (; j < n; ++j)
+		y[j] += a * x[j*incx];
+}
+CNET_TARGET("avx2,fma") static fREAL dotAVX2(size_t n, const fREAL* x, const fREAL* y, size_t incy) {
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	size_t j = 0;
+	if (incy == 1) {
+		for (; j + 16 <= n; j += 16) {
+			acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j), acc0);
+			acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j + 8), _mm256_loadu_ps(y + j + 8), acc1);
+		}
+		for (; j + 8 <= n; j += 8)
+			acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j), acc0);
+	} else {
+		__m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int32_t)incy));
+		for (; j + 8 <= n; j += 8)
+			acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_i32gather_ps(y + j*incy, index, 4), acc0);
+	}
+	acc0 = _mm256_add_ps(acc0, acc1);
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+	fREAL sum = _mm_cvtss_f32(half);
+	for (; j < n; ++j)
+		sum += x[j] * y[j*incy];
+	return sum;
+}
+
+/* AVX-512 kernels - 16 lanes, masked tail
+*/
+CNET_TARGET("avx512f") static void axpyAVX512(size_t n, fREAL a, const fREAL* x, size_t incx, fREAL* y) {
+	__m512 va = _mm512_set1_ps(a);
+	__m512i index = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32((int32_t)incx));
+	size_t j = 0;
+	if (incx == 1) {
+		for (; j + 16 <= n; j += 16)
+			_mm512_storeu_ps(y + j, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j)));
+	} else {
+		for (; j + 16 <= n; j += 16)
+			_mm512_storeu_ps(y + j, _mm512_fmadd_ps(va, _mm512_i32gather_ps(index, x + j*incx, 4), _mm512_loadu_ps(y + j)));
+	}
+	if (j < n) {
+		__mmask16 mask = (__mmask16)((1u << (n - j)) - 1);
+		__m512 vx = incx == 1 ? _mm512_maskz_loadu_ps(mask, x + j) : _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, index, x + j*incx, 4);
+		_mm512_mask_storeu_ps(y + j, mask, _mm512_fmadd_ps(va, vx, _mm512_maskz_loadu_ps(mask, y + j)));
+	}
+}
+CNET_TARGET("avx512f") static fREAL dotAVX512(size_t n, const fREAL* x, const fREAL* y, size_t incy) {
+	__m512 acc = _mm512_setzero_ps();
+	__m512i index = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32((int32_t)incy));
+	size_t j = 0;
+	if (incy == 1) {
+		for (; j + 16 <= n; j += 16)
+			acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j), acc);
+	} else {
+		for (; j + 16 <= n; j += 16)
+			acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + j), _mm512_i32gather_ps(index, y + j*incy, 4), acc);
+	}
+	if (j < n) {
+		__mmask16 mask = (__mmask16)((1u << (n - j)) - 1);
+		__m512 vy = incy == 1 ? _mm512_maskz_loadu_ps(mask, y + j) : _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, index, y + j*incy, 4);
+		acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + j), vy, acc);
+	}
+	return _mm512_reduce_add_ps(acc);
+}
+#endif
+
+/* Dispatch
+*/
+static const SimdKernels scalarKernels = { &axpyScalar, &dotScalar, simd_t::scalarISA };
+#ifdef CNET_X86
+static const SimdKernels avx2Kernels = { &axpyAVX2, &dotAVX2, simd_t::avx2ISA };
+static const SimdKernels avx512Kernels = { &axpyAVX512, &dotAVX512, simd_t::avx512ISA };
+#endif
+
+simd_t detectISA() {
+#if defined(CNET_X86) && defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return simd_t::scalarISA;
+	__cpuid(regs, 1);
+	bool fma = (regs[2] & (1 << 12)) != 0;
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	if (!osxsave)
+		return simd_t::scalarISA;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	bool avx2 = fma && (regs[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6; // OS saves xmm/ymm
+	bool avx512 = avx2 && (regs[1] & (1 << 16)) != 0 && (xcr0 & 0xE6) == 0xE6; // ... and opmask/zmm
+	return avx512 ? simd_t::avx512ISA : avx2 ? simd_t::avx2ISA : simd_t::scalarISA;
+#elif defined(CNET_X86) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return simd_t::avx512ISA;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return simd_t::avx2ISA;
+	return simd_t::scalarISA;
+#else
+	return simd_t::scalarISA;
+#endif
+}
+std::string cpuSignature() {
+	std::string brand;
+#if defined(CNET_X86)
+	int regs[12];
+#if defined(_MSC_VER)
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] >= 0x80000004) {
+		__cpuid(regs, 0x80000002);
+		__cpuid(regs + 4, 0x80000003);
+		__cpuid(regs + 8, 0x80000004);
+		brand.assign((const char*)regs, sizeof(regs));
+	}
+#elif defined(__GNUC__)
+	if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004) {
+		for (unsigned leaf = 0; leaf < 3; ++leaf)
+			__get_cpuid(0x80000002 + leaf, (unsigned*)regs + 4 * leaf, (unsigned*)regs + 4 * leaf + 1, (unsigned*)regs + 4 * leaf + 2, (unsigned*)regs + 4 * leaf + 3);
+		brand.assign((const char*)regs, sizeof(regs));
+	}
+#endif
+#endif
+	brand = brand.substr(0, brand.find('\0'));
+	std::string signature;
+	for (char c : brand) {
+		if (c != ' ' || (!signature.empty() && signature.back() != '_'))
+			signature += c == ' ' ? '_' : c;
+	}
+	if (signature.empty())
+		signature = "unknownCPU";
+	return signature + "|isa" + std::to_string(detectISA()) + "|threads" + std::to_string(omp_get_max_threads());
+}
+static const SimdKernels& kernelsFor(simd_t isa) {
+#ifdef CNET_X86
+	if (isa == simd_t::avx512ISA)
+		return avx512Kernels;
+	if (isa == simd_t::avx2ISA)
+		return avx2Kernels;
+#endif
+	return scalarKernels;
+}
+static std::atomic<const SimdKernels*> activeKernels(&kernelsFor(detectISA())); // selected at load time
+static thread_local const SimdKernels* pinnedKernels = nullptr; // benchmarkISA: table of the calling thread only
+
+const SimdKernels& simdKernels() {
+	if (pinnedKernels)
+		return *pinnedKernels;
+	return *activeKernels.load(std::memory_order_acquire);
+}
+bool setISA(simd_t isa) {
+	if (isa > detectISA())
+		return false;
+	activeKernels.store(&kernelsFor(isa), std::memory_order_release);
+	return true;
+}
+
+/* Benchmark of the direct kernels per ISA level.
+*  The kernels fetch their table on the calling thread, so the level is pinned there and the active table stays untouched.
+*/
+MAT benchmarkISA(size_t NOUTXY, size_t kernelXY, size_t stride, size_t inChannels, size_t outChannels, size_t repetitions) {
+	typedef std::chrono::steady_clock CLOCK;
+	size_t NINXY = NOUTXY*stride;
+	size_t padding = padSize(NOUTXY, NINXY, kernelXY, stride);
+	size_t features = inChannels*outChannels;
+
+	MAT in = MAT::Random(NINXY*NINXY*inChannels, 1);
+	MAT delta = MAT::Random(NOUTXY*NOUTXY*outChannels, 1);
+	MAT kernel = MAT::Random(kernelXY, kernelXY*features);
+	MAT out(NOUTXY*NOUTXY*outChannels, 1);
+	MAT deltaBelow(NINXY*NINXY*inChannels, 1);
+	MAT grad;
+
+	MAT times(3, 4);
+	times.setConstant(-1);
+	for (size_t level = 0; level < 3; ++level) {
+		if (simd_t(level) > detectISA())
+			continue;
+		pinnedKernels = &kernelsFor(simd_t(level));
+		for (size_t k = 0; k < 4; ++k) {
+			double best = 0;
+			for (size_t r = 0; r < std::max(repetitions, size_t(1)); ++r) {
+				CLOCK::time_point start = CLOCK::now();
+				switch (k) {
+				case 0: conv_(tensorView(in, NINXY, NINXY, inChannels), kernel, out.data(), NOUTXY, NOUTXY, stride, stride, 1, 1, padding, padding, features, outChannels, inChannels, 1); break;
+				case 1: antiConv_(tensorView(delta, NOUTXY, NOUTXY, outChannels), kernel, deltaBelow.data(), NINXY, NINXY, stride, stride, 1, 1, padding, padding, features, inChannels, outChannels, 1); break;
+				case 2: convGrad_(tensorView(in, NINXY, NINXY, inChannels), tensorView(delta, NOUTXY, NOUTXY, outChannels), grad, false, kernelXY, kernelXY, stride, stride, 1, 1, padding, padding, features, outChannels, inChannels, 1); break;
+				case 3: antiConvGrad_(tensorView(in, NINXY, NINXY, inChannels), tensorView(delta, NOUTXY, NOUTXY, outChannels), grad, false, kernelXY, kernelXY, stride, stride, 1, 1, padding, padding, features, inChannels, outChannels, 1); break;
+				}
+				double ms = std::chrono::duration<double, std::milli>(CLOCK::now() - start).count();
+				best = r == 0 ? ms : std::min(best, ms);
+			}
+			times(level, k) = (fREAL)best;
+		}
+	}
+	pinnedKernels = nullptr;
+	return times;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "defininitions.h"
+#ifndef CNET_SIMDKERNELS
+#define CNET_SIMDKERNELS
+
+enum simd_t { scalarISA = 0, avx2ISA = 1, avx512ISA = 2 }; // instruction set levels, ascending
+
+/* Hand-vectorized microkernels of the direct convolution loops.
+*  The innermost loops of conv_, antiConv_, convGrad_ and antiConvGrad_ are axpy and dot products along a column,
+*  the x side possibly strided (convolution stride). One table of kernels per instruction set level,
+*  the best level the CPU supports is selected when the library is loaded. The scalar kernels are the plain loops.
+*/
+struct SimdKernels {
+	void(*axpy)(size_t n, fREAL a, const fREAL* x, size_t incx, fREAL* y); // y[j] += a*x[j*incx]
+	fREAL(*dot)(size_t n, const fREAL* x, const fREAL* y, size_t incy); // sum_j x[j]*y[j*incy]
+	simd_t isa;
+};
+
+const SimdKernels& simdKernels(); // active table
+simd_t detectISA(); // best level of this CPU
+std::string cpuSignature(); // CPU brand, ISA level and thread count without blanks - identifies the machine in tuning caches
+bool setISA(simd_t isa); // force a level (e.g. for benchmarks) - false if the CPU does not support it. Running kernels keep their table.
+
+/* Time conv_, antiConv_, convGrad_ and antiConvGrad_ for one geometry at every ISA level.
+*  Returns (3 levels, 4 kernels) in milliseconds (best of repetitions), -1 for levels the CPU does not support.
+*/
+MAT benchmarkISA(size_t NOUTXY, size_t kernelXY, size_t stride, size_t inChannels, size_t outChannels, size_t repetitions);
+
+#endif
@@ -0,0 +1,63 @@
+#include "stdafx.h"
+#include "StepArena.h"
+#include <algorithm>
+
+StepArena::StepArena() : preparedSamples(0), misses(0) {
+}
+// Most buffers of each size live at the same tick make the pool of that size.
+void StepArena::prepare(const vector<BufferLife>& plan, size_t samples) {
+	if (samples == preparedSamples && plan == preparedPlan)
+		return;
+	preparedPlan = plan;
+	preparedSamples = samples;
+
+	size_t ticks = 0;
+	for (const BufferLife& life : plan)
+		ticks = std::max(ticks, life.last + 1);
+	std::map<size_t, size_t> peaks;
+	for (size_t t = 0; t < ticks; ++t) {
+		std::map<size_t, size_t> live;
+		for (const BufferLife& life : plan) {
+			if (life.first <= t && t <= life.last)
+				++live[life.rows*(life.cols > 0 ? life.cols : samples)];
+		}
+		for (const auto& count : live)
+			peaks[count.first] = std::max(peaks[count.first], count.second);
+	}
+	for (const auto& peak : peaks) {
+		if (peak.first == 0)
+			continue;
+		Pool& pool = pools[peak.first];
+		pool.peak = std::max(pool.peak, peak.second);
+		pool.free.reserve(pool.peak);
+		while (pool.free.size() + pool.live < pool.peak) {
+			pool.free.push_back(MAT(peak.first, 1));
+			++misses;
+		}
+	}
+}
+
+MAT StepArena::take(size_t rows, size_t cols) {
+	Pool& pool = pools[rows*cols];
+	pool.peak = std::max(pool.peak, ++pool.live);
+	if (pool.free.empty()) {
+		++misses;
+		return MAT(rows, cols);
+	}
+	MAT buffer = std::move(pool.free.back());
+	pool.free.pop_back();
+	buffer.resize(rows, cols); // same element count - keeps the storage
+	return buffer;
+}
+
+void StepArena::give(MAT& buffer) {
+	if (buffer.size() == 0)
+		return;
+	Pool& pool = pools[buffer.size()];
+	if (pool.live > 0)
+		--pool.live;
+	if (pool.free.size() + pool.live < pool.peak)
+		pool.free.push_back(std::move(buffer));
+	buffer.resize(0, 0); // either moved out already or no room for it
+}
+
@@ -0,0 +1,51 @@
+#pragma once
+#include "defininitions.h"
+#include <map>
+#ifndef CNET_STEPARENA
+#define CNET_STEPARENA
+
+/* Lifetime of one buffer of a training step (CNet::planStep): rows x cols elements, cols == 0 for one column per sample.
+*  The buffer is live from tick first to tick last (inclusive) of the step.
+*/
+struct BufferLife {
+	size_t rows;
+	size_t cols;
+	size_t first;
+	size_t last;
+};
+inline bool operator==(const BufferLife& a, const BufferLife& b) {
+	return a.rows == b.rows && a.cols == b.cols && a.first == b.first && a.last == b.last;
+}
+
+/* Buffers of training steps - the minibatches passed between the layers, deltas and gradient temporaries.
+*  The layers take a buffer, pass their old one back (CNetLayer::passOn) and the next layer takes that.
+*  Buffers are matched by their element count, so a buffer can come back in another shape (reshapes, deltas of the same size).
+*  The arena keeps at most as many buffers of a size as were live at once - planned by prepare or seen since.
+*  getMisses counts the buffers the arena had to allocate, plus the heap buffers the kernels allocated during the steps
+*  (growth of the partial sums and workspaces of the convolutions, see kernelBuffers), which CNet::backProp hands over with countKernelBuffers.
+*/
+class StepArena {
+public:
+	StepArena();
+	// Pre-size for plan at samples columns per minibatch - nothing to do if that was the last call
+	void prepare(const vector<BufferLife>& plan, size_t samples);
+	// A (rows,cols) buffer - contents undefined
+	MAT take(size_t rows, size_t cols);
+	// buffer is left empty. Buffers that were not taken from the arena are welcome as long as there is room for them.
+	void give(MAT& buffer);
+	inline void countKernelBuffers(size_t buffers) { misses += buffers; };
+	inline size_t getMisses() const { return misses; };
+
+private:
+	struct Pool {
+		vector<MAT> free;
+		size_t live = 0; // taken and not given back
+		size_t peak = 0; // most buffers live at once - the arena holds no more than this
+	};
+	std::map<size_t, Pool> pools; // by element count
+	vector<BufferLife> preparedPlan;
+	size_t preparedSamples;
+	size_t misses; // buffers allocated by prepare or take, and by the kernels
+};
+
+#endif
@@ -36,16 +36,54 @@ struct MATIND {
 	size_t cols;
 };
 typedef Map<MAT> MATMAP;
+typedef Map<const MAT> MATMAP_CONST;
+typedef Ref<const MAT> MATREF; // binds MAT, MATMAP and MATMAP_CONST without copying
 typedef Map<MAT_ROWMAJOR> MATMAP_ROWMAJOR;
 typedef vector<MAT> MATVEC;
 typedef Map<MATU8> MATU8MAP;
 typedef fREAL(*ACTFUNC)(fREAL);
+/* Bias and activation fused into the pass of a convolution kernel that writes its output: out = act(conv + bias).
+*  If preAct is given, conv + bias is stored there as well (e.g. actSave). The default epilogue leaves the output as is.
+*  For minibatches preActivation is a (NOUT,B) matrix sized by the caller and sample selects its column.
+*/
+struct ConvEpilogue {
+	const fREAL* bias = nullptr; // flat (NOUT,1)
+	ACTFUNC act = nullptr;
+	fREAL* preAct = nullptr; // flat (NOUT,1)
+
+	ConvEpilogue() {}
+	ConvEpilogue(const MAT& b, ACTFUNC activation, MAT* preActivation, size_t sample = 0) : bias(b.data()), act(activation) {
+		if (preActivation) {
+			if (preActivation->rows() != b.rows() || preActivation->cols() == 0)
+				preActivation->resize(b.rows(), 1);
+			assert(sample < preActivation->cols());
+			preAct = preActivation->data() + sample*b.rows();
+		}
+	}
+	// Apply to the flat output elements [begin, end).
+	inline void operator()(fREAL* out, size_t begin, size_t end) const {
+		if (bias) {
+			for (size_t k = begin; k < end; ++k)
+				out[k] += bias[k];
+		}
+		if (preAct) {
+			for (size_t k = begin; k < end; ++k)
+				preAct[k] = out[k];
+		}
+		if (act) {
+			for (size_t k = begin; k < end; ++k)
+				out[k] = act(out[k]);
+		}
+	}
+};
+typedef void(*CONVFUNC)(const MATREF&, const MATREF&, fREAL*, size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t, const ConvEpilogue&); // signature of conv_
 typedef LLT<MAT> CHOL;
 
 enum actfunc_t {RELU =1, TANH=2, SIG=3, NONE=4, SOFTPLUS=5, LEAKYRELU=6};
-enum layer_t { fullyConnected = 0, convolutional = 1, antiConvolutional=2, maxPooling = 3, avgPooling=4, cnet = 5, passOn = 6, dropout=7, mixtureDensity=8, reshape=9, sideChannel = 10, batchNorm=11, gaussreparam=12}; // enumerators: 1, 2, 4 range: 0..7
+enum layer_t { fullyConnected = 0, convolutional = 1, antiConvolutional=2, maxPooling = 3, avgPooling=4, cnet = 5, passOn = 6, dropout=7, mixtureDensity=8, reshape=9, sideChannel = 10, batchNorm=11, gaussreparam=12, separableConvolutional=13}; // enumerators: 1, 2, 4 range: 0..7
 enum pooling_t {max =1, average = 2};
 enum hierarchy_t { input = 1, hidden = 2, output = 3};
+enum convalgo_t { directConv = 1, im2colConv = 2, winogradConv = 3, fftConv = 4 }; // execution path of the convolution kernels
 
 struct learnPars {
 	learnPars() {
@@ -72,10 +110,54 @@ struct learnPars {
 };
 // library functions
 
-MAT conv_(const MAT& in, const MAT& kernel, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels);
-MAT antiConv_(const MAT& in, const MAT& kernel, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels);
-MAT convGrad_(const MAT& input, const MAT& delta, size_t strideY, size_t strideX, size_t kernelY, size_t kernelX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels);
-MAT antiConvGrad_(const MAT& delta, const MAT& input, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels);
+/* Spatial tensors (activations and deltas of convolutional, deconvolutional and pooling layers)
+*  travel through the chain as flat (NOUT,1) columns. Channel c occupies the contiguous range [c*NY*NX, (c+1)*NY*NX)
+*  and each channel plane is column-major, so one spatial column (fixed x, all y) is contiguous as well.
+*  The convolution kernels see a tensor as a (NY, NX*channels) view of the same memory and write flat tensors into caller-provided memory,
+*  typically a column of a (NOUT,B) buffer from the step arena.
+*  Hence, reshaping only happens at the DLL boundary (row-major LabVIEW arrays).
+*  A minibatch is a (NOUT,B) matrix with one flat tensor per column - sample selects the column to view.
+*/
+inline MATMAP_CONST tensorView(const MAT& flat, size_t NY, size_t NX, size_t channels, size_t sample = 0) {
+	return MATMAP_CONST(flat.data() + sample*flat.rows(), NY, NX*channels);
+}
+inline MATMAP tensorView(MAT& flat, size_t NY, size_t NX, size_t channels, size_t sample = 0) {
+	return MATMAP(flat.data() + sample*flat.rows(), NY, NX*channels);
+}
+// Heap buffers the kernels allocated on the calling thread so far - CNet::backProp adds the ones of a step to the misses of its arena.
+size_t kernelBuffers();
+void countKernelBuffers(size_t buffers);
+MAT kernelBuffer(size_t rows, size_t cols); // uninitialized, counted
+/* The forward and delta kernels write their flat result tensor to result (NOUTY*NOUTX*outChannels elements, not overlapping the input).
+*  The forward kernels take an optional epilogue, applied while the output is still in cache.
+*  The gradient kernels write the kernel gradient to kernelGrad, or add it if accumulate is set - summing a batch needs no temporaries.
+*/
+void conv_(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue = ConvEpilogue());
+void antiConv_(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue = ConvEpilogue());
+void convGrad_(const MATREF& input, const MATREF& delta, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups);
+void antiConvGrad_(const MATREF& delta, const MATREF& input, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups);
+// antiConv_ of delta and convGrad_ in one pass over the delta - the delta below goes to result, the kernel gradient to (or, accumulating, onto) kernelGrad.
+void convBackward_(const MATREF& input, const MATREF& delta, const MATREF& kernel, fREAL* result, MAT& kernelGrad, bool accumulate, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups);
+// Depthwise kernels (one kernel per channel, no channel mixing). kernels is (kernelY*kernelX, channels), column c holds the kernel of channel c in column-major order.
+void depthwiseConv_(const MATREF& in, const MATREF& kernels, fREAL* result, size_t kernelY, size_t kernelX, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t channels);
+void depthwiseAntiConv_(const MATREF& delta, const MATREF& kernels, fREAL* result, size_t kernelY, size_t kernelX, size_t NINY, size_t NINX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t channels);
+void depthwiseConvGrad_(const MATREF& in, const MATREF& delta, fREAL* kernelGrad, size_t ld, bool accumulate, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t channels);
+// conv_ specialized at compile time for square kernels 1, 3, 5, 7 and strides 1, 2 - conv_ for all other geometries.
+CONVFUNC selectConvKernel(size_t kernelY, size_t kernelX, size_t strideY, size_t strideX);
+// im2col + GEMM path. cols is a caller-owned column buffer, so that it can be reused between calls.
+void im2col_(const MATREF& in, MAT& cols, size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t inChannels);
+void im2colAt_(const MATREF& in, fREAL* cols, size_t ld, size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t inChannels);
+void convIm2col_(const MATREF& in, const MATREF& kernel, fREAL* result, MAT& cols, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue = ConvEpilogue());
+void convGradIm2col_(const MATREF& input, const MATREF& delta, MAT& kernelGrad, bool accumulate, MAT& cols, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups);
+// Summed kernel gradient of several samples of a flat batch - one GEMM over their stacked im2col blocks.
+void convGradIm2colBatch_(const MAT& input, const MAT& delta, size_t first, size_t count, MAT& cols, MAT& deltas, MAT& kernelGrad, bool accumulate, size_t NINY, size_t NINX, size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t paddingY, size_t paddingX, size_t feautures, size_t outChannels, size_t inChannels, size_t groups);
+// Winograd F(2x2,3x3) path for 3x3 kernels with stride 1. workspace is a caller-owned buffer like cols above.
+void convWinograd_(const MATREF& in, const MATREF& kernel, fREAL* result, MAT& workspace, size_t NOUTY, size_t NOUTX, size_t paddingY, size_t paddingX, size_t outChannels, size_t inChannels, const ConvEpilogue& epilogue = ConvEpilogue());
+void flipKernel_(const MATREF& kernel, MAT& flipped, size_t kernelY, size_t kernelX, size_t outChannels, size_t inChannels);
+convalgo_t selectConvAlgorithm(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t outChannels, size_t inChannels, size_t groups);
+convalgo_t selectConvGradAlgorithm(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t outChannels, size_t inChannels, size_t groups);
+bool convAlgorithmSupported(convalgo_t algorithm, bool kernelGradient, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t groups);
+bool fftConvCheaper(size_t smallY, size_t smallX, size_t kernelY, size_t kernelX, size_t outChannels, size_t inChannels, bool kernelGradient);
 MAT fourier(const MAT& in);
 void clipParameters(MAT& layers, fREAL clip);
 fREAL spectralNorm(const MAT& W, const MAT& u1, const MAT& v1);
@@ -202,12 +284,18 @@ inline uint32_t antiConvoSize(uint32_t inSize, uint32_t kernelSize,uint32_t anti
 inline uint32_t padSizeForEqualConv(uint32_t inSize, uint32_t kernelSize, uint32_t stride) {
 	return ((stride - 1)*inSize + kernelSize - stride) / 2; // ONLY WORKS FOR ODD KERNELSIZES if STRIDE==1
 }
+// Extent of a kernel whose taps are spread dilation pixels apart - the geometry helpers take it in place of the kernel size.
+inline uint32_t dilatedSize(uint32_t kernelSize, uint32_t dilation) {
+	return (kernelSize - 1)*dilation + 1;
+}
 inline uint32_t padSize(uint32_t outSize, uint32_t inSize, uint32_t kernelSize, uint32_t stride) {
 	return (stride*outSize - stride - inSize + kernelSize) / 2; 
 }
 inline uint32_t antiConvPad(uint32_t inSize, uint32_t stride, uint32_t kernelSize, uint32_t outSize) {
 	return (stride*(inSize - 1) + kernelSize - outSize) / 2;
 }
+// Optional dilation and channel groups at the end of a layer's geometry line - values missing in older files read as 1.
+void readConvOptions(ifstream& in, size_t& dilationY, size_t& dilationX, size_t& groups);
 void flipUD(MAT& toFlip);
 void flipLR(MAT& toFlip);
 
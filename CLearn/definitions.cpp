@@ -1,6 +1,9 @@
 #include "stdafx.h"
 #include "defininitions.h"
+#include "SimdKernels.h"
 #include <random>
+#include <sstream>
+#include <omp.h>
 /* Define a few more complex functions
 */
 
@@ -72,10 +75,95 @@ void clipParameters(MAT& layer, fREAL clip) {
 	}
 }
 
+/* Range [lo, hi) of loop indices j in [0, count) for which j*stride + offset - padding lies in [0, extent).
+*  The direct kernels clamp their innermost loops to this range, so the interior runs without bound checks
+*  and the padded border is simply skipped. Per-element summation order is unchanged.
+*/
+static inline void validRange(size_t offset, size_t padding, size_t stride, size_t extent, size_t count, size_t& lo, size_t& hi) {
+	lo = padding > offset ? (padding - offset + stride - 1) / stride : 0;
+	hi = extent + padding > offset ? std::min(count, (extent + padding - offset + stride - 1) / stride) : 0;
+	if (lo > hi)
+		lo = hi;
+}
+/* Number of column tiles per channel, so that (channel, tile) work items keep all threads busy even with few channels.
+*  Items write disjoint parts of the output, tiles never split a column.
+*/
+static inline size_t spatialTiles(size_t channels, size_t columns) {
+	static const size_t itemsPerThread = 4; // slack for load balancing
+	size_t wanted = itemsPerThread*omp_get_max_threads();
+	size_t tiles = (wanted + channels - 1) / channels;
+	return std::max<size_t>(1, std::min(tiles, columns));
+}
+/* Channel groups: the channels of one side are split into groups of equal size and channel c of the other side
+*  only sees the group c / (channels / groups). Returns the first channel of that group, perGroup is the group size.
+*/
+static inline size_t groupBegin(size_t channel, size_t channels, size_t groups, size_t perGroup) {
+	return channel / (channels / groups) * perGroup;
+}
+// Columns [lo, hi) of tile number tile.
+static inline void tileRange(size_t tile, size_t tiles, size_t columns, size_t& lo, size_t& hi) {
+	lo = tile*columns / tiles;
+	hi = (tile + 1)*columns / tiles;
+}
+/* Heap buffers of the kernels (growth of the per-thread partial sums and workspaces, kernel copies, spectra), counted on the calling thread.
+*  Buffers allocated inside a parallel region are counted by the caller before the region.
+*  The kernels write their results into caller-provided memory, so a training step of fixed geometry allocates nothing once warm.
+*/
+static thread_local size_t kernelBufferCount = 0;
+size_t kernelBuffers() {
+	return kernelBufferCount;
+}
+void countKernelBuffers(size_t buffers) {
+	kernelBufferCount += buffers;
+}
+MAT kernelBuffer(size_t rows, size_t cols) {
+	++kernelBufferCount;
+	return MAT(rows, cols);
+}
+/* One zeroed (rows, cols) partial per thread, partial t starts at t*rows*cols of the returned memory.
+*  The memory belongs to the calling thread and only grows, so layers of different geometries share it without reallocating.
+*/
+static fREAL* kernelPartials(size_t rows, size_t cols) {
+	static thread_local std::vector<fREAL> partials;
+	size_t elements = omp_get_max_threads()*rows*cols;
+	if (partials.size() < elements) {
+		countKernelBuffers(1);
+		partials.resize(elements);
+	}
+	std::fill(partials.begin(), partials.begin() + elements, fREAL(0));
+	return partials.data();
+}
+/* count tables of n entries, one after the other. They belong to the calling thread and keep their capacity between calls (kernels do not nest).
+*/
+static size_t* rangeTables(size_t count, size_t n) {
+	static thread_local std::vector<size_t> tables;
+	if (tables.size() < count*n) {
+		countKernelBuffers(1);
+		tables.resize(count*n);
+	}
+	return tables.data();
+}
+/* Sum the partials in thread order into kernelGrad, or onto it if accumulate is set.
+*  The partials are summed first, so accumulating samples adds their gradients in the same order as summing separate results.
+*/
+template<typename GRAD>
+static void reducePartials(fREAL* partials, size_t rows, size_t cols, GRAD&& kernelGrad, bool accumulate) {
+	MATMAP sum(partials, rows, cols);
+	size_t threads = omp_get_max_threads();
+	for (size_t t = 1; t < threads; ++t)
+		sum += MATMAP(partials + t*rows*cols, rows, cols);
+	if (accumulate)
+		kernelGrad += sum;
+	else
+		kernelGrad = sum;
+}
 /* Parallelized convolution routine with in/out features.
+*  Kernel tap (m,n) of output pixel (j,i) reads input pixel (j*strideY + m*dilationY - paddingY, i*strideX + n*dilationX - paddingX).
+*  With groups > 1 out-channel outF only sees the inChannels/groups in-channels of its group, through feature (inF - first in-channel of the group) + outF*inChannels/groups.
+*  The flat result tensor (NOUTY*NOUTX*outChannels) is written to result, which must not overlap in.
 */
-MAT conv_(const MAT& in, const MAT& kernel, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX,
-	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels) {
+void conv_(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue) {
 	
 	// (1) Geometry of the situation
 	size_t NINY = in.rows();
@@ -83,48 +171,169 @@ MAT conv_(const MAT& in, const MAT& kernel, size_t NOUTY, size_t NOUTX, size_t s
 	size_t kernelY = kernel.rows();
 	size_t kernelX = kernel.cols()/features;
 
-	// (2) Allocate matrices 
-	MAT out(NOUTY, NOUTX*outChannels); // stack features along x in accord with convention
+	// (2) View the result as a flat tensor with features stacked along x
+	MATMAP out(result, NOUTY, NOUTX*outChannels);
 	out.setZero();
 
 	// (3) Begin loop
 	int32_t xInd = 0;
-	int32_t yInd = 0;
-	int32_t outF = 0;
+	int32_t item = 0;
 	size_t f = 0;
+	size_t tiles = spatialTiles(outChannels, NOUTX);
+	size_t inPerGroup = inChannels / groups;
+	const SimdKernels& simd = simdKernels();
 
-	/* Parallelize over features.
+	/* Parallelize over (out feature, column tile) pairs.
 	* Read/write access to separate parts of the matrix is safe.
-	* TODO - features are organized along rows - bad for the cache. Eigen matrices are column-major.
+	* Every feature plane is contiguous and the innermost loop runs along its columns.
 	*/
-	#pragma omp parallel for private(xInd,yInd, outF, f) shared(out, kernel, in) 
-	for (outF = 0; outF < outChannels; ++outF) {
-		for (size_t inF = 0; inF < inChannels; ++inF) {
-			f = inF + outF*inChannels; // max[f] = outChannels-1 + (inChannels-1)*outChannels = inChannels*outChannels -1
-			for (size_t i = 0; i < NOUTX; ++i) {
+	#pragma omp parallel for private(xInd, item, f) shared(out, kernel, in) 
+	for (item = 0; item < outChannels*tiles; ++item) {
+		size_t outF = item / tiles;
+		size_t iBegin, iEnd;
+		tileRange(item % tiles, tiles, NOUTX, iBegin, iEnd);
+		size_t inBegin = groupBegin(outF, outChannels, groups, inPerGroup);
+		for (size_t inF = inBegin; inF < inBegin + inPerGroup; ++inF) {
+			f = inF - inBegin + outF*inPerGroup; // max[f] = inPerGroup-1 + (outChannels-1)*inPerGroup = features-1
+			for (size_t i = iBegin; i < iEnd; ++i) {
+				fREAL* outCol = &out(0, i + outF*NOUTX);
 				for (size_t n = 0; n < kernelX; ++n) {
+					xInd = i*strideX + n*dilationX - paddingX;
+					if (xInd < 0 || xInd >= NINX) // padded border column
+						continue;
+					const fREAL* inCol = in.data() + (xInd + inF*NINX)*in.outerStride();
 					for (size_t m = 0; m < kernelY; ++m) {
-						for (size_t j = 0; j < NOUTY; ++j) { // Eigen matrices are stored in column-major order.
-							yInd = j*strideY + m - paddingY;
-							xInd = i*strideX + n - paddingX;
-							if (yInd < NINY &&
-								yInd >= 0 &&
-								xInd < NINX &&
-								xInd >= 0) { // Check we're not in the padding.
-									out(j, i + outF*NOUTX) += kernel(m, n + f*kernelX) * in(yInd, xInd + inF*NINX);
-							}
+						size_t jLo, jHi;
+						validRange(m*dilationY, paddingY, strideY, NINY, NOUTY, jLo, jHi);
+						if (jLo < jHi) // outCol[j] += w * inCol[j*strideY + m*dilationY - paddingY] - Eigen matrices are stored in column-major order.
+							simd.axpy(jHi - jLo, kernel(m, n + f*kernelX), inCol + jLo*strideY + m*dilationY - paddingY, strideY, outCol + jLo);
+					}
+				}
+			}
+		}
+		epilogue(result, (iBegin + outF*NOUTX)*NOUTY, (iEnd + outF*NOUTX)*NOUTY); // columns of this item are complete
+	}
+}
+/* conv_ for square KxK kernels with stride S known at compile time.
+*  The taps of a kernel live in a fixed-size matrix and the tap loops are unrolled. Output pixels whose taps all lie inside the input
+*  run without bound checks. Every output pixel accumulates its taps in the same order as conv_, so the results are identical.
+*  The dilation stays a runtime parameter - it only changes the tap offsets.
+*/
+template<size_t K, size_t S>
+void convFixed_(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue) {
+	typedef Matrix<fREAL, K, K> KERNEL;
+	static const size_t BLOCK = 16; // output pixels per register block
+	assert(kernel.rows() == K && kernel.cols() == K*features && strideY == S && strideX == S);
+
+	// (1) Geometry of the situation
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t ld = in.outerStride();
+
+	// Interior: output rows/columns for which the first and the last tap are inside the input
+	size_t jLo, jHi, iLo, iHi, lo, hi;
+	validRange(0, paddingY, S, NINY, NOUTY, jLo, jHi);
+	validRange((K - 1)*dilationY, paddingY, S, NINY, NOUTY, lo, hi);
+	jLo = std::max(jLo, lo);
+	jHi = std::max(jLo, std::min(jHi, hi));
+	validRange(0, paddingX, S, NINX, NOUTX, iLo, iHi);
+	validRange((K - 1)*dilationX, paddingX, S, NINX, NOUTX, lo, hi);
+	iLo = std::max(iLo, lo);
+	iHi = std::max(iLo, std::min(iHi, hi));
+
+	// (2) View the result as a flat tensor with features stacked along x
+	MATMAP out(result, NOUTY, NOUTX*outChannels);
+	out.setZero();
+
+	// (3) Begin loop
+	int32_t item = 0;
+	size_t tiles = spatialTiles(outChannels, NOUTX);
+	size_t inPerGroup = inChannels / groups;
+
+	#pragma omp parallel for private(item) shared(out, kernel, in)
+	for (item = 0; item < outChannels*tiles; ++item) {
+		size_t outF = item / tiles;
+		size_t iBegin, iEnd;
+		tileRange(item % tiles, tiles, NOUTX, iBegin, iEnd);
+		size_t inBegin = groupBegin(outF, outChannels, groups, inPerGroup);
+		for (size_t inF = inBegin; inF < inBegin + inPerGroup; ++inF) {
+			size_t f = inF - inBegin + outF*inPerGroup;
+			const KERNEL w = kernel.template block<K, K>(0, f*K);
+			const fREAL* inPlane = in.data() + inF*NINX*ld;
+
+			for (size_t i = iBegin; i < iEnd; ++i) {
+				fREAL* outCol = &out(0, i + outF*NOUTX);
+				size_t jBegin = NOUTY; // border pixels are [0, jBegin) and [jEnd, NOUTY)
+				size_t jEnd = NOUTY;
+				if (i >= iLo && i < iHi) {
+					jBegin = jLo;
+					jEnd = jHi;
+				}
+				// (a) interior - no checks, all taps unrolled over fixed-size blocks of output pixels
+				size_t j = jBegin;
+				for (; j + BLOCK <= jEnd; j += BLOCK) {
+					const fREAL* corner = inPlane + (j*S - paddingY) + (i*S - paddingX)*ld; // first tap of pixel j
+					Matrix<fREAL, BLOCK, 1> acc = Map<Matrix<fREAL, BLOCK, 1>>(outCol + j);
+					for (size_t n = 0; n < K; ++n)
+						for (size_t m = 0; m < K; ++m)
+							acc += w(m, n) * Map<const Matrix<fREAL, BLOCK, 1>, 0, InnerStride<S>>(corner + m*dilationY + n*dilationX*ld);
+					Map<Matrix<fREAL, BLOCK, 1>>(outCol + j) = acc;
+				}
+				for (; j < jEnd; ++j) {
+					const fREAL* corner = inPlane + (j*S - paddingY) + (i*S - paddingX)*ld;
+					fREAL acc = outCol[j];
+					for (size_t n = 0; n < K; ++n)
+						for (size_t m = 0; m < K; ++m)
+							acc += w(m, n) * corner[m*dilationY + n*dilationX*ld];
+					outCol[j] = acc;
+				}
+				// (b) border - check we're not in the padding
+				for (j = 0; j < NOUTY; ++j) {
+					if (j == jBegin)
+						j = jEnd;
+					if (j >= NOUTY)
+						break;
+					fREAL acc = outCol[j];
+					for (size_t n = 0; n < K; ++n) {
+						int32_t xInd = i*S + n*dilationX - paddingX;
+						if (xInd < 0 || xInd >= NINX)
+							continue;
+						for (size_t m = 0; m < K; ++m) {
+							int32_t yInd = j*S + m*dilationY - paddingY;
+							if (yInd >= 0 && yInd < NINY)
+								acc += w(m, n) * inPlane[yInd + xInd*ld];
 						}
 					}
+					outCol[j] = acc;
 				}
 			}
 		}
+		epilogue(result, (iBegin + outF*NOUTX)*NOUTY, (iEnd + outF*NOUTX)*NOUTY); // columns of this item are complete
+	}
+}
+/* Dispatch table of the specialized convolution kernels.
+*/
+CONVFUNC selectConvKernel(size_t kernelY, size_t kernelX, size_t strideY, size_t strideX) {
+	static const struct { size_t kernel; size_t stride; CONVFUNC func; } table[] = {
+		{ 1, 1, &convFixed_<1, 1> }, { 1, 2, &convFixed_<1, 2> },
+		{ 3, 1, &convFixed_<3, 1> }, { 3, 2, &convFixed_<3, 2> },
+		{ 5, 1, &convFixed_<5, 1> }, { 5, 2, &convFixed_<5, 2> },
+		{ 7, 1, &convFixed_<7, 1> }, { 7, 2, &convFixed_<7, 2> }
+	};
+	if (kernelY == kernelX && strideY == strideX) {
+		for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+			if (table[i].kernel == kernelY && table[i].stride == strideY)
+				return table[i].func;
+		}
 	}
-	return out;
+	return &conv_;
 }
 /* Routine specifically for backpropagating deltas through a convolutional layer.
+*  The kernel gradient (kernelY, kernelX*features) goes to kernelGrad, or is added to it if accumulate is set.
 */
-MAT convGrad_(const MAT& in, const MAT& delta, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
-	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels) {
+void convGrad_(const MATREF& in, const MATREF& delta, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups) {
 
 	// (1) Geometry of the situation
 	size_t NINY = in.rows();
@@ -133,97 +342,260 @@ MAT convGrad_(const MAT& in, const MAT& delta, size_t kernelY, size_t kernelX, s
 	size_t deltaY = delta.rows(); // deltaX = (NINX-kernelX+2*paddingX)/strideX +1 
 	size_t deltaX = delta.cols() /outChannels;
 
-	// (2) Allocate matrices 
-	MAT kernelGrad(kernelY, kernelX*features); // stack features along x in accord with convention
-	kernelGrad.setZero();
+	// (2) Allocate matrices - one partial gradient per thread, since tiles of one channel pair hit the same kernel taps
+	size_t gradCols = kernelX*features; // stack features along x in accord with convention
+	fREAL* partials = kernelPartials(kernelY, gradCols);
 
-	// (3) Begin loop
+	// (3) Begin loop over (out feature, delta column tile) pairs
 	size_t f = 0;
-	int32_t outF = 0;
+	int32_t item = 0;
 	int32_t xInd = 0;
-	int32_t yInd = 0;
+	size_t tiles = spatialTiles(outChannels, deltaX);
+	size_t inPerGroup = inChannels / groups;
+	const SimdKernels& simd = simdKernels();
 
-	#pragma omp parallel for private(xInd, yInd,f, outF) shared(kernelGrad, delta, in)// Choose (probably) smallest rowwise loop size for parallelization.
-	for (outF = 0; outF < outChannels; ++outF) {
-		for(size_t inF=0; inF < inChannels; ++inF){
-			f = inF + outF*inChannels; // max[f] = outChannels-1 + (inChannels-1)*outChannels = inChannels*outChannels -1
+	// Rows of the delta that every kernel row j reaches: m*strideY + j*dilationY - paddingY in [0, NINY)
+	size_t* mLo = rangeTables(2, kernelY);
+	size_t* mHi = mLo + kernelY;
+	for (size_t j = 0; j < kernelY; ++j)
+		validRange(j*dilationY, paddingY, strideY, NINY, deltaY, mLo[j], mHi[j]);
+
+	#pragma omp parallel for schedule(static) private(xInd, f, item) shared(partials, delta, in, mLo, mHi)
+	for (item = 0; item < outChannels*tiles; ++item) {
+		size_t outF = item / tiles;
+		size_t nBegin, nEnd;
+		tileRange(item % tiles, tiles, deltaX, nBegin, nEnd);
+		MATMAP partial(partials + omp_get_thread_num()*kernelY*gradCols, kernelY, gradCols);
+		size_t inBegin = groupBegin(outF, outChannels, groups, inPerGroup);
+		for(size_t inF = inBegin; inF < inBegin + inPerGroup; ++inF){
+			f = inF - inBegin + outF*inPerGroup; // max[f] = inPerGroup-1 + (outChannels-1)*inPerGroup = features-1
 
-			for (size_t n = 0; n < deltaX; ++n) {
+			for (size_t n = nBegin; n < nEnd; ++n) {
 				for (size_t i = 0; i < kernelX; ++i) {
-					for (size_t m = 0; m < deltaY; ++m) {
-						for (size_t j = 0; j < kernelY; ++j) { // Eigen matrices are stored in column-major order.
-							yInd = j + m*strideY - paddingY;
-							xInd = i + n*strideX - paddingX; // max [xInd] = (kernelX-1)+ (deltaX-1)*strideX = (kernelX-1)+ (NINX-kernelX+2*paddingX) = NINX+2*paddingX-1 -> correct
-							if (yInd < NINY &&
-								yInd >= 0 &&
-								xInd < NINX &&
-								xInd >= 0) { // Check we're not in the padding.
-
-								kernelGrad(j, i + f*kernelX) += delta(m, n + outF*deltaX) * in(yInd, xInd + inF*NINX);
-							}
-						}
+					xInd = i*dilationX + n*strideX - paddingX; // max [xInd] = (kernelX-1)+ (deltaX-1)*strideX = (kernelX-1)+ (NINX-kernelX+2*paddingX) = NINX+2*paddingX-1 -> correct
+					if (xInd < 0 || xInd >= NINX) // padded border column
+						continue;
+					fREAL* gradCol = &partial(0, i + f*kernelX);
+					const fREAL* inCol = in.data() + (xInd + inF*NINX)*in.outerStride();
+					const fREAL* deltaCol = delta.data() + (n + outF*deltaX)*delta.outerStride();
+					for (size_t j = 0; j < kernelY; ++j) { // gradCol[j] += sum_m deltaCol[m] * inCol[m*strideY + j*dilationY - paddingY]
+						if (mLo[j] < mHi[j])
+							gradCol[j] += simd.dot(mHi[j] - mLo[j], deltaCol + mLo[j], inCol + mLo[j] * strideY + j*dilationY - paddingY, strideY);
 					}
 				}
 			}
 		}
 	}
-	return kernelGrad;
+	// (4) Reduce the partial gradients in thread order
+	reducePartials(partials, kernelY, gradCols, kernelGrad, accumulate);
 }
-/* Parallelized deconvolution operation (in this library referred to as Anticonvolution).
+/* Fused backward pass of a convolution: the delta for the layer below (antiConv_ of delta) and the kernel gradient (convGrad_).
+*  Both visit the same pairs of delta pixel (j,n) and input pixel (j*strideY + m*dilationY - paddingY, n*strideX + k*dilationX - paddingX), so the
+*  loops are merged and every delta column is used for both results while it is in cache.
+*  Work items are (in-channel, input column tile) pairs. An item owns its columns of the delta below, which goes to result (flat, input geometry).
+*  Kernel gradients go to one partial per thread and are reduced in thread order - into kernelGrad, or onto it if accumulate is set.
 */
-MAT antiConv_(const MAT& in, const MAT& kernel, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t paddingY, size_t paddingX, size_t features,
-	size_t outChannels, size_t inChannels) {
+void convBackward_(const MATREF& in, const MATREF& delta, const MATREF& kernel, fREAL* result, MAT& kernelGrad, bool accumulate, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups) {
 
 	// (1) Geometry of the situation
 	size_t NINY = in.rows();
 	size_t NINX = in.cols() / inChannels;
+	size_t deltaY = delta.rows();
+	size_t deltaX = delta.cols() / outChannels;
 	size_t kernelY = kernel.rows();
 	size_t kernelX = kernel.cols() / features;
 
-	// (2) Allocate matrices 
-	MAT out(NOUTY, NOUTX*outChannels); // stack features along x in accord with convention
-	out.setZero();
+	// Rows of the delta that every kernel row m reaches: j*strideY + m*dilationY - paddingY in [0, NINY)
+	size_t* jLo = rangeTables(2, kernelY);
+	size_t* jHi = jLo + kernelY;
+	for (size_t m = 0; m < kernelY; ++m)
+		validRange(m*dilationY, paddingY, strideY, NINY, deltaY, jLo[m], jHi[m]);
 
-	// (3) Begin loop
-	int32_t outF = 0;
-	size_t f = 0;
-	size_t xInd = 0;
-	size_t yInd = 0;
+	// (2) View the delta below as a flat tensor in the input geometry
+	MATMAP deltaBelow(result, NINY, NINX*inChannels);
+	deltaBelow.setZero();
+	size_t gradCols = kernelX*features;
+	fREAL* partials = kernelPartials(kernelY, gradCols);
 
-	#pragma omp parallel for private(xInd, yInd,outF,f) shared(out, kernel, in)// Choose (probably) smallest rowwise loop size for parallelization.
-	for (outF = 0; outF < outChannels; ++outF) {
-		for (size_t inF = 0; inF < inChannels; ++inF) {
-			//f = inF + outF*inChannels; // max[f] = outChannels-1 + (inChannels-1)*outChannels = inChannels*outChannels -1
-			f = outF + inF*outChannels; //this has to be the other way around
+	// (3) Begin loop
+	int32_t item = 0;
+	size_t tiles = spatialTiles(inChannels, NINX);
+	size_t inPerGroup = inChannels / groups;
+	size_t outPerGroup = outChannels / groups;
+	const SimdKernels& simd = simdKernels();
 
-			for (size_t n = 0; n < kernelX; ++n) {
-				for (size_t i = 0; i < NINX; ++i) {
+	#pragma omp parallel for schedule(static) private(item) shared(deltaBelow, partials, kernel, delta, in, jLo, jHi)
+	for (item = 0; item < inChannels*tiles; ++item) {
+		size_t inF = item / tiles;
+		size_t xBegin, xEnd;
+		tileRange(item % tiles, tiles, NINX, xBegin, xEnd);
+		MATMAP grad(partials + omp_get_thread_num()*kernelY*gradCols, kernelY, gradCols);
+		size_t outBegin = groupBegin(inF, inChannels, groups, outPerGroup);
+		size_t inLocal = inF % inPerGroup; // position of inF in its group
+		for (size_t x = xBegin; x < xEnd; ++x) {
+			fREAL* outCol = &deltaBelow(0, x + inF*NINX);
+			const fREAL* inCol = in.data() + (x + inF*NINX)*in.outerStride();
+			for (size_t outF = outBegin; outF < outBegin + outPerGroup; ++outF) {
+				size_t f = inLocal + outF*inPerGroup;
+				// delta column n reaches input column x through the taps k with n*strideX + k*dilationX = x + paddingX
+				for (size_t k = 0; k < kernelX && k*dilationX <= x + paddingX; ++k) {
+					size_t n = (x + paddingX - k*dilationX) / strideX;
+					if ((x + paddingX - k*dilationX) % strideX != 0 || n >= deltaX)
+						continue;
+					const fREAL* deltaCol = delta.data() + (n + outF*deltaX)*delta.outerStride();
 					for (size_t m = 0; m < kernelY; ++m) {
-						for (size_t j = 0; j < NINY; ++j) { // Eigen matrices are stored in column-major order.
+						if (jHi[m] == jLo[m])
+							continue;
+						const fREAL w = kernel(m, k + f*kernelX);
+						size_t rows = jHi[m] - jLo[m];
+						size_t y0 = jLo[m] * strideY + m*dilationY - paddingY; // first row of the input plane
+						if (strideY == 1) { // delta below
+							simd.axpy(rows, w, deltaCol + jLo[m], 1, outCol + y0);
+						} else {
+							for (size_t j = jLo[m]; j < jHi[m]; ++j)
+								outCol[j*strideY + m*dilationY - paddingY] += w * deltaCol[j];
+						}
+						grad(m, k + f*kernelX) += simd.dot(rows, deltaCol + jLo[m], inCol + y0, strideY); // kernel gradient
+					}
+				}
+			}
+		}
+	}
 
-							yInd = j*strideY + m - paddingY; // max[yInd] == (NINY-1)*strideY+kernelY - paddingY -1= 
-							xInd = i*strideX + n - paddingX;
+	// (4) Reduce the partial gradients in thread order
+	reducePartials(partials, kernelY, gradCols, kernelGrad, accumulate);
+}
+/* Parallelized deconvolution operation (in this library referred to as Anticonvolution), computed as a gather.
+*  Writes the flat result tensor to result like conv_.
+*/
+void antiConv_(const MATREF& in, const MATREF& kernel, fREAL* result, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features,
+	size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue) {
 
-							if (xInd >= 0 &&
-								yInd >= 0 &&
-								yInd < NOUTY	&&
-								xInd < NOUTX) { // Check we're not in the padding.
+	// (1) Geometry of the situation
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t kernelY = kernel.rows();
+	size_t kernelX = kernel.cols() / features;
+
+	// (2) View the result as a flat tensor with features stacked along x
+	MATMAP out(result, NOUTY, NOUTX*outChannels);
+	out.setZero();
+
+	// (3) Sub-pixel phases along y: output rows y = r + t*strideY only see the kernel rows m with (r + paddingY - m*dilationY) % strideY == 0,
+	// through input row j = t + shift with shift = (r + paddingY - m*dilationY) / strideY. Interior rows t in [tLo, tHi) need no checks.
+	struct Tap { size_t m; int32_t shift; };
+	static thread_local std::vector<std::vector<Tap>> callerTaps; // keeps its capacity, like rangeTables
+	std::vector<std::vector<Tap>>& phaseTaps = callerTaps; // the workers read the tables of the calling thread
+	if (phaseTaps.size() < strideY) {
+		countKernelBuffers(1);
+		phaseTaps.resize(strideY);
+	}
+	size_t* tLo = rangeTables(3, strideY);
+	size_t* tHi = tLo + strideY;
+	size_t* rowCount = tHi + strideY;
+	for (size_t r = 0; r < strideY; ++r) {
+		phaseTaps[r].clear();
+		rowCount[r] = r < NOUTY ? (NOUTY - r + strideY - 1) / strideY : 0;
+		int32_t lo = 0;
+		int32_t hi = rowCount[r];
+		for (size_t m = 0; m < kernelY; ++m) {
+			int32_t offset = (int32_t)(r + paddingY) - (int32_t)(m*dilationY);
+			if (((offset % (int32_t)strideY) + strideY) % strideY != 0)
+				continue;
+			int32_t shift = offset / (int32_t)strideY;
+			phaseTaps[r].push_back({ m, shift });
+			lo = std::max(lo, -shift);
+			hi = std::min(hi, (int32_t)NINY - shift);
+		}
+		tLo[r] = std::min<int32_t>(lo, rowCount[r]);
+		tHi[r] = std::max<int32_t>(tLo[r], hi);
+	}
 
-								out(yInd, xInd + outF*NOUTX) += kernel(m, n + f*kernelX) * in(j, i + inF*NINX);
+	// (4) Begin loop
+	int32_t item = 0;
+	size_t tiles = spatialTiles(outChannels, NOUTX);
+	size_t inPerGroup = inChannels / groups;
+	size_t outPerGroup = outChannels / groups;
+	const SimdKernels& simd = simdKernels();
+
+	/* Gather form: every output pixel collects the input pixels that reach it, instead of every input pixel scattering
+	*  into the output. Output column x only sees the taps n of its phase (x + paddingX - n*dilationX) % strideX == 0, output rows likewise,
+	*  so no taps are wasted for strides > 1 and output pixels are independent. The interior rows of a phase accumulate with the axpy microkernel.
+	*  Per output pixel the contributions are summed in the same order as by the scatter (inF, n, m).
+	*/
+	#pragma omp parallel for private(item) shared(out, kernel, in, phaseTaps, tLo, tHi, rowCount)
+	for (item = 0; item < outChannels*tiles; ++item) {
+		size_t outF = item / tiles;
+		size_t xBegin, xEnd;
+		tileRange(item % tiles, tiles, NOUTX, xBegin, xEnd);
+		size_t inBegin = groupBegin(outF, outChannels, groups, inPerGroup);
+		size_t outLocal = outF % outPerGroup; // position of outF in its group
+		// per-thread lists that keep their capacity between calls
+		static thread_local std::vector<std::pair<size_t, size_t>> columnTaps; // (n, i): input column i reaches x through tap n
+		static thread_local std::vector<fREAL> phaseRows; // interior rows of one phase, contiguous
+		phaseRows.resize(strideY > 1 ? NOUTY : 0);
+		for (size_t x = xBegin; x < xEnd; ++x) {
+			fREAL* outCol = &out(0, x + outF*NOUTX);
+			columnTaps.clear();
+			for (size_t n = 0; n < kernelX && n*dilationX <= x + paddingX; ++n) {
+				size_t i = (x + paddingX - n*dilationX) / strideX;
+				if ((x + paddingX - n*dilationX) % strideX == 0 && i < NINX)
+					columnTaps.push_back({ n, i });
+			}
+			for (size_t r = 0; r < strideY; ++r) {
+				const std::vector<Tap>& taps = phaseTaps[r];
+				// (a) interior - all taps in range. With stride 1 the rows of the phase are contiguous in the output.
+				size_t rows = tHi[r] - tLo[r];
+				if (rows > 0) {
+					fREAL* acc = strideY == 1 ? outCol + tLo[r] : phaseRows.data();
+					std::fill(acc, acc + rows, fREAL(0));
+					for (size_t inF = inBegin; inF < inBegin + inPerGroup; ++inF) {
+						size_t f = outLocal + inF*outPerGroup;
+						for (const std::pair<size_t, size_t>& c : columnTaps) {
+							const fREAL* inCol = in.data() + (c.second + inF*NINX)*in.outerStride() + tLo[r];
+							for (const Tap& tap : taps)
+								simd.axpy(rows, kernel(tap.m, c.first + f*kernelX), inCol + tap.shift, 1, acc);
+						}
+					}
+					if (strideY > 1) {
+						for (size_t u = 0; u < rows; ++u)
+							outCol[r + (tLo[r] + u)*strideY] = acc[u];
+					}
+				}
+				// (b) border - check we're not outside the input
+				for (size_t u = 0; u < rowCount[r]; ++u) {
+					if (u == tLo[r])
+						u = tHi[r];
+					if (u >= rowCount[r])
+						break;
+					fREAL acc = 0;
+					for (size_t inF = inBegin; inF < inBegin + inPerGroup; ++inF) {
+						size_t f = outLocal + inF*outPerGroup;
+						for (const std::pair<size_t, size_t>& c : columnTaps) {
+							const fREAL* inCol = in.data() + (c.second + inF*NINX)*in.outerStride();
+							for (const Tap& tap : taps) {
+								int32_t j = u + tap.shift;
+								if (j >= 0 && j < NINY)
+									acc += kernel(tap.m, c.first + f*kernelX) * inCol[j];
 							}
 						}
 					}
+					outCol[r + u*strideY] = acc;
 				}
 			}
+			epilogue(result, (x + outF*NOUTX)*NOUTY, (x + 1 + outF*NOUTX)*NOUTY);
 		}
 	}
-	return out;
 }
 
 
 
-MAT antiConvGrad_(const MAT& delta, const MAT& in, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
-	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels){
+/* Kernel gradient of antiConv_ (kernelY, kernelX*features) - into kernelGrad, or onto it if accumulate is set.
+*/
+void antiConvGrad_(const MATREF& delta, const MATREF& in, MAT& kernelGrad, bool accumulate, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups){
 	
 	// (1) Geometry of the situation
 	size_t NINY = in.rows();
@@ -232,43 +604,571 @@ MAT antiConvGrad_(const MAT& delta, const MAT& in, size_t kernelY, size_t kernel
 	size_t deltaY = delta.rows(); // deltaX = (NINX-kernelX+2*paddingX)/strideX +1 
 	size_t deltaX = delta.cols() / outChannels;
 
-	// (2) Allocate matrices 
-	MAT kernelGrad(kernelY, kernelX*features); // stack features along x in accord with convention
-	kernelGrad.setZero();
+	// (2) Allocate matrices - one partial gradient per thread, since tiles of one channel pair hit the same kernel taps
+	size_t gradCols = kernelX*features; // stack features along x in accord with convention
+	fREAL* partials = kernelPartials(kernelY, gradCols);
 
-	// (3) Begin loop
+	// (3) Begin loop over (out feature, input column tile) pairs
 	size_t f = 0;
-	int32_t outF = 0;
+	int32_t item = 0;
 	int32_t xInd = 0;
-	int32_t yInd = 0;
+	size_t tiles = spatialTiles(outChannels, NINX);
+	size_t inPerGroup = inChannels / groups;
+	size_t outPerGroup = outChannels / groups;
+	const SimdKernels& simd = simdKernels();
 
-	#pragma omp parallel for private(xInd, yInd,f, outF) shared(kernelGrad, delta, in)// Choose (probably) smallest rowwise loop size for parallelization.
-	for (outF = 0; outF < outChannels; ++outF) {
-		for (size_t inF = 0; inF < inChannels; ++inF) {
+	// Rows of the input that every kernel row j reaches: m*strideY + j*dilationY - paddingY in [0, deltaY)
+	size_t* mLo = rangeTables(2, kernelY);
+	size_t* mHi = mLo + kernelY;
+	for (size_t j = 0; j < kernelY; ++j)
+		validRange(j*dilationY, paddingY, strideY, deltaY, NINY, mLo[j], mHi[j]);
+
+	#pragma omp parallel for schedule(static) private(xInd, f, item) shared(partials, delta, in, mLo, mHi)
+	for (item = 0; item < outChannels*tiles; ++item) {
+		size_t outF = item / tiles;
+		size_t nBegin, nEnd;
+		tileRange(item % tiles, tiles, NINX, nBegin, nEnd);
+		MATMAP partial(partials + omp_get_thread_num()*kernelY*gradCols, kernelY, gradCols);
+		size_t inBegin = groupBegin(outF, outChannels, groups, inPerGroup);
+		size_t outLocal = outF % outPerGroup;
+		for (size_t inF = inBegin; inF < inBegin + inPerGroup; ++inF) {
 			//f = inF + outF*inChannels; // max[f] = outChannels-1 + (inChannels-1)*outChannels = inChannels*outChannels -1
-			f = outF + inF*outChannels; // max[f] = outChannels-1 + (inChannels-1)*outChannels = inChannels*outChannels -1
+			f = outLocal + inF*outPerGroup; // max[f] = outPerGroup-1 + (inChannels-1)*outPerGroup = features-1
 
-			for (size_t n = 0; n < NINX; ++n) {
+			for (size_t n = nBegin; n < nEnd; ++n) {
 				for (size_t i = 0; i < kernelX; ++i) {
-					for (size_t m = 0; m < NINY; ++m) {
-						for (size_t j = 0; j < kernelY; ++j) { // Eigen matrices are stored in column-major order.
-							yInd = j + m*strideY - paddingY;
-							xInd = i + n*strideX - paddingX; // max [xInd] = (kernelX-1)+ (deltaX-1)*strideX = (kernelX-1)+ (NINX-kernelX+2*paddingX) = NINX+2*paddingX-1 -> correct
+					xInd = i*dilationX + n*strideX - paddingX; // max [xInd] = (kernelX-1)+ (deltaX-1)*strideX = (kernelX-1)+ (NINX-kernelX+2*paddingX) = NINX+2*paddingX-1 -> correct
+					if (xInd < 0 || xInd >= deltaX) // padded border column
+						continue;
+					fREAL* gradCol = &partial(0, i + f*kernelX);
+					const fREAL* deltaCol = delta.data() + (xInd + outF*deltaX)*delta.outerStride();
+					const fREAL* inCol = in.data() + (n + inF*NINX)*in.outerStride();
+					for (size_t j = 0; j < kernelY; ++j) { // gradCol[j] += sum_m inCol[m] * deltaCol[m*strideY + j*dilationY - paddingY]
+						if (mLo[j] < mHi[j])
+							gradCol[j] += simd.dot(mHi[j] - mLo[j], inCol + mLo[j], deltaCol + mLo[j] * strideY + j*dilationY - paddingY, strideY);
+					}
+				}
+			}
+		}
+	}
+	// (4) Reduce the partial gradients in thread order
+	reducePartials(partials, kernelY, gradCols, kernelGrad, accumulate);
+}
+/* Depthwise convolution: channel c of the output only sees channel c of the input, through its own kernel (column c of kernels).
+*  Same loop structure as conv_ with a single channel pair per work item. The flat result tensor goes to result.
+*/
+void depthwiseConv_(const MATREF& in, const MATREF& kernels, fREAL* result, size_t kernelY, size_t kernelX, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX,
+	size_t paddingY, size_t paddingX, size_t channels) {
+
+	// (1) Geometry of the situation
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / channels;
 
-							if (yInd < deltaY &&
-								yInd >= 0 &&
-								xInd < deltaX &&
-								xInd >= 0) { // Check we're not in the padding.
+	// (2) View the result as a flat tensor
+	MATMAP out(result, NOUTY, NOUTX*channels);
+	out.setZero();
 
-								kernelGrad(j, i + f*kernelX) += delta(yInd, xInd + outF*deltaX) * in(m, n + inF*NINX);
-							}
+	// (3) Begin loop over (channel, column tile) pairs
+	int32_t item = 0;
+	int32_t xInd = 0;
+	size_t tiles = spatialTiles(channels, NOUTX);
+	const SimdKernels& simd = simdKernels();
+
+	#pragma omp parallel for private(xInd, item) shared(out, kernels, in)
+	for (item = 0; item < channels*tiles; ++item) {
+		size_t c = item / tiles;
+		size_t iBegin, iEnd;
+		tileRange(item % tiles, tiles, NOUTX, iBegin, iEnd);
+		const fREAL* kernel = kernels.data() + c*kernels.outerStride();
+		for (size_t i = iBegin; i < iEnd; ++i) {
+			fREAL* outCol = &out(0, i + c*NOUTX);
+			for (size_t n = 0; n < kernelX; ++n) {
+				xInd = i*strideX + n - paddingX;
+				if (xInd < 0 || xInd >= NINX) // padded border column
+					continue;
+				const fREAL* inCol = in.data() + (xInd + c*NINX)*in.outerStride();
+				for (size_t m = 0; m < kernelY; ++m) {
+					size_t jLo, jHi;
+					validRange(m, paddingY, strideY, NINY, NOUTY, jLo, jHi);
+					if (jLo < jHi) // outCol[j] += w * inCol[j*strideY + m - paddingY]
+						simd.axpy(jHi - jLo, kernel[m + n*kernelY], inCol + jLo*strideY + m - paddingY, strideY, outCol + jLo);
+				}
+			}
+		}
+	}
+}
+/* Transposed depthwise convolution (delta propagation), NINY x NINX is the plane of the layer input.
+*  Work items own columns of the result and gather the delta columns that reach them; along y the delta is scattered,
+*  with the axpy microkernel for stride 1. The flat delta below goes to result.
+*/
+void depthwiseAntiConv_(const MATREF& delta, const MATREF& kernels, fREAL* result, size_t kernelY, size_t kernelX, size_t NINY, size_t NINX, size_t strideY, size_t strideX,
+	size_t paddingY, size_t paddingX, size_t channels) {
+
+	// (1) Geometry of the situation
+	size_t deltaY = delta.rows();
+	size_t deltaX = delta.cols() / channels;
+
+	// (2) View the result as a flat tensor
+	MATMAP out(result, NINY, NINX*channels);
+	out.setZero();
+
+	// (3) Begin loop over (channel, input column tile) pairs
+	int32_t item = 0;
+	size_t tiles = spatialTiles(channels, NINX);
+	const SimdKernels& simd = simdKernels();
+
+	// Delta rows j that reach the plane through kernel row m: j*strideY + m - paddingY in [0, NINY)
+	size_t* jLo = rangeTables(2, kernelY);
+	size_t* jHi = jLo + kernelY;
+	for (size_t m = 0; m < kernelY; ++m)
+		validRange(m, paddingY, strideY, NINY, deltaY, jLo[m], jHi[m]);
+
+	#pragma omp parallel for private(item) shared(out, kernels, delta, jLo, jHi)
+	for (item = 0; item < channels*tiles; ++item) {
+		size_t c = item / tiles;
+		size_t xBegin, xEnd;
+		tileRange(item % tiles, tiles, NINX, xBegin, xEnd);
+		const fREAL* kernel = kernels.data() + c*kernels.outerStride();
+		for (size_t x = xBegin; x < xEnd; ++x) {
+			fREAL* outCol = &out(0, x + c*NINX);
+			// delta column i reaches x through tap n: i*strideX + n - paddingX = x
+			for (size_t n = (x + paddingX) % strideX; n < kernelX && n <= x + paddingX; n += strideX) {
+				size_t i = (x + paddingX - n) / strideX;
+				if (i >= deltaX)
+					continue;
+				const fREAL* deltaCol = delta.data() + (i + c*deltaX)*delta.outerStride();
+				for (size_t m = 0; m < kernelY; ++m) {
+					fREAL w = kernel[m + n*kernelY];
+					if (jLo[m] >= jHi[m])
+						continue;
+					if (strideY == 1) {
+						simd.axpy(jHi[m] - jLo[m], w, deltaCol + jLo[m], 1, outCol + jLo[m] + m - paddingY);
+					} else {
+						for (size_t j = jLo[m]; j < jHi[m]; ++j)
+							outCol[j*strideY + m - paddingY] += w * deltaCol[j];
+					}
+				}
+			}
+		}
+	}
+}
+/* Gradient of the depthwise kernels - (kernelY*kernelX, channels) like the kernels.
+*  Column c goes to kernelGrad + c*ld (the kernels may be a block of a larger matrix), or is added there if accumulate is set.
+*/
+void depthwiseConvGrad_(const MATREF& in, const MATREF& delta, fREAL* kernelGrad, size_t ld, bool accumulate, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX,
+	size_t paddingY, size_t paddingX, size_t channels) {
+
+	// (1) Geometry of the situation
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / channels;
+	size_t deltaY = delta.rows();
+	size_t deltaX = delta.cols() / channels;
+
+	// (2) Allocate matrices - one partial gradient per thread, since tiles of one channel hit the same kernel taps
+	size_t taps = kernelY*kernelX;
+	fREAL* partials = kernelPartials(taps, channels);
+
+	// (3) Begin loop over (channel, delta column tile) pairs
+	int32_t item = 0;
+	int32_t xInd = 0;
+	size_t tiles = spatialTiles(channels, deltaX);
+	const SimdKernels& simd = simdKernels();
+
+	// Rows of the delta that every kernel row m reaches: j*strideY + m - paddingY in [0, NINY)
+	size_t* jLo = rangeTables(2, kernelY);
+	size_t* jHi = jLo + kernelY;
+	for (size_t m = 0; m < kernelY; ++m)
+		validRange(m, paddingY, strideY, NINY, deltaY, jLo[m], jHi[m]);
+
+	#pragma omp parallel for schedule(static) private(xInd, item) shared(partials, delta, in, jLo, jHi)
+	for (item = 0; item < channels*tiles; ++item) {
+		size_t c = item / tiles;
+		size_t iBegin, iEnd;
+		tileRange(item % tiles, tiles, deltaX, iBegin, iEnd);
+		fREAL* grad = partials + (omp_get_thread_num()*channels + c)*taps;
+		for (size_t i = iBegin; i < iEnd; ++i) {
+			const fREAL* deltaCol = delta.data() + (i + c*deltaX)*delta.outerStride();
+			for (size_t n = 0; n < kernelX; ++n) {
+				xInd = i*strideX + n - paddingX;
+				if (xInd < 0 || xInd >= NINX) // padded border column
+					continue;
+				const fREAL* inCol = in.data() + (xInd + c*NINX)*in.outerStride();
+				for (size_t m = 0; m < kernelY; ++m) { // grad[m,n] += sum_j deltaCol[j] * inCol[j*strideY + m - paddingY]
+					if (jLo[m] < jHi[m])
+						grad[m + n*kernelY] += simd.dot(jHi[m] - jLo[m], deltaCol + jLo[m], inCol + jLo[m] * strideY + m - paddingY, strideY);
+				}
+			}
+		}
+	}
+	// (4) Reduce the partial gradients in thread order
+	reducePartials(partials, taps, channels, Map<MAT, 0, OuterStride<>>(kernelGrad, taps, channels, OuterStride<>(ld)), accumulate);
+}
+/* Lower the input into a column buffer (im2col), so that convolutions become matrix products.
+*  cols has shape (NOUTY*NOUTX, kernelY*kernelX*inChannels). Row j + i*NOUTY is output pixel (j,i).
+*  Column m + n*kernelY + inF*kernelY*kernelX holds what kernel tap (m,n) of in-channel inF sees (dilated taps are spread apart in the input).
+*  This is the memory order of one row of kernels in the kernel matrix, so no kernel copies are needed.
+*/
+void im2col_(const MATREF& in, MAT& cols, size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t inChannels) {
+	// Allocate the buffer only if the geometry changed
+	cols.resize(NOUTY*NOUTX, kernelY*kernelX*inChannels);
+	im2colAt_(in, cols.data(), NOUTY*NOUTX, NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, dilationY, dilationX, paddingY, paddingX, inChannels);
+}
+// Column r of the buffer starts at cols + r*ld - ld > NOUTY*NOUTX leaves room for the blocks of other samples.
+void im2colAt_(const MATREF& in, fREAL* cols, size_t ld, size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t inChannels) {
+
+	// (1) Geometry of the situation
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t taps = kernelY*kernelX;
+
+	// (2) Begin loop
+	int32_t r = 0;
+	int32_t xInd = 0;
+	int32_t yInd = 0;
+
+	/* Parallelize over columns of the buffer.
+	* Every column is a contiguous block of memory.
+	*/
+	#pragma omp parallel for private(xInd, yInd, r) shared(cols, in)
+	for (r = 0; r < taps*inChannels; ++r) {
+		size_t inF = r / taps;
+		size_t n = (r % taps) / kernelY;
+		size_t m = r % kernelY;
+		fREAL* col = cols + r*ld;
+		for (size_t i = 0; i < NOUTX; ++i) {
+			xInd = i*strideX + n*dilationX - paddingX;
+			if (xInd < 0 || xInd >= NINX) { // whole column of the output lies in the padding
+				for (size_t j = 0; j < NOUTY; ++j) {
+					col[j + i*NOUTY] = 0.0f;
+				}
+				continue;
+			}
+			const fREAL* inCol = in.data() + (xInd + inF*NINX)*in.outerStride(); // spatial columns are contiguous
+			for (size_t j = 0; j < NOUTY; ++j) {
+				yInd = j*strideY + m*dilationY - paddingY;
+				col[j + i*NOUTY] = (yInd >= 0 && yInd < NINY) ? inCol[yInd] : 0.0f;
+			}
+		}
+	}
+}
+/* Convolution as a single matrix product (same contract as conv_).
+*  The kernels of out-channel outF are contiguous in memory, so the kernel matrix
+*  maps onto a (kernelY*kernelX*inChannels/groups, outChannels) matrix without copying.
+*  Channel groups multiply their own block of buffer columns with their own block of out-channels.
+*/
+void convIm2col_(const MATREF& in, const MATREF& kernel, fREAL* result, MAT& cols, size_t NOUTY, size_t NOUTX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups, const ConvEpilogue& epilogue) {
+
+	size_t kernelY = kernel.rows();
+	size_t kernelX = kernel.cols() / features;
+
+	im2col_(in, cols, NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, dilationY, dilationX, paddingY, paddingX, inChannels);
+
+	size_t depth = kernelY*kernelX*inChannels / groups; // buffer columns of one group
+	size_t outPerGroup = outChannels / groups;
+	MATMAP outMap(result, NOUTY*NOUTX, outChannels); // flat tensor, one plane per out-channel
+	MATMAP_CONST kernelMap(kernel.data(), depth, outChannels);
+	for (size_t g = 0; g < groups; ++g) {
+		outMap.middleCols(g*outPerGroup, outPerGroup).noalias() = cols.middleCols(g*depth, depth) * kernelMap.middleCols(g*outPerGroup, outPerGroup);
+	}
+
+	int32_t outF = 0;
+	#pragma omp parallel for private(outF) shared(result)
+	for (outF = 0; outF < outChannels; ++outF) {
+		epilogue(result, outF*NOUTY*NOUTX, (outF + 1)*NOUTY*NOUTX);
+	}
+}
+/* Kernel gradient as a single matrix product (same contract as convGrad_).
+*/
+void convGradIm2col_(const MATREF& in, const MATREF& delta, MAT& kernelGrad, bool accumulate, MAT& cols, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t features, size_t outChannels, size_t inChannels, size_t groups) {
+
+	size_t deltaY = delta.rows();
+	size_t deltaX = delta.cols() / outChannels;
+
+	im2col_(in, cols, deltaY, deltaX, kernelY, kernelX, strideY, strideX, dilationY, dilationX, paddingY, paddingX, inChannels);
+
+	size_t depth = kernelY*kernelX*inChannels / groups;
+	size_t outPerGroup = outChannels / groups;
+	if (!accumulate)
+		kernelGrad.resize(kernelY, kernelX*features); // stack features along x in accord with convention
+	MATMAP gradMap(kernelGrad.data(), depth, outChannels);
+	MATMAP_CONST deltaMap(delta.data(), deltaY*deltaX, outChannels); // tensor views are contiguous
+	for (size_t g = 0; g < groups; ++g) {
+		if (accumulate)
+			gradMap.middleCols(g*outPerGroup, outPerGroup).noalias() += cols.middleCols(g*depth, depth).transpose() * deltaMap.middleCols(g*outPerGroup, outPerGroup);
+		else
+			gradMap.middleCols(g*outPerGroup, outPerGroup).noalias() = cols.middleCols(g*depth, depth).transpose() * deltaMap.middleCols(g*outPerGroup, outPerGroup);
+	}
+}
+/* Kernel gradient of the samples [first, first+count) of a flat (NIN,B) batch in one matrix product.
+*  The im2col blocks of the samples are stacked along the rows of cols and their deltas along the rows of deltas,
+*  so the product sums over the samples. Both buffers need at least count*NOUTY*NOUTX rows.
+*  kernelGrad (kernelY, kernelX*features) is overwritten, or added to if accumulate is set.
+*/
+void convGradIm2colBatch_(const MAT& input, const MAT& delta, size_t first, size_t count, MAT& cols, MAT& deltas, MAT& kernelGrad, bool accumulate,
+	size_t NINY, size_t NINX, size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX,
+	size_t paddingY, size_t paddingX, size_t /*features*/, size_t outChannels, size_t inChannels, size_t groups) {
+
+	size_t pixels = NOUTY*NOUTX;
+	size_t rows = count*pixels;
+	assert(cols.rows() >= rows && cols.cols() == kernelY*kernelX*inChannels);
+	assert(deltas.rows() >= rows && deltas.cols() == outChannels);
+	for (size_t s = 0; s < count; ++s) {
+		im2colAt_(tensorView(input, NINY, NINX, inChannels, first + s), cols.data() + s*pixels, cols.rows(), NOUTY, NOUTX, kernelY, kernelX,
+			strideY, strideX, dilationY, dilationX, paddingY, paddingX, inChannels);
+		deltas.middleRows(s*pixels, pixels) = MATMAP_CONST(delta.col(first + s).data(), pixels, outChannels);
+	}
+
+	size_t depth = kernelY*kernelX*inChannels / groups;
+	size_t outPerGroup = outChannels / groups;
+	MATMAP gradMap(kernelGrad.data(), depth, outChannels);
+	for (size_t g = 0; g < groups; ++g) {
+		if (accumulate)
+			gradMap.middleCols(g*outPerGroup, outPerGroup).noalias() += cols.topRows(rows).middleCols(g*depth, depth).transpose() * deltas.topRows(rows).middleCols(g*outPerGroup, outPerGroup);
+		else
+			gradMap.middleCols(g*outPerGroup, outPerGroup).noalias() = cols.topRows(rows).middleCols(g*depth, depth).transpose() * deltas.topRows(rows).middleCols(g*outPerGroup, outPerGroup);
+	}
+}
+/* Winograd minimal filtering F(2x2,3x3) for stride-1 convolutions with 3x3 kernels.
+*  Every 2x2 output tile is computed from a 4x4 input tile with 16 instead of 36 multiplications per channel pair:
+*  Y = A^T [ sum_inF (G g G^T) .* (B^T d B) ] A
+*  The elementwise products are batched over all tiles into 16 matrix products (tiles x inChannels) * (inChannels x outChannels).
+*  workspace is a caller-owned buffer for the transformed kernels, the transformed input and the products. It only grows,
+*  so forward and delta propagation of a layer share it without reallocating. The flat result tensor goes to result like with conv_.
+*/
+void convWinograd_(const MATREF& in, const MATREF& kernel, fREAL* result, MAT& workspace, size_t NOUTY, size_t NOUTX, size_t paddingY, size_t paddingX,
+	size_t outChannels, size_t inChannels, const ConvEpilogue& epilogue) {
+	assert(kernel.rows() == 3 && kernel.cols() == 3 * outChannels*inChannels);
+
+	// (1) Geometry of the situation
+	size_t NINY = in.rows();
+	size_t NINX = in.cols() / inChannels;
+	size_t ld = in.outerStride();
+	size_t tilesY = (NOUTY + 1) / 2;
+	size_t tilesX = (NOUTX + 1) / 2;
+	size_t tiles = tilesY*tilesX;
+	size_t ldT = (tiles + 15) / 16 * 16; // The transforms stream through 16 columns at once. Avoid strides of multiples of 4 kB.
+	if ((ldT*sizeof(fREAL)) % 4096 == 0)
+		ldT += 16;
+
+	// (2) Transform kernels: U(inF, outF + xi*outChannels) = (G g G^T)[xi]
+	size_t transformed = ldT * 16 * (inChannels + outChannels); // V and M
+	if (static_cast<size_t>(workspace.size()) < transformed + 16 * inChannels*outChannels) {
+		countKernelBuffers(1);
+		workspace.resize(transformed + 16 * inChannels*outChannels, 1);
+	}
+	MATMAP U(workspace.data() + transformed, inChannels, 16 * outChannels);
+	for (size_t outF = 0; outF < outChannels; ++outF) {
+		for (size_t inF = 0; inF < inChannels; ++inF) {
+			size_t f = inF + outF*inChannels;
+			fREAL Gg[4][3]; // G g
+			for (size_t n = 0; n < 3; ++n) {
+				fREAL g0 = kernel(0, n + 3 * f), g1 = kernel(1, n + 3 * f), g2 = kernel(2, n + 3 * f);
+				Gg[0][n] = g0;
+				Gg[1][n] = 0.5f*(g0 + g1 + g2);
+				Gg[2][n] = 0.5f*(g0 - g1 + g2);
+				Gg[3][n] = g2;
+			}
+			for (size_t a = 0; a < 4; ++a) { // (G g) G^T
+				U(inF, outF + (4 * a + 0) * outChannels) = Gg[a][0];
+				U(inF, outF + (4 * a + 1) * outChannels) = 0.5f*(Gg[a][0] + Gg[a][1] + Gg[a][2]);
+				U(inF, outF + (4 * a + 2) * outChannels) = 0.5f*(Gg[a][0] - Gg[a][1] + Gg[a][2]);
+				U(inF, outF + (4 * a + 3) * outChannels) = Gg[a][2];
+			}
+		}
+	}
+
+	// (3) Transform input tiles: V(tile, inF + xi*inChannels) = (B^T d B)[xi]
+	MATMAP V(workspace.data(), ldT, 16 * inChannels);
+	MATMAP M(workspace.data() + ldT * 16 * inChannels, ldT, 16 * outChannels);
+	size_t strideV = inChannels*ldT; // distance between tile elements xi
+	int32_t inF = 0;
+	#pragma omp parallel for private(inF) shared(V, in)
+	for (inF = 0; inF < inChannels; ++inF) {
+		const fREAL* inPlane = in.data() + inF*NINX*ld;
+		for (size_t tx = 0; tx < tilesX; ++tx) {
+			for (size_t ty = 0; ty < tilesY; ++ty) {
+				int32_t y0 = 2 * ty - paddingY;
+				int32_t x0 = 2 * tx - paddingX;
+				fREAL d[4][4];
+				if (y0 >= 0 && x0 >= 0 && y0 + 4 <= NINY && x0 + 4 <= NINX) { // interior tile
+					for (size_t b = 0; b < 4; ++b)
+						for (size_t a = 0; a < 4; ++a)
+							d[a][b] = inPlane[(y0 + a) + (x0 + b)*ld];
+				} else { // border tile - zero padding
+					for (size_t b = 0; b < 4; ++b) {
+						for (size_t a = 0; a < 4; ++a) {
+							int32_t y = y0 + a;
+							int32_t x = x0 + b;
+							d[a][b] = (y >= 0 && x >= 0 && y < NINY && x < NINX) ? inPlane[y + x*ld] : 0;
 						}
 					}
 				}
+				fREAL Bd[4][4]; // B^T d
+				for (size_t b = 0; b < 4; ++b) {
+					Bd[0][b] = d[0][b] - d[2][b];
+					Bd[1][b] = d[1][b] + d[2][b];
+					Bd[2][b] = d[2][b] - d[1][b];
+					Bd[3][b] = d[1][b] - d[3][b];
+				}
+				fREAL* tile = &V(ty + tx*tilesY, inF);
+				for (size_t a = 0; a < 4; ++a) { // (B^T d) B
+					tile[(4 * a + 0) * strideV] = Bd[a][0] - Bd[a][2];
+					tile[(4 * a + 1) * strideV] = Bd[a][1] + Bd[a][2];
+					tile[(4 * a + 2) * strideV] = Bd[a][2] - Bd[a][1];
+					tile[(4 * a + 3) * strideV] = Bd[a][1] - Bd[a][3];
+				}
 			}
 		}
 	}
-	return kernelGrad;
+
+	// (4) Reduce over in-channels: one matrix product per tile element
+	for (size_t xi = 0; xi < 16; ++xi) {
+		M.block(0, xi*outChannels, tiles, outChannels).noalias() = V.block(0, xi*inChannels, tiles, inChannels)*U.middleCols(xi*outChannels, outChannels);
+	}
+
+	// (5) Inverse transform into the output tiles - every output pixel is written
+	MATMAP out(result, NOUTY, NOUTX*outChannels);
+	size_t strideM = outChannels*ldT;
+	int32_t outF = 0;
+	#pragma omp parallel for private(outF) shared(out, M)
+	for (outF = 0; outF < outChannels; ++outF) {
+		for (size_t tx = 0; tx < tilesX; ++tx) {
+			for (size_t ty = 0; ty < tilesY; ++ty) {
+				const fREAL* tile = &M(ty + tx*tilesY, outF);
+				fREAL AM[2][4]; // A^T m
+				for (size_t b = 0; b < 4; ++b) {
+					fREAL m0 = tile[(0 + b) * strideM];
+					fREAL m1 = tile[(4 + b) * strideM];
+					fREAL m2 = tile[(8 + b) * strideM];
+					fREAL m3 = tile[(12 + b) * strideM];
+					AM[0][b] = m0 + m1 + m2;
+					AM[1][b] = m1 - m2 - m3;
+				}
+				for (size_t a = 0; a < 2 && 2 * ty + a < NOUTY; ++a) { // (A^T m) A, cropped at odd output sizes
+					out(2 * ty + a, 2 * tx + outF*NOUTX) = AM[a][0] + AM[a][1] + AM[a][2];
+					if (2 * tx + 1 < NOUTX)
+						out(2 * ty + a, 2 * tx + 1 + outF*NOUTX) = AM[a][1] - AM[a][2] - AM[a][3];
+				}
+			}
+		}
+		epilogue(result, outF*NOUTY*NOUTX, (outF + 1)*NOUTY*NOUTX);
+	}
+}
+/* Kernel of the adjoint convolution: rotate every kernel by 180 degrees and swap the roles of in- and out-channels.
+*  With stride 1, antiConv_(in, kernel, ..., padding) equals a convolution with the flipped kernel and padding kernel-1-padding.
+*  flipped is only reallocated if the geometry changed.
+*/
+void flipKernel_(const MATREF& kernel, MAT& flipped, size_t kernelY, size_t kernelX, size_t outChannels, size_t inChannels) {
+	if (flipped.rows() != kernelY || flipped.cols() != kernelX*outChannels*inChannels)
+		flipped = kernelBuffer(kernelY, kernelX*outChannels*inChannels);
+	for (size_t outF = 0; outF < outChannels; ++outF) {
+		for (size_t inF = 0; inF < inChannels; ++inF) {
+			size_t f = inF + outF*inChannels;
+			size_t fT = outF + inF*outChannels;
+			for (size_t n = 0; n < kernelX; ++n) {
+				for (size_t m = 0; m < kernelY; ++m) {
+					flipped(kernelY - 1 - m, kernelX - 1 - n + fT*kernelX) = kernel(m, n + f*kernelX);
+				}
+			}
+		}
+	}
+}
+static const size_t maxBufferBytes = 128 * 1024 * 1024; // bound of the im2col and Winograd workspaces
+
+/* im2col + GEMM if the column buffer is of reasonable size, the direct loops otherwise.
+*  The GEMM beats the direct loops even for single channels, as long as the output is not tiny.
+*  The column buffer holds kernelY*kernelX copies of the input, so we bound its size.
+*/
+static convalgo_t gemmOrDirect(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t inChannels) {
+	size_t depth = kernelY*kernelX*inChannels; // inner dimension of the matrix product
+	size_t bufferBytes = NOUTY*NOUTX*depth*sizeof(fREAL);
+
+	if (NOUTY*NOUTX >= 16 && bufferBytes <= maxBufferBytes) {
+		return convalgo_t::im2colConv;
+	} else {
+		return convalgo_t::directConv;
+	}
+}
+/* The Winograd workspace holds 16 transformed values per 2x2 output tile and channel (in and out) - bounded like the column buffer.
+*/
+static bool winogradFits(size_t NOUTY, size_t NOUTX, size_t outChannels, size_t inChannels) {
+	size_t tiles = ((NOUTY + 1) / 2)*((NOUTX + 1) / 2);
+	return tiles * 16 * (inChannels + outChannels)*sizeof(fREAL) <= maxBufferBytes;
+}
+/* Choose the execution path of a convolution for a given geometry.
+*  3x3 kernels with stride 1 use Winograd unless its workspace is too large, large stride-1 kernels the FFT engine (see FFTConvolution).
+*  With few features the specialized direct kernels (selectConvKernel) beat the matrix product.
+*  Dilated and grouped kernels only run on the direct loops and im2col + GEMM.
+*/
+convalgo_t selectConvAlgorithm(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t outChannels, size_t inChannels, size_t groups) {
+	static const size_t maxSpecializedFeatures = 16;
+	bool dense = dilationY == 1 && dilationX == 1 && groups == 1;
+	if (dense && kernelY == 3 && kernelX == 3 && strideY == 1 && strideX == 1) {
+		return winogradFits(NOUTY, NOUTX, outChannels, inChannels) ? convalgo_t::winogradConv : gemmOrDirect(NOUTY, NOUTX, kernelY, kernelX, inChannels);
+	} else if (dense && strideY == 1 && strideX == 1 && fftConvCheaper(NOUTY, NOUTX, kernelY, kernelX, outChannels, inChannels, false)) {
+		return convalgo_t::fftConv;
+	} else if (selectConvKernel(kernelY, kernelX, strideY, strideX) != &conv_ && outChannels*inChannels / groups <= maxSpecializedFeatures) {
+		return convalgo_t::directConv;
+	} else {
+		return gemmOrDirect(NOUTY, NOUTX, kernelY, kernelX, inChannels);
+	}
+}
+/* Winograd has no gradient path - kernel gradients choose between FFT, im2col + GEMM and the direct loops.
+*/
+convalgo_t selectConvGradAlgorithm(size_t NOUTY, size_t NOUTX, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t outChannels, size_t inChannels, size_t groups) {
+	if (dilationY == 1 && dilationX == 1 && groups == 1 && strideY == 1 && strideX == 1 && fftConvCheaper(NOUTY, NOUTX, kernelY, kernelX, outChannels, inChannels, true)) {
+		return convalgo_t::fftConv;
+	} else {
+		return gemmOrDirect(NOUTY, NOUTX, kernelY, kernelX, inChannels);
+	}
+}
+/* Winograd is F(2x2,3x3) without a gradient path, the FFT engine covers stride 1 only. Neither handles dilated or grouped kernels.
+*/
+bool convAlgorithmSupported(convalgo_t algorithm, bool kernelGradient, size_t kernelY, size_t kernelX, size_t strideY, size_t strideX, size_t dilationY, size_t dilationX, size_t groups) {
+	bool unitStride = strideY == 1 && strideX == 1 && dilationY == 1 && dilationX == 1 && groups == 1;
+	switch (algorithm) {
+	case convalgo_t::directConv:
+	case convalgo_t::im2colConv:
+		return true;
+	case convalgo_t::winogradConv:
+		return !kernelGradient && unitStride && kernelY == 3 && kernelX == 3;
+	case convalgo_t::fftConv:
+		return unitStride;
+	default:
+		return false;
+	}
+}
+/* Rough cost model of the FFT engine against the direct loops for stride 1 (unit: one direct multiply-add).
+*  smallY, smallX is the smaller of input and output plane - the one the direct loops run over.
+*  Forward passes transform each channel once, kernel gradients need an inverse transform per feature.
+*/
+bool fftConvCheaper(size_t smallY, size_t smallX, size_t kernelY, size_t kernelX, size_t outChannels, size_t inChannels, bool kernelGradient) {
+	static const double transformCost = 1.6; // per point and log2(points) of a 2D transform
+	static const double productCost = 1.4; // per point and feature of the spectral products
+	size_t features = outChannels*inChannels;
+	double direct = double(smallY*smallX)*kernelY*kernelX*features;
+
+	size_t PY = kernelGradient ? 2 * smallY + 2 * kernelY : smallY + 2 * kernelY; // the padded planes
+	size_t PX = kernelGradient ? 2 * smallX + 2 * kernelX : smallX + 2 * kernelX;
+	double points = double(PY)*PX;
+	size_t transforms = kernelGradient ? inChannels + outChannels + features : inChannels + outChannels;
+	double fft = transformCost*transforms*points*log2(points) + productCost*features*points;
+	return fft < direct;
+}
+void readConvOptions(ifstream& in, size_t& dilationY, size_t& dilationX, size_t& groups) {
+	string rest;
+	getline(in, rest);
+	istringstream line(rest);
+	if (!(line >> dilationY >> dilationX)) {
+		dilationY = 1;
+		dilationX = 1;
+	}
+	if (!(line >> groups))
+		groups = 1;
 }
 /* Spectral norm function
 *  Calculate the spectral norm of u,v
@@ -8,60 +8,172 @@
 #include "FullyConnectedLayer.h"
 #include "MaxPoolLayer.h"
 #include "PassOnLayer.h"
+#include "SimdKernels.h"
+#include <set>
+#include <mutex>
 
 /* CNet LIBRARY FUNCTIONS 
 */
 
-bool sameCNet(CNet* ptr) {
-	// save ptr
-	static CNet* ptrCache = NULL;
-
-	if (ptr != ptrCache) {
-		ptrCache = ptr;
-		return false;
-	} else {
-		return true;
+/* Handle table of the live nets
+*  initializeCNet registers a net, destroyCNet takes it out and deletes it - handles that are not (or no longer) live are ignored there.
+*  A net that still lends layers (shareLayer) to a live net is only retired: its handle is dead at once, but it is deleted
+*  with the last net that borrows from it.
+*  Every other export that takes a net checks the handle as well (also in release builds): it does nothing for a dead one
+*  and returns DEAD_HANDLE_ERROR, or 0 (layers, misses), where it returns a value.
+*  Linking is up to each net (CNet::ensureLinked), so switching between nets costs nothing unless the chain changed.
+*/
+static std::set<CNet*> liveCNets;
+static std::set<CNet*> retiredCNets; // destroyed, but their layers are still in use by a live net
+static std::mutex liveCNetsLock;
+
+CNet* registerCNet(CNet* ptr) {
+	std::lock_guard<std::mutex> lock(liveCNetsLock);
+	liveCNets.insert(ptr);
+	return ptr;
+}
+// Take the handle out and delete every retired net no live net borrows from any more
+void releaseCNet(CNet* ptr) {
+	std::lock_guard<std::mutex> lock(liveCNetsLock);
+	if (liveCNets.erase(ptr) == 0)
+		return;
+	retiredCNets.insert(ptr);
+	for (std::set<CNet*>::iterator it = retiredCNets.begin(); it != retiredCNets.end();) {
+		bool lent = false;
+		for (CNet* live : liveCNets)
+			lent = lent || (*it)->lendsTo(*live);
+		if (lent) {
+			++it;
+		} else {
+			delete *it; // never dereferences the layers it borrowed itself
+			it = retiredCNets.erase(it);
+		}
 	}
-	
+}
+bool isLiveCNet(CNet* ptr) {
+	std::lock_guard<std::mutex> lock(liveCNetsLock);
+	return liveCNets.count(ptr) > 0;
+}
+// Returned by the exports that report an error when a handle is not live
+const fREAL DEAD_HANDLE_ERROR = -1.0f;
+// Returned by backPropCNetBatch for a training mode the net does not support (normalization with Hogwild)
+const fREAL UNSUPPORTED_MODE_ERROR = -2.0f;
+// Called before propagating through a net from the DLL - false, and nothing done, if the handle is not live
+bool prepareCNet(CNet* ptr) {
+	if (!isLiveCNet(ptr))
+		return false;
+	ptr->ensureLinked();
+	return true;
 }
 typedef std::shared_ptr<CNet> CNETPTR;
 __declspec(dllexport) void __stdcall initializeCNet(CNet** ptr, uint32_t NIN){
-	*ptr = new CNet(NIN);
+	*ptr = registerCNet(new CNet(NIN));
+}
+
+// Input of channels planes with NINY rows and NINX columns each
+__declspec(dllexport) void __stdcall initializeRectangularCNet(CNet** ptr, uint32_t NINY, uint32_t NINX, uint32_t channels) {
+	*ptr = registerCNet(new CNet(NINY, NINX, channels));
 }
 
 __declspec(dllexport) void __stdcall addFullyConnectedLayer(CNet* ptr, uint32_t NOUT, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addFullyConnectedLayer(NOUT, static_cast<actfunc_t>(func));
 }
 __declspec(dllexport) void __stdcall addConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addConvolutionalLayer(NOUTXY, kernelXY, stride,  outChannels, inChannels, static_cast<actfunc_t>(func));
 }
 __declspec(dllexport) void __stdcall addAntiConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addAntiConvolutionalLayer(NOUTXY, kernelXY, stride, outChannels, inChannels, static_cast<actfunc_t>(func));
 }
+// Kernel taps spread dilation pixels apart - the layer sees a (kernelXY-1)*dilation+1 wide window with kernelXY*kernelXY weights
+__declspec(dllexport) void __stdcall addDilatedConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t dilation, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addConvolutionalLayer(NOUTXY, kernelXY, stride, outChannels, inChannels, static_cast<actfunc_t>(func), dilation);
+}
+__declspec(dllexport) void __stdcall addDilatedAntiConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t dilation, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addAntiConvolutionalLayer(NOUTXY, kernelXY, stride, outChannels, inChannels, static_cast<actfunc_t>(func), dilation);
+}
+// Channels split into groups, out-channels only see the in-channels of their group - groups has to divide both channel counts
+__declspec(dllexport) void __stdcall addGroupedConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t groups, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addConvolutionalLayer(NOUTXY, kernelXY, stride, outChannels, inChannels, static_cast<actfunc_t>(func), 1, groups);
+}
+__declspec(dllexport) void __stdcall addGroupedAntiConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t groups, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addAntiConvolutionalLayer(NOUTXY, kernelXY, stride, outChannels, inChannels, static_cast<actfunc_t>(func), 1, groups);
+}
+// Rectangular output planes, kernels and strides (Y = rows, X = columns) - the input planes follow from the layer below
+__declspec(dllexport) void __stdcall addRectangularConvolutionalLayer(CNet* ptr, uint32_t NOUTY, uint32_t NOUTX, uint32_t kernelY, uint32_t kernelX, uint32_t strideY, uint32_t strideX,
+	uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addConvolutionalLayer(NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, outChannels, inChannels, static_cast<actfunc_t>(func));
+}
+__declspec(dllexport) void __stdcall addRectangularAntiConvolutionalLayer(CNet* ptr, uint32_t NOUTY, uint32_t NOUTX, uint32_t kernelY, uint32_t kernelX, uint32_t strideY, uint32_t strideX,
+	uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addAntiConvolutionalLayer(NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, outChannels, inChannels, static_cast<actfunc_t>(func));
+}
+__declspec(dllexport) void __stdcall addSeparableConvolutionalLayer(CNet* ptr, uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addSeparableConvolutionalLayer(NOUTXY, kernelXY, stride, outChannels, inChannels, static_cast<actfunc_t>(func));
+}
+__declspec(dllexport) void __stdcall addRectangularSeparableConvolutionalLayer(CNet* ptr, uint32_t NOUTY, uint32_t NOUTX, uint32_t kernelY, uint32_t kernelX, uint32_t strideY, uint32_t strideX,
+	uint32_t inChannels, uint32_t outChannels, uint32_t func) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addSeparableConvolutionalLayer(NOUTY, NOUTX, kernelY, kernelX, strideY, strideX, outChannels, inChannels, static_cast<actfunc_t>(func));
+}
 __declspec(dllexport) void __stdcall addMaxPoolLayer(CNet* ptr, uint32_t maxOverXY, uint32_t channels) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addPoolingLayer(maxOverXY, channels, pooling_t::max);
 }
+__declspec(dllexport) void __stdcall addRectangularMaxPoolLayer(CNet* ptr, uint32_t maxOverY, uint32_t maxOverX, uint32_t channels) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->addPoolingLayer(maxOverY, maxOverX, channels, pooling_t::max);
+}
 __declspec(dllexport) void __stdcall addPassOnLayer(CNet* ptr, uint32_t function) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addPassOnLayer(static_cast<actfunc_t>(function));
 } 
 __declspec(dllexport) void __stdcall addReshapeLayer(CNet* ptr) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addReshape();
 }
 __declspec(dllexport) void __stdcall addSideChannel(CNet* ptr, uint32_t sideChannelSize) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addSideChannel(sideChannelSize);
 }
 __declspec(dllexport) void __stdcall addDropoutLayer(CNet* ptr, fREAL ratio) {
+	if (!isLiveCNet(ptr))
+		return;
 	 ptr->addDropoutLayer(ratio);
 }
 __declspec(dllexport) void __stdcall addGaussianReparametrization(CNet* ptr) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addGaussianReparametrization();
 }
 __declspec(dllexport) fREAL __stdcall forwardCNet(CNet* ptr, fREAL* const input, fREAL* const output, int32_t* const inFormat, int32_t* const outFormat) {
-	// if change of CNet instance, relink the chain
-
-	if (!sameCNet(ptr)) {
-		ptr->linkChain();
-	}
+	if (!prepareCNet(ptr)) // relinks only if the chain changed
+		return DEAD_HANDLE_ERROR;
 
 	assert(ptr->getNOUT() == outFormat[0]*outFormat[1]);
 	assert(ptr->getNIN() == inFormat[0]*inFormat[1]);
@@ -85,10 +197,8 @@ __declspec(dllexport) fREAL __stdcall backPropCNet(CNet* ptr, fREAL* const input
 	uint32_t* const weight_norm, uint32_t* const spectral_norm, uint32_t* const firstTrain, uint32_t* const lastTrain, int32_t* const inFormat, 
 	int32_t* const outFormat, uint32_t* const deltaProvided) {
 	
-	// if change of CNet instance, relink the chain
-	if (! sameCNet(ptr)) {
-		ptr->linkChain();
-	}
+	if (!prepareCNet(ptr)) // relinks only if the chain changed
+		return DEAD_HANDLE_ERROR;
 	bool deltaProvided_bool = false;
 	if (*deltaProvided == 1) {
 		deltaProvided_bool = true;
@@ -114,8 +224,110 @@ __declspec(dllexport) fREAL __stdcall backPropCNet(CNet* ptr, fREAL* const input
 	return error;
 }
 
+/* BATCHED FORWARD AND BACK
+*  batchSize samples lie back to back in input and output, each one a row-major (format[0], format[1]) array as above.
+*  The whole batch travels through the chain as one (N, batchSize) matrix and the returned error is the one of the batch.
+*/
+// Each row-major sample is transposed straight into its column - no intermediate copies.
+MAT batchFromRowMajor(const fREAL* const data, const int32_t* const format, uint32_t batchSize) {
+	size_t N = format[0] * format[1];
+	MAT batch(N, batchSize);
+	for (uint32_t s = 0; s < batchSize; ++s) {
+		MATMAP(batch.col(s).data(), format[0], format[1]) = MATMAP_CONST(data + s*N, format[1], format[0]).transpose();
+	}
+	return batch;
+}
+void batchToRowMajor(const MAT& batch, fREAL* const data, const int32_t* const format) {
+	size_t N = format[0] * format[1];
+	for (size_t s = 0; s < batch.cols(); ++s) {
+		MATMAP(data + s*N, format[1], format[0]) = MATMAP_CONST(batch.col(s).data(), format[0], format[1]).transpose();
+	}
+}
+__declspec(dllexport) fREAL __stdcall forwardCNetBatch(CNet* ptr, uint32_t batchSize, fREAL* const input, fREAL* const output, int32_t* const inFormat, int32_t* const outFormat) {
+	if (!prepareCNet(ptr)) // relinks only if the chain changed
+		return DEAD_HANDLE_ERROR;
+
+	assert(ptr->getNOUT() == outFormat[0] * outFormat[1]);
+	assert(ptr->getNIN() == inFormat[0] * inFormat[1]);
+
+	MAT inputMatrix = batchFromRowMajor(input, inFormat, batchSize); // (NIN, batchSize) Matrix
+	MAT outputDesiredMatrix = batchFromRowMajor(output, outFormat, batchSize); // (NOUT, batchSize) Matrix
+
+	fREAL error = ptr->forProp(inputMatrix, outputDesiredMatrix, false);
+	batchToRowMajor(inputMatrix, output, outFormat);
+	return error;
+}
+// Concurrent inference - every calling loop owns one context and may run inferCNet on any net at the same time as the others.
+// Training calls (backPropCNet etc.) on the same net must not overlap with inferCNet.
+__declspec(dllexport) void __stdcall createInferenceContext(InferenceContext** ctx) {
+	*ctx = new InferenceContext();
+}
+__declspec(dllexport) void __stdcall destroyInferenceContext(InferenceContext* ctx) {
+	delete ctx;
+}
+__declspec(dllexport) void __stdcall feedInferenceSideChannel(InferenceContext* ctx, fREAL* const sideChannelArray, int32_t* const format) {
+	MAT sideChannelMatrix = MATMAP_ROWMAJOR(sideChannelArray, format[0], format[1]);
+	sideChannelMatrix.resize(format[0] * format[1], 1);
+	ctx->preFeedSideChannel(sideChannelMatrix);
+}
+__declspec(dllexport) fREAL __stdcall inferCNet(CNet* ptr, InferenceContext* ctx, uint32_t batchSize, fREAL* const input, fREAL* const output, int32_t* const inFormat, int32_t* const outFormat) {
+	if (!isLiveCNet(ptr))
+		return DEAD_HANDLE_ERROR;
+	// no relinking - the chain is not touched by infer
+	assert(ptr->getNOUT() == outFormat[0] * outFormat[1]);
+	assert(ptr->getNIN() == inFormat[0] * inFormat[1]);
+
+	MAT inputMatrix = batchFromRowMajor(input, inFormat, batchSize); // (NIN, batchSize) Matrix
+	MAT outputDesiredMatrix = batchFromRowMajor(output, outFormat, batchSize); // (NOUT, batchSize) Matrix
+
+	fREAL error = ptr->infer(inputMatrix, outputDesiredMatrix, *ctx);
+	batchToRowMajor(inputMatrix, output, outFormat);
+	return error;
+}
+__declspec(dllexport) fREAL __stdcall backPropCNetBatch(CNet* ptr, uint32_t batchSize, fREAL* const input, fREAL* const output, fREAL* const eta,
+	fREAL* const clip, fREAL* const gamma, fREAL* const lambda, uint32_t* const rmsprop, uint32_t* const adam, uint32_t* const batch_update,
+	uint32_t* const weight_norm, uint32_t* const spectral_norm, uint32_t* const firstTrain, uint32_t* const lastTrain, int32_t* const inFormat,
+	int32_t* const outFormat, uint32_t* const deltaProvided) {
+
+	if (!prepareCNet(ptr)) // relinks only if the chain changed
+		return DEAD_HANDLE_ERROR;
+	bool deltaProvided_bool = *deltaProvided == 1;
+	if (ptr->isAsynchronous() && (*weight_norm != 0 || *spectral_norm != 0))
+		return UNSUPPORTED_MODE_ERROR; // Hogwild steps the shared W directly
+
+	// batch_update != 0 keeps accumulating over further batches before the step is taken
+	learnPars pars(*eta, *clip, *gamma, *lambda, *rmsprop, *adam, *batch_update, *weight_norm, *spectral_norm, *firstTrain, *lastTrain, true);
+
+	assert(ptr->getNOUT() == outFormat[0] * outFormat[1]);
+	assert(ptr->getNIN() == inFormat[0] * inFormat[1]);
+
+	MAT inputMatrix = batchFromRowMajor(input, inFormat, batchSize); // (NIN, batchSize) Matrix
+	MAT outputDesiredMatrix = batchFromRowMajor(output, outFormat, batchSize); // (NOUT, batchSize) Matrix
+	fREAL error = ptr->isAsynchronous() ? ptr->backPropHogwild(inputMatrix, outputDesiredMatrix, pars, deltaProvided_bool)
+		: ptr->backPropParallel(inputMatrix, outputDesiredMatrix, pars, deltaProvided_bool); // sequential for a single worker
+
+	// The predictions go back into the outgoing array.
+	batchToRowMajor(outputDesiredMatrix, output, outFormat);
+	return error;
+}
+
+// Split the batches of backPropCNetBatch over workers replicas of the net (data-parallel, 1 = sequential)
+__declspec(dllexport) void __stdcall setTrainingWorkers(CNet* ptr, uint32_t workers) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->setWorkers(workers);
+}
+// 1: the workers of backPropCNetBatch train asynchronously (Hogwild, one step per sample), 0: synchronous data-parallel steps
+__declspec(dllexport) void __stdcall setAsynchronousTraining(CNet* ptr, uint32_t asynchronous) {
+	if (!isLiveCNet(ptr))
+		return;
+	ptr->setAsynchronous(asynchronous == 1);
+}
+
 __declspec(dllexport) fREAL __stdcall forward_VAE(CNet* ptr_enc, CNet* ptr_dec, uint32_t validate, fREAL* const Y_, fREAL* const X_, int32_t* const Y_format, int32_t* const X_format)
 {
+	if (!isLiveCNet(ptr_enc) || !isLiveCNet(ptr_dec))
+		return DEAD_HANDLE_ERROR;
 	// (0) map the matrices --------------------------------------------------------------------------------------
 	MAT X = MATMAP_ROWMAJOR(X_, X_format[0], X_format[1]);
 	MAT Y = MATMAP_ROWMAJOR(Y_, Y_format[0], Y_format[1]);
@@ -131,6 +343,7 @@ __declspec(dllexport) fREAL __stdcall forward_VAE(CNet* ptr_enc, CNet* ptr_dec,
 		Z_tilde.unaryExpr(&std_normal);
 		ptr_enc->preFeedSideChannel(Z_tilde);
 		
+		prepareCNet(ptr_enc);
 		ptr_enc->forProp(Z, Z_target, false);
 		// Z contains latent space
 	}
@@ -143,6 +356,7 @@ __declspec(dllexport) fREAL __stdcall forward_VAE(CNet* ptr_enc, CNet* ptr_dec,
 	// (2) forprop the decoder -----------------------------------------------------------------------------------
 	ptr_dec->preFeedSideChannel(Z);
 	MAT X_HAT(Y);
+	prepareCNet(ptr_dec);
 	fREAL err = ptr_dec->forProp(X_HAT, X, false);
 	// X_HAT contains the input prediction
 
@@ -160,6 +374,8 @@ __declspec(dllexport) fREAL __stdcall train_FB_VAE(CNet* ptr_enc, CNet* ptr_dec,
 	fREAL eta_VAE, fREAL eta_forw, uint32_t batch_update, uint32_t weight_norm, uint32_t spectral_norm, int32_t* const Y_format,
 	int32_t* const X_format)
 {
+	if (!isLiveCNet(ptr_enc) || !isLiveCNet(ptr_dec) || !isLiveCNet(ptr_forw))
+		return DEAD_HANDLE_ERROR;
 	// (0) Initialize learning structures etc
 	bool batch_is_due = batch_update == 0;
 	learnPars pars_vae(eta_VAE, 0.0f, 0.9, 0.0f, true, false, batch_update, weight_norm, false, 0, 99, true);
@@ -188,6 +404,7 @@ __declspec(dllexport) fREAL __stdcall train_FB_VAE(CNet* ptr_enc, CNet* ptr_dec,
 	if (batch_is_due)
 		pars_forw.batch_update = 0;
 	MAT Y_temp(Y);
+	prepareCNet(ptr_forw);
 	ptr_forw->backProp(X, Y_temp, pars_forw);
 	
 	if (batch_is_due)
@@ -214,6 +431,7 @@ __declspec(dllexport) fREAL __stdcall train_FB_VAE(CNet* ptr_enc, CNet* ptr_dec,
 	MAT x_diff = move(beta*(X_HAT - X));
 	x_diff.resize(x_diff.size(), 1);
 	x_diff = move(x_diff + delta_f);
+	prepareCNet(ptr_dec);
 	ptr_dec->backProp(Y, x_diff, pars_vae, true);
 	// get the delta out of the sidechannel
 	MAT delta_dec(ptr_dec->getSideChannelSize(), 1);
@@ -221,6 +439,7 @@ __declspec(dllexport) fREAL __stdcall train_FB_VAE(CNet* ptr_enc, CNet* ptr_dec,
 	
 	// (4) backprop through the encoder --------------------------------------------------------------------------------
 	// we need to make sure the side channel of the encoder still
+	prepareCNet(ptr_enc);
 	ptr_enc->backProp(Y, delta_dec, pars_vae, true);
 
 	return y_reconstruction_err;
@@ -229,6 +448,8 @@ __declspec(dllexport) fREAL __stdcall train_FB_VAE(CNet* ptr_enc, CNet* ptr_dec,
 __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL* const X, fREAL* const Y, 
 	uint32_t prepGen, uint32_t handOverLayer, fREAL* D_REAL_ERR, fREAL* D_FAKE_ERR, fREAL eta_D, fREAL eta_G, fREAL clip, fREAL gamma, fREAL lambda, uint32_t rmsprop, uint32_t adam, uint32_t batch_update,
 	uint32_t weight_norm, uint32_t spectral_norm, uint32_t firstTrain, uint32_t lastTrain, int32_t* const xFormat, int32_t* const yFormat, uint32_t int_GEN_TO_SIDECHANNEL) {
+	if (!isLiveCNet(ptr_D) || !isLiveCNet(ptr_G))
+		return;
 
 	// Make a choice if the generator feeds into a side channel of the discriminator 
 	// or if the conditional variable Y feeds into the side channel instead.
@@ -252,7 +473,8 @@ __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL
 	if(pars.spectral_normalization)
 		 pars.weight_normalization = false;
 	//pars.firstTrain = 0; // UNDOOOOOOOOOOOOOOOOOOO
-	//ptr_D->linkChain(); // relink the chain
+	// Each net is prepared before its turn - this only relinks if the nets share layers.
+	prepareCNet(ptr_D);
 
 	// (1) Train D real =====================================================================
 
@@ -278,6 +500,7 @@ __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL
 	Z.setRandom().unaryExpr(&abs<fREAL>);
 	ptr_G->preFeedSideChannel(Z);
 	MAT G_Sample(y_matrix);
+	prepareCNet(ptr_G);
 	ptr_G->forProp(G_Sample, x_matrix, false); // G_Sample contains the generator sample
 
 	// (3) Train D fake =====================================================================
@@ -286,6 +509,7 @@ __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL
 
 	if (batchIsDue) // undo the change to batch_update 
 		pars.batch_update = 0;
+	prepareCNet(ptr_D);
 	
 	if (GEN_TO_SIDECHANNEL) {
 		MAT D_FAKE_Y(y_matrix); // Y copy - expensive
@@ -303,7 +527,9 @@ __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL
 		Z.setRandom().unaryExpr(&abs<fREAL>); // map to [0,1]
 		ptr_G->preFeedSideChannel(Z);
 		G_Sample = y_matrix;
+		prepareCNet(ptr_G);
 		ptr_G->forProp(G_Sample, x_matrix, true); // New Gen sample, SAVE = true!
+		prepareCNet(ptr_D);
 		
 		MAT D_G_RES(1, 1);
 		if (GEN_TO_SIDECHANNEL) {
@@ -330,7 +556,7 @@ __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL
 		pars.weight_normalization = weight_norm;
 		pars.eta = eta_G;
 		//pars.firstTrain = 0; // UNDOOOOOOOOOOOOOOOOOOO
-		//ptr_G->linkChain();
+		prepareCNet(ptr_G);
 		ptr_G->backProp_GAN_G(y_matrix, deltas, pars); // backprop those deltas through G
 	}
 	// (5) Copy the G_sample into the X-Array ================================================
@@ -343,6 +569,8 @@ __declspec(dllexport) void __stdcall trainConGan(CNet* ptr_D, CNet* ptr_G, fREAL
 }
 
 __declspec(dllexport) void __stdcall feedSideChannel(CNet* ptr, fREAL* const sideChannelArray, int32_t* const format) {
+	if (!isLiveCNet(ptr))
+		return;
 
 	MAT sideChannelMatrix = MATMAP_ROWMAJOR(sideChannelArray, format[0], format[1]);
 	sideChannelMatrix.resize(format[0] * format[1], 1);
@@ -351,15 +579,18 @@ __declspec(dllexport) void __stdcall feedSideChannel(CNet* ptr, fREAL* const sid
 }
 
 __declspec(dllexport) void __stdcall addMixtureDensity(CNet* ptr, size_t NOUT, size_t features, size_t BlockXY) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->addMixtureDensity( NOUT,  features,  BlockXY);
 }
 __declspec(dllexport) void __stdcall debugMsg(CNet* ptr, fREAL* msg) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->debugMsg(msg);
 }
 __declspec(dllexport) uint32_t __stdcall initializeNetwork(CNet* ptr, uint32_t init, uint32_t batchSize, uint32_t* const wrongLayer) {
-	if (!sameCNet(ptr)) {
-		ptr->linkChain();
-	}
+	if (!prepareCNet(ptr))
+		return 0; // no layers
 	if (init > 0) {
 		ptr->initToUnitVariance(batchSize);
 	}
@@ -368,55 +599,94 @@ __declspec(dllexport) uint32_t __stdcall initializeNetwork(CNet* ptr, uint32_t i
 	return ptr->getLayerNumber();
 }
 __declspec(dllexport) void __stdcall saveCNet(CNet* ptr, char* filePath) {
-	if (!sameCNet(ptr)) {
-		ptr->linkChain();
-	}
+	if (!prepareCNet(ptr))
+		return;
 
 	ptr->saveToFile(string(filePath));
 }
+// Pick the fastest convolution path per layer - filePath is the tuning cache (empty: time every layer, keep nothing).
+__declspec(dllexport) uint32_t __stdcall tuneCNet(CNet* ptr, char* filePath, uint32_t repetitions) {
+	if (!isLiveCNet(ptr))
+		return 0; // no layers timed
+	return ptr->tune(string(filePath), repetitions); // relinks the chain
+}
 __declspec(dllexport) void __stdcall loadCNet(CNet* ptr, char* filePath) {
-
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->loadFromFile(string(filePath));
 
-	sameCNet(ptr); // store ptr 
-	ptr->linkChain(); // relink chain regardless
+	prepareCNet(ptr); // loading marks the chain for relinking
 	
 }
 __declspec(dllexport) void __stdcall loadCNet_layer(CNet* ptr, uint32_t layer, char* filePath) {
-	
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->loadFromFile_layer(string(filePath), layer);
 
-	sameCNet(ptr); // store ptr
-	ptr->linkChain();// relink chain regardless
+	prepareCNet(ptr); // loading marks the chain for relinking
 
 }
 
 __declspec(dllexport) void __stdcall destroyCNet(CNet* ptr) {
-	ptr->~CNet();
+	releaseCNet(ptr);
 }
 // share-Layer functionality which enables dynamical switching
 __declspec(dllexport) void __stdcall shareLayer(CNet* ptr, CNet* ptrOther, uint32_t firstLayer, uint32_t lastLayer) {
+	if (!isLiveCNet(ptr) || !isLiveCNet(ptrOther))
+		return;
 	ptr->shareLayers(ptrOther, firstLayer, lastLayer);
 }
-__declspec(dllexport) void __stdcall writeLayer(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* toCopyToFormat) {
+// Caller-owned activations and deltas - bind a workspace per net before its passes so shared layers keep the state of each net.
+// A null workspace returns the net to the layers' own storage. Unbind all nets from a workspace before destroying it.
+__declspec(dllexport) void __stdcall createExecutionWorkspace(ExecutionWorkspace** ws) {
+	*ws = new ExecutionWorkspace();
+}
+__declspec(dllexport) void __stdcall destroyExecutionWorkspace(ExecutionWorkspace* ws) {
+	delete ws;
+}
+__declspec(dllexport) void __stdcall bindExecutionWorkspace(CNet* ptr, ExecutionWorkspace* ws) {
+	if (!isLiveCNet(ptr))
+		return;
+	if (ws)
+		ptr->bindWorkspace(*ws);
+	else
+		ptr->unbindWorkspace();
+}
+// Heap buffers the training steps allocated so far - by the step arena and by the convolution kernels. Stops growing once the steps reuse their buffers.
+__declspec(dllexport) uint32_t __stdcall getArenaMisses(CNet* ptr) {
+	if (!isLiveCNet(ptr))
+		return 0;
+	return static_cast<uint32_t>(ptr->getArenaMisses());
+}
+__declspec(dllexport) void __stdcall writeLayer(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* /*toCopyToFormat*/) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->copyNthLayer(layer, toCopyTo);
 }
-__declspec(dllexport) void __stdcall getActivation(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* toCopyToFormat) {
+__declspec(dllexport) void __stdcall getActivation(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* /*toCopyToFormat*/) {
+	if (!isLiveCNet(ptr))
+		return;
 	ptr->copyNthActivation(layer, toCopyTo);
 }
 __declspec(dllexport) void __stdcall getDelta(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* const toCopyToFormat) {
+	if (!isLiveCNet(ptr))
+		return;
 	//MAT test(1, 1);
 	//test.setZero();
 	//copyToOut(test.data(), toCopyTo, 1);
 	ptr->copyNthDelta(layer, toCopyTo, (toCopyToFormat[0]* toCopyToFormat[1]));
 }
-__declspec(dllexport) void __stdcall getWeight(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* const toCopyToFormat) {
+__declspec(dllexport) void __stdcall getWeight(CNet* ptr, uint32_t layer, fREAL* const toCopyTo, int32_t* const /*toCopyToFormat*/) {
+	if (!isLiveCNet(ptr))
+		return;
 	//MAT test(1, 1);
 	//test.setZero();
 	//copyToOut(test.data(), toCopyTo, 1);
 	ptr->copyNthLayer(layer, toCopyTo);
 }
 __declspec(dllexport) void __stdcall getLayerDimension(CNet* ptr, uint32_t layer, uint32_t* rows, uint32_t* cols) {
+	if (!isLiveCNet(ptr))
+		return;
 	size_t rows_ = 0;
 	size_t cols_ = 0;
 	ptr->inquireDimensions(layer, rows_, cols_);
@@ -424,12 +694,30 @@ __declspec(dllexport) void __stdcall getLayerDimension(CNet* ptr, uint32_t layer
 	*cols = cols_;
 }
 __declspec(dllexport) void __stdcall setLayer(CNet* ptr, uint32_t layer, fREAL* const copyFrom, int32_t* const format) {
+	if (!isLiveCNet(ptr))
+		return;
 	MAT newLayer = MATMAP_ROWMAJOR(copyFrom, format[0], format[1]); // is newLayer now a row major matrix? or is the input just mapped in a row-major way?
 	ptr->setNthLayer(layer, newLayer);
 }
 __declspec(dllexport) uint32_t __stdcall test() {
 	return 0;
 }
+/* Benchmark of the direct convolution kernels at every instruction set level (scalar, AVX2, AVX-512).
+*  times receives (3 levels x 4 kernels: conv, antiConv, convGrad, antiConvGrad) row by row in ms, -1 where the CPU lacks the level.
+*  Returns the level selected at load time.
+*/
+__declspec(dllexport) uint32_t __stdcall benchmarkConvolutionISA(uint32_t NOUTXY, uint32_t kernelXY, uint32_t stride, uint32_t inChannels, uint32_t outChannels, uint32_t repetitions, fREAL* const times) {
+	MAT result = benchmarkISA(NOUTXY, kernelXY, stride, inChannels, outChannels, repetitions);
+	MATMAP_ROWMAJOR(times, result.rows(), result.cols()) = result;
+	return simdKernels().isa;
+}
+/* Benchmark of sequential, data-parallel and Hogwild training on a random FC regression task.
+*  results receives (3 modes x 2: ms per epoch, final error) row by row.
+*/
+__declspec(dllexport) void __stdcall benchmarkTrainingModes(uint32_t NIN, uint32_t hidden, uint32_t NOUT, uint32_t samples, uint32_t batchSize, uint32_t workers, uint32_t epochs, fREAL eta, fREAL* const results) {
+	MAT result = benchmarkTrainingModes(NIN, hidden, NOUT, samples, batchSize, workers, epochs, eta);
+	MATMAP_ROWMAJOR(results, result.rows(), result.cols()) = result;
+}
 /* DEPRECATED HOLONET Stuff **************************************************************************************************************
 
 